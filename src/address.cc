@@ -0,0 +1,126 @@
+#include "address.h"
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "capture.h"
+#include "omnis.h"
+#include "sniffer.h"
+
+int address_monitor_open() {
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0) {
+        fprintf(g_log, "Could not open netlink socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(g_log, "Could not bind netlink socket: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    int groups[] = {RTNLGRP_IPV4_IFADDR, RTNLGRP_IPV6_IFADDR};
+    for (int group : groups) {
+        if (setsockopt(fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group,
+                       sizeof(group)) < 0) {
+            fprintf(g_log, "Could not join netlink group %d: %s\n", group,
+                    strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+
+    return fd;
+}
+
+/* Reads the local addresses of the named device again, or of every device if
+ * name is NULL. The any device holds the addresses of every interface, so it
+ * is read again on any change. Workers on the same device share it and are
+ * next to each other in g_captures. */
+static void refresh_devices(const char *name) {
+    struct device *last = NULL;
+    for (struct capture *capture : g_captures) {
+        struct device *device = capture->device;
+        if (device == last) continue;
+        last = device;
+
+        if (name != NULL && strcmp(device->name, name) != 0 &&
+            strcmp(device->name, "any") != 0)
+            continue;
+
+        /* Only this thread replaces the set, so it can be read without
+         * entering a read section. */
+        if (refresh_local_ip_addresses(device))
+            fprintf(g_log, "Local addresses of %s changed, it now has %zu\n",
+                    device->name, device->local_ips.load()->len);
+    }
+}
+
+void address_monitor_loop() {
+    int fd = address_monitor_open();
+    if (fd < 0) {
+        fprintf(g_log,
+                "Local addresses will not be updated when they change\n");
+        return;
+    }
+
+    /* Addresses may have changed between the captures being opened and
+     * joining the groups. */
+    refresh_devices(NULL);
+
+    alignas(struct nlmsghdr) char buffer[16384];
+    while (1) {
+        ssize_t len = recv(fd, buffer, sizeof(buffer), 0);
+        if (len < 0) {
+            if (errno == EINTR) continue;
+
+            /* Too many changes at once overflowed the socket, we no longer
+             * know which devices changed. */
+            if (errno == ENOBUFS) {
+                refresh_devices(NULL);
+                continue;
+            }
+
+            fprintf(g_log, "Reading address changes from netlink failed: %s\n",
+                    strerror(errno));
+            break;
+        }
+
+        /* A single read can hold many changes to the same interface */
+        std::vector<unsigned int> changed;
+        for (struct nlmsghdr *message = (struct nlmsghdr *)buffer;
+             NLMSG_OK(message, len); message = NLMSG_NEXT(message, len)) {
+            if (message->nlmsg_type != RTM_NEWADDR &&
+                message->nlmsg_type != RTM_DELADDR)
+                continue;
+
+            struct ifaddrmsg *ifaddr = (struct ifaddrmsg *)NLMSG_DATA(message);
+            if (std::find(changed.begin(), changed.end(),
+                          ifaddr->ifa_index) == changed.end())
+                changed.push_back(ifaddr->ifa_index);
+        }
+
+        for (unsigned int index : changed) {
+            char name[IF_NAMESIZE];
+            if (if_indextoname(index, name) == NULL) continue;
+
+            refresh_devices(name);
+        }
+    }
+
+    close(fd);
+}
@@ -0,0 +1,20 @@
+#ifndef ADDRESS_H
+#define ADDRESS_H
+
+/* Local addresses change while omnis runs, through DHCP renewals, VPNs coming
+ * up or going down and addresses added to containers. A netlink socket joined
+ * to the RTNLGRP_IPV4_IFADDR and RTNLGRP_IPV6_IFADDR groups is told whenever
+ * an address is added or removed, and the local addresses of the interface it
+ * belongs to are then read again and published. Capture threads pick up the
+ * new set on their next packet, and rebuild their filter on their next
+ * batch. */
+
+/* Opens the netlink socket subscribed to address changes. Returns the socket,
+ * or -1 on failure with the reason written to g_log. */
+int address_monitor_open();
+
+/* Keeps the local addresses of every device in g_captures current. Never
+ * returns unless reading from netlink fails. */
+void address_monitor_loop();
+
+#endif
@@ -8,20 +8,36 @@
 #include <cstring>
 #include <ctime>
 
+/* Traffic counters accumulated over a single database interval. Only ever
+ * written by one capture thread, each sits on a cache line of its own so
+ * accounting a packet touches exactly one. */
+struct alignas(64) traffic {
+    unsigned long long pkt_rx;   /* packets received in bytes */
+    unsigned long long pkt_tx;   /* packets transmitted in bytes */
+    unsigned long long pkt_rx_c; /* number of packets received */
+    unsigned long long pkt_tx_c; /* number of packets transmitted */
+    unsigned long long pkt_tcp;  /* number of tcp packets */
+    unsigned long long pkt_udp;  /* number of udp packets */
+};
+
 struct application {
-    int id;                    /* database application id */
-    pid_t pid;                 /* pid directory for application */
-    char name[16];             /* application name (pruned process cmdline) */
-    unsigned long long pkt_rx; /* packets received in bytes */
-    unsigned long long pkt_tx; /* packets transmitted in bytes */
-    int pkt_rx_c;              /* number of packets received */
-    int pkt_tx_c;              /* number of packets transmitted */
-    int pkt_tcp;               /* number of tcp packets */
-    int pkt_udp;               /* number of udp packets */
-    time_t start_time;         /* timestamp for when application detected */
+    int id;                      /* database application id */
+    unsigned int index;          /* position in g_applications */
+    pid_t pid;                   /* pid directory for application */
+    char name[16];               /* application name (pruned process cmdline) */
+    unsigned long long pkt_rx;   /* packets received in bytes */
+    unsigned long long pkt_tx;   /* packets transmitted in bytes */
+    unsigned long long pkt_rx_c; /* number of packets received */
+    unsigned long long pkt_tx_c; /* number of packets transmitted */
+    unsigned long long pkt_tcp;  /* number of tcp packets */
+    unsigned long long pkt_udp;  /* number of udp packets */
+    time_t start_time;           /* timestamp for when application detected */
+    double var_rx;               /* variance of rx bytes due to sampling */
+    double var_tx;               /* variance of tx bytes due to sampling */
 
     application(const char *comm) {
         id = 0;
+        index = 0;
         pkt_rx = 0;
         pkt_tx = 0;
         pkt_rx_c = 0;
@@ -29,6 +45,8 @@ struct application {
         pkt_tcp = 0;
         pkt_udp = 0;
         pid = 0;
+        var_rx = 0;
+        var_tx = 0;
         strncpy(name, comm, 16);
         start_time = std::time(NULL);
     }
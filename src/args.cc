@@ -1,5 +1,6 @@
 #include "args.h"
 
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <stdexcept>
@@ -7,6 +8,9 @@
 #include <string_view>
 #include <vector>
 
+#include "capture.h"
+#include "packet.h"
+
 void print_help() {
     printf("Usage: omnis [OPTIONS]...");
     printf("\nNetwork monitoring daemon & cli application.");
@@ -26,6 +30,66 @@ void print_help() {
     printf(
         "\n  --daemon            \tUsed to launch initial daemon process to "
         "monitor traffic");
+    printf(
+        "\n  -I, --interface [name]\tCapture on this interface, can be given "
+        "multiple times.");
+    printf(
+        "\n                        Defaults to every interface that is up and "
+        "has an address");
+    printf(
+        "\n  --snaplen [profile] \tBytes of each packet to capture. Options: "
+        "headers, full, or an integer. Default: headers");
+    printf(
+        "\n  --no-filter         \tDon't filter out ignored packets in the "
+        "kernel before they are captured");
+    printf(
+        "\n  --batch-size [int]  \tPackets accounted at once by each capture "
+        "thread. Default: 64");
+    printf(
+        "\n  --batch-latency [int]\tMilliseconds a packet may wait in a "
+        "batch before being accounted. Default: 100");
+    printf(
+        "\n  --pending-flows [int]\tFlows each capture holds on to while "
+        "their socket is unknown. Default: 4096");
+    printf(
+        "\n  --trace-sockets     \tTrace which process owns each socket with "
+        "BPF programs on the root cgroup");
+    printf(
+        "\n  --sample [int|auto] \tOnly account 1 in N packets, scaling their "
+        "counts by N. auto starts at 1");
+    printf(
+        "\n                        and raises N while packets are being "
+        "dropped. Default: 1");
+    printf(
+        "\n  --workers [int]     \tCapture workers per interface, packets are "
+        "spread over them by flow. Default: 1");
+    printf(
+        "\n  --cpus [list]       \tPin capture workers to these cpus round "
+        "robin. Example: --cpus 0,2,4-7");
+    printf(
+        "\n  --capture [backend] \tPacket capture backend to use. Options: "
+        "pcap, ring, xdp. Default: pcap");
+    printf(
+        "\n  --ring-size [int]   \tSize of the ring capture buffer in MiB. "
+        "Default: 64");
+    printf(
+        "\n  --block-timeout [int]\tMilliseconds before a partially filled "
+        "ring block is handed over. Default: 100");
+    printf(
+        "\n  --xdp-mode [mode]   \tMode to attach the xdp capture program in. "
+        "Options: generic, native. Default: generic");
+    printf(
+        "\n  --replay [file]     \tReplay a recorded pcap file through the "
+        "packet accounting and report its throughput, then exit");
+    printf(
+        "\n  --fixture [file]    \tPacket hash to application mappings used "
+        "by --replay instead of a /proc snapshot");
+    printf(
+        "\n  --bench-proc [file] \tBenchmark parsing a /proc/net table such "
+        "as /proc/net/tcp, then exit");
+    printf(
+        "\n  --check-trace-sockets\tCheck that --trace-sockets finds the "
+        "owners of loopback sockets, then exit");
     printf("\nCLI Arguments:\n");
     printf("If no arguments provided, will default to 1 day timeframe.\n");
     printf(
@@ -43,14 +107,44 @@ void print_help() {
     printf(
         "\n  --show [int]        \tSpecify how many rows on the table will be "
         "shown, truncating the rest. Defaults to showing all rows.");
+    printf(
+        "\n  -I, --interface [name]\tOnly sum traffic that went over this "
+        "interface, can be given multiple times.");
     printf(
         "\n  --historical [name] \tPerform a historical account of a single "
         "application by name, showing data usage in blocks of a specified time "
         "gap, such as days");
 }
 
+int parse_cpu_list(const std::string &list, std::vector<int> *cpus) {
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t comma = list.find(',', pos);
+        if (comma == std::string::npos) comma = list.size();
+
+        std::string range = list.substr(pos, comma - pos);
+        size_t dash = range.find('-');
+
+        try {
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos
+                           ? first
+                           : std::stoi(range.substr(dash + 1));
+
+            if (first < 0 || last < first) return -1;
+            for (int cpu = first; cpu <= last; cpu++) cpus->push_back(cpu);
+        } catch (const std::exception &e) {
+            return -1;
+        }
+
+        pos = comma + 1;
+    }
+
+    return cpus->empty() ? -1 : 0;
+}
+
 int parse_args(int argc, char **argv, struct args *args) {
-    if (argc > 16) {
+    if (argc > 32) {
         fprintf(stderr, "Entered way too many command line arguments.\n");
         exit(1);
     }
@@ -60,10 +154,29 @@ int parse_args(int argc, char **argv, struct args *args) {
     args->debug = false;
     args->verbose = false;
     args->interval = 5;
+    args->capture = PCAP_BACKEND;
+    args->ring_size = 64;
+    args->block_timeout = 100;
+    args->xdp_native = false;
+    args->interfaces.clear();
+    args->snaplen = HEADER_SNAPLEN;
+    args->filter = true;
+    args->batch_size = 64;
+    args->batch_latency = 100;
+    args->pending_flows = 4096;
+    args->trace_sockets = false;
+    args->check_trace_sockets = false;
+    args->sample_rate = 1;
+    args->sample_auto = false;
+    args->workers = 1;
+    args->cpus.clear();
     args->time = {0, 0, 0, 0};
     args->sort = RX_DESC;
     args->rows_shown = -1;
     args->historical = "";
+    args->replay = "";
+    args->bench_proc = "";
+    args->fixture = "";
 
     bool timeframe_set = false;
 
@@ -109,6 +222,275 @@ int parse_args(int argc, char **argv, struct args *args) {
             }
         }
 
+        if (arg == "-I" || arg == "--interface") {
+            if (it + 1 != end) {
+                args->interfaces.push_back(std::string(*(it + 1)));
+            } else {
+                fprintf(stderr,
+                        "The interface argument (-I, --interface) requires "
+                        "the name of a network interface.\n");
+                exit(1);
+            }
+        }
+
+        if (arg == "--snaplen") {
+            if (it + 1 != end) {
+                std::string_view profile = *(it + 1);
+
+                if (profile == "headers") {
+                    args->snaplen = HEADER_SNAPLEN;
+                } else if (profile == "full") {
+                    args->snaplen = BUFSIZ;
+                } else {
+                    try {
+                        args->snaplen = std::stoi(std::string(profile));
+                    } catch (const std::invalid_argument &ia) {
+                        fprintf(stderr,
+                                "The snaplen argument (--snaplen) requires "
+                                "headers, full, or an integer. Invalid "
+                                "argument: %s\n",
+                                ia.what());
+                        exit(1);
+                    }
+
+                    if (args->snaplen < HEADER_SNAPLEN)
+                        args->snaplen = HEADER_SNAPLEN;
+                }
+            } else {
+                fprintf(stderr,
+                        "The snaplen argument (--snaplen) requires headers, "
+                        "full, or an integer.\n");
+                exit(1);
+            }
+        }
+
+        if (arg == "--no-filter") {
+            args->filter = false;
+        }
+
+        if (arg == "--batch-size") {
+            if (it + 1 != end) {
+                try {
+                    args->batch_size = std::stoi(std::string(*(it + 1)));
+                } catch (const std::invalid_argument &ia) {
+                    fprintf(stderr,
+                            "The batch size argument (--batch-size) requires "
+                            "an integer. Invalid argument: %s\n",
+                            ia.what());
+                    exit(1);
+                }
+
+                if (args->batch_size < 1) args->batch_size = 1;
+            } else {
+                fprintf(stderr,
+                        "The batch size argument (--batch-size) requires an "
+                        "integer.\n");
+                exit(1);
+            }
+        }
+
+        if (arg == "--batch-latency") {
+            if (it + 1 != end) {
+                try {
+                    args->batch_latency = std::stoi(std::string(*(it + 1)));
+                } catch (const std::invalid_argument &ia) {
+                    fprintf(stderr,
+                            "The batch latency argument (--batch-latency) "
+                            "requires an integer in milliseconds. Invalid "
+                            "argument: %s\n",
+                            ia.what());
+                    exit(1);
+                }
+            } else {
+                fprintf(stderr,
+                        "The batch latency argument (--batch-latency) requires "
+                        "an integer in milliseconds.\n");
+                exit(1);
+            }
+        }
+
+        if (arg == "--pending-flows") {
+            if (it + 1 != end) {
+                try {
+                    args->pending_flows = std::stoi(std::string(*(it + 1)));
+                } catch (const std::invalid_argument &ia) {
+                    fprintf(stderr,
+                            "The pending flows argument (--pending-flows) "
+                            "requires an integer. Invalid argument: %s\n",
+                            ia.what());
+                    exit(1);
+                }
+
+                if (args->pending_flows < 1) args->pending_flows = 1;
+            } else {
+                fprintf(stderr,
+                        "The pending flows argument (--pending-flows) requires "
+                        "an integer.\n");
+                exit(1);
+            }
+        }
+
+        if (arg == "--trace-sockets") {
+            args->trace_sockets = true;
+        }
+
+        if (arg == "--check-trace-sockets") {
+            args->check_trace_sockets = true;
+        }
+
+        if (arg == "--sample") {
+            if (it + 1 != end) {
+                std::string sample(*(it + 1));
+                if (sample == "auto") {
+                    args->sample_auto = true;
+                } else {
+                    try {
+                        args->sample_rate = std::stoi(sample);
+                    } catch (const std::invalid_argument &ia) {
+                        fprintf(stderr,
+                                "The sample argument (--sample) requires an "
+                                "integer or auto. Invalid argument: %s\n",
+                                ia.what());
+                        exit(1);
+                    }
+
+                    args->sample_rate =
+                        std::clamp(args->sample_rate, 1, MAX_SAMPLE_RATE);
+                }
+            } else {
+                fprintf(stderr,
+                        "The sample argument (--sample) requires an integer "
+                        "or auto.\n");
+                exit(1);
+            }
+        }
+
+        if (arg == "--workers") {
+            if (it + 1 != end) {
+                try {
+                    args->workers = std::stoi(std::string(*(it + 1)));
+                } catch (const std::invalid_argument &ia) {
+                    fprintf(stderr,
+                            "The workers argument (--workers) requires an "
+                            "integer. Invalid argument: %s\n",
+                            ia.what());
+                    exit(1);
+                }
+
+                if (args->workers < 1) args->workers = 1;
+            } else {
+                fprintf(stderr,
+                        "The workers argument (--workers) requires an "
+                        "integer.\n");
+                exit(1);
+            }
+        }
+
+        if (arg == "--cpus") {
+            if (it + 1 != end) {
+                if (parse_cpu_list(std::string(*(it + 1)), &args->cpus) < 0) {
+                    fprintf(stderr,
+                            "The cpus argument (--cpus) requires a list of "
+                            "cpus. Example: --cpus 0,2,4-7\n");
+                    exit(1);
+                }
+            } else {
+                fprintf(stderr,
+                        "The cpus argument (--cpus) requires a list of cpus. "
+                        "Example: --cpus 0,2,4-7\n");
+                exit(1);
+            }
+        }
+
+        if (arg == "--capture") {
+            if (it + 1 != end) {
+                std::string_view backend = *(it + 1);
+
+                if (backend == "pcap")
+                    args->capture = PCAP_BACKEND;
+                else if (backend == "ring")
+                    args->capture = RING_BACKEND;
+                else if (backend == "xdp")
+                    args->capture = XDP_BACKEND;
+                else {
+                    fprintf(stderr,
+                            "The capture argument (--capture) requires a "
+                            "capture backend. Options: pcap, ring, xdp. "
+                            "Example: --capture ring\n");
+                    exit(1);
+                }
+            } else {
+                fprintf(stderr,
+                        "The capture argument (--capture) requires a capture "
+                        "backend. Options: pcap, ring, xdp. Example: --capture "
+                        "ring\n");
+                exit(1);
+            }
+        }
+
+        if (arg == "--ring-size") {
+            if (it + 1 != end) {
+                try {
+                    args->ring_size = std::stoi(std::string(*(it + 1)));
+                } catch (const std::invalid_argument &ia) {
+                    fprintf(stderr,
+                            "The ring size argument (--ring-size) requires an "
+                            "integer in MiB. Invalid argument: %s\n",
+                            ia.what());
+                    exit(1);
+                }
+            } else {
+                fprintf(stderr,
+                        "The ring size argument (--ring-size) requires an "
+                        "integer in MiB.\n");
+                exit(1);
+            }
+        }
+
+        if (arg == "--block-timeout") {
+            if (it + 1 != end) {
+                try {
+                    args->block_timeout = std::stoi(std::string(*(it + 1)));
+                } catch (const std::invalid_argument &ia) {
+                    fprintf(stderr,
+                            "The block timeout argument (--block-timeout) "
+                            "requires an integer in milliseconds. Invalid "
+                            "argument: %s\n",
+                            ia.what());
+                    exit(1);
+                }
+            } else {
+                fprintf(stderr,
+                        "The block timeout argument (--block-timeout) requires "
+                        "an integer in milliseconds.\n");
+                exit(1);
+            }
+        }
+
+        if (arg == "--xdp-mode") {
+            if (it + 1 != end) {
+                std::string_view mode = *(it + 1);
+
+                if (mode == "generic" || mode == "skb")
+                    args->xdp_native = false;
+                else if (mode == "native" || mode == "drv")
+                    args->xdp_native = true;
+                else {
+                    fprintf(stderr,
+                            "The xdp mode argument (--xdp-mode) requires a "
+                            "mode. Options: generic, native. Example: "
+                            "--xdp-mode native\n");
+                    exit(1);
+                }
+            } else {
+                fprintf(stderr,
+                        "The xdp mode argument (--xdp-mode) requires a mode. "
+                        "Options: generic, native. Example: --xdp-mode "
+                        "native\n");
+                exit(1);
+            }
+        }
+
         if (arg == "-d" || arg == "--days") {
             if (it + 1 != end) {
                 try {
@@ -216,6 +598,39 @@ int parse_args(int argc, char **argv, struct args *args) {
             }
         }
 
+        if (arg == "--replay") {
+            if (it + 1 != end) {
+                args->replay = *(it + 1);
+            } else {
+                fprintf(stderr,
+                        "The replay argument (--replay) requires the path of "
+                        "a pcap file.\n");
+                exit(1);
+            }
+        }
+
+        if (arg == "--bench-proc") {
+            if (it + 1 != end) {
+                args->bench_proc = *(it + 1);
+            } else {
+                fprintf(stderr,
+                        "The bench argument (--bench-proc) requires the path "
+                        "of a /proc/net table.\n");
+                exit(1);
+            }
+        }
+
+        if (arg == "--fixture") {
+            if (it + 1 != end) {
+                args->fixture = *(it + 1);
+            } else {
+                fprintf(stderr,
+                        "The fixture argument (--fixture) requires the path "
+                        "of a fixture file.\n");
+                exit(1);
+            }
+        }
+
         if (arg == "--historical") {
             if (it + 1 != end) {
                 args->historical = *(it + 1);
@@ -2,6 +2,7 @@
 #define ARGS_H
 
 #include <string>
+#include <vector>
 
 #include "database.h"
 
@@ -13,6 +14,13 @@ enum sort {
     TX_DESC,
 };
 
+/* Packet capture backends the daemon can sniff with */
+enum capture_backend {
+    PCAP_BACKEND, /* libpcap, the default */
+    RING_BACKEND, /* AF_PACKET TPACKET_V3 mmap ring */
+    XDP_BACKEND,  /* XDP program copying headers into a BPF ring buffer */
+};
+
 /*
  * used as a global struct that carries user options to determine program
  * state. Includes options given by command line arguments and config files.
@@ -22,14 +30,36 @@ struct args {
     bool verbose; /* verbose mode (even more info than debug) */
     bool daemon;  /* flag to determine if we are launched the daemon or cli */
     int interval; /* interval to update database in seconds */
+    enum capture_backend capture; /* backend used to capture packets */
+    int ring_size;     /* size of the TPACKET_V3 ring in MiB */
+    int block_timeout; /* ms before a partially filled ring block retires */
+    bool xdp_native;   /* attach XDP program natively instead of generic */
+    std::vector<std::string> interfaces; /* interfaces selected to capture on */
+    int snaplen;           /* bytes of each packet to capture */
+    bool filter;           /* drop packets we ignore in the kernel with bpf */
+    int batch_size;        /* packets accounted at once by a capture */
+    int batch_latency;     /* ms a packet may wait in a batch */
+    int pending_flows;     /* max unresolved flows held by a capture */
+    bool trace_sockets;    /* trace socket owners with cgroup bpf programs */
+    bool check_trace_sockets; /* check the tracer on loopback sockets, exit */
+    int sample_rate;       /* account 1 in sample_rate packets */
+    bool sample_auto;      /* raise sample_rate when packets are dropped */
+    int workers;           /* capture workers per interface (PACKET_FANOUT) */
+    std::vector<int> cpus; /* cpus to pin capture workers to, round robin */
     struct timeframe time; /* timeframe to sum application data usage for */
     enum sort sort;        /* Sort preference for table */
     int rows_shown; /* Amount of rows shown on the tabls, truncating rest. */
     std::string historical; /* name of app to do historical account */
+    std::string replay;     /* pcap file to replay instead of capturing */
+    std::string fixture;    /* packet hash to application mappings for replay */
+    std::string bench_proc; /* /proc/net table to benchmark parsing of */
 };
 
 void print_help();
 
+/* Parses a cpu list such as "0,2,4-7" into cpus, returns -1 if malformed */
+int parse_cpu_list(const std::string &list, std::vector<int> *cpus);
+
 int parse_args(int argc, char **argv, struct args *args);
 
 #endif
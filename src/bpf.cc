@@ -0,0 +1,164 @@
+#include "bpf.h"
+
+#include <errno.h>
+#include <linux/bpf.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+
+static int sys_bpf(enum bpf_cmd cmd, union bpf_attr *attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof(union bpf_attr));
+}
+
+int bpf_create_map(uint32_t map_type, uint32_t key_size, uint32_t value_size,
+                   uint32_t max_entries, const char *name) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = map_type;
+    attr.key_size = key_size;
+    attr.value_size = value_size;
+    attr.max_entries = max_entries;
+    strncpy(attr.map_name, name, BPF_OBJ_NAME_LEN - 1);
+
+    return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+int bpf_load_program(uint32_t prog_type, uint32_t expected_attach_type,
+                     const void *insns, size_t insn_cnt, const char *name,
+                     char *log, size_t log_size) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = prog_type;
+    attr.expected_attach_type = expected_attach_type;
+    attr.insns = (uint64_t)(uintptr_t)insns;
+    attr.insn_cnt = insn_cnt;
+    attr.license = (uint64_t)(uintptr_t) "GPL";
+    strncpy(attr.prog_name, name, BPF_OBJ_NAME_LEN - 1);
+
+    int fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (fd >= 0 || log == NULL) return fd;
+
+    /* Load again with the verifier log enabled to find out why it failed */
+    log[0] = '\0';
+    attr.log_buf = (uint64_t)(uintptr_t)log;
+    attr.log_size = log_size;
+    attr.log_level = 1;
+
+    int err = errno;
+    fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (fd < 0) errno = err;
+
+    return fd;
+}
+
+int bpf_create_link(int prog_fd, int target, uint32_t attach_type,
+                    uint32_t flags) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = prog_fd;
+    attr.link_create.target_fd = target;
+    attr.link_create.attach_type = attach_type;
+    attr.link_create.flags = flags;
+
+    return sys_bpf(BPF_LINK_CREATE, &attr);
+}
+
+int bpf_lookup_elem(int map_fd, const void *key, void *value) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key = (uint64_t)(uintptr_t)key;
+    attr.value = (uint64_t)(uintptr_t)value;
+
+    return sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr);
+}
+
+int bpf_update_elem(int map_fd, const void *key, const void *value,
+                    uint64_t flags) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key = (uint64_t)(uintptr_t)key;
+    attr.value = (uint64_t)(uintptr_t)value;
+    attr.flags = flags;
+
+    return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+int bpf_ringbuf_open(struct bpf_ringbuf *ringbuf, int map_fd, size_t size) {
+    memset(ringbuf, 0, sizeof(struct bpf_ringbuf));
+    ringbuf->map_fd = map_fd;
+    ringbuf->size = size;
+    ringbuf->page_size = sysconf(_SC_PAGESIZE);
+
+    void *consumer = mmap(NULL, ringbuf->page_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, map_fd, 0);
+    if (consumer == MAP_FAILED) return -1;
+
+    /* The kernel maps the data area twice in a row after the producer page,
+     * so a record wrapping around the end can still be read contiguously. */
+    void *producer = mmap(NULL, ringbuf->page_size + 2 * size, PROT_READ,
+                          MAP_SHARED, map_fd, ringbuf->page_size);
+    if (producer == MAP_FAILED) {
+        munmap(consumer, ringbuf->page_size);
+        return -1;
+    }
+
+    ringbuf->consumer_pos = (unsigned long *)consumer;
+    ringbuf->producer_pos = (unsigned long *)producer;
+    ringbuf->data = (uint8_t *)producer + ringbuf->page_size;
+
+    return 0;
+}
+
+int bpf_ringbuf_consume(struct bpf_ringbuf *ringbuf,
+                        bpf_ringbuf_handler handler, void *ctx) {
+    unsigned long consumer =
+        __atomic_load_n(ringbuf->consumer_pos, __ATOMIC_ACQUIRE);
+    unsigned long producer =
+        __atomic_load_n(ringbuf->producer_pos, __ATOMIC_ACQUIRE);
+
+    int count = 0;
+    while (consumer < producer) {
+        uint32_t *header =
+            (uint32_t *)(ringbuf->data + (consumer & (ringbuf->size - 1)));
+        uint32_t len = __atomic_load_n(header, __ATOMIC_ACQUIRE);
+
+        /* Reserved by the program but not yet submitted */
+        if (len & BPF_RINGBUF_BUSY_BIT) break;
+
+        uint32_t data_len = len & ~BPF_RINGBUF_DISCARD_BIT;
+        if ((len & BPF_RINGBUF_DISCARD_BIT) == 0) {
+            handler(ctx, (const uint8_t *)header + BPF_RINGBUF_HDR_SZ,
+                    data_len);
+            count++;
+        }
+
+        consumer += (data_len + BPF_RINGBUF_HDR_SZ + 7) & ~7UL;
+        __atomic_store_n(ringbuf->consumer_pos, consumer, __ATOMIC_RELEASE);
+    }
+
+    return count;
+}
+
+int bpf_ringbuf_poll(struct bpf_ringbuf *ringbuf, int timeout) {
+    struct pollfd pfd;
+    memset(&pfd, 0, sizeof(pfd));
+    pfd.fd = ringbuf->map_fd;
+    pfd.events = POLLIN;
+
+    return poll(&pfd, 1, timeout);
+}
+
+void bpf_ringbuf_close(struct bpf_ringbuf *ringbuf) {
+    if (ringbuf->consumer_pos)
+        munmap(ringbuf->consumer_pos, ringbuf->page_size);
+    if (ringbuf->producer_pos)
+        munmap(ringbuf->producer_pos, ringbuf->page_size + 2 * ringbuf->size);
+
+    ringbuf->consumer_pos = NULL;
+    ringbuf->producer_pos = NULL;
+}
@@ -0,0 +1,62 @@
+#ifndef BPF_H
+#define BPF_H
+
+#include <cstddef>
+#include <cstdint>
+
+/* Thin wrappers around the bpf(2) syscall so omnis can load its small BPF
+ * programs without depending on libbpf. This header is deliberately free of
+ * <linux/bpf.h> since that clashes with libpcap's own struct bpf_insn, program
+ * types and attach types are therefore passed through as plain integers. */
+
+/* Creates a BPF map, returns the map fd or -1 with errno set. */
+int bpf_create_map(uint32_t map_type, uint32_t key_size, uint32_t value_size,
+                   uint32_t max_entries, const char *name);
+
+/* Loads insn_cnt instructions of eBPF bytecode as a program of prog_type.
+ * If the verifier rejects it, its log is written into log when given.
+ * Returns the program fd or -1 with errno set. */
+int bpf_load_program(uint32_t prog_type, uint32_t expected_attach_type,
+                     const void *insns, size_t insn_cnt, const char *name,
+                     char *log, size_t log_size);
+
+/* Creates a BPF link attaching the program to target (an interface index or
+ * a cgroup fd depending on the attach type). The program stays attached for
+ * exactly as long as the returned link fd is open. */
+int bpf_create_link(int prog_fd, int target, uint32_t attach_type,
+                    uint32_t flags);
+
+int bpf_lookup_elem(int map_fd, const void *key, void *value);
+
+int bpf_update_elem(int map_fd, const void *key, const void *value,
+                    uint64_t flags);
+
+/* User space side of a BPF_MAP_TYPE_RINGBUF map. Records are read in place
+ * from the shared mapping, nothing is copied out of it. */
+struct bpf_ringbuf {
+    int map_fd;                     /* ringbuf map */
+    unsigned long *consumer_pos;    /* consumer page, written by us */
+    unsigned long *producer_pos;    /* producer page, written by the kernel */
+    uint8_t *data;                  /* record data, mapped twice back to back */
+    size_t size;                    /* size of the data area, a power of 2 */
+    size_t page_size;
+};
+
+/* Callback for each record, data points straight into the ring buffer and
+ * is only valid until the callback returns. */
+typedef void (*bpf_ringbuf_handler)(void *ctx, const uint8_t *data,
+                                    uint32_t len);
+
+/* Maps the ringbuf map of size bytes, returns 0 on success or -1. */
+int bpf_ringbuf_open(struct bpf_ringbuf *ringbuf, int map_fd, size_t size);
+
+/* Hands every committed record to handler, returning how many were read. */
+int bpf_ringbuf_consume(struct bpf_ringbuf *ringbuf,
+                        bpf_ringbuf_handler handler, void *ctx);
+
+/* Waits up to timeout milliseconds for new records. */
+int bpf_ringbuf_poll(struct bpf_ringbuf *ringbuf, int timeout);
+
+void bpf_ringbuf_close(struct bpf_ringbuf *ringbuf);
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef BPF_INSN_H
+#define BPF_INSN_H
+
+#include <linux/bpf.h>
+
+#include <vector>
+
+/* Minimal eBPF assembler, enough to write omnis's BPF programs by hand.
+ * Must never be included alongside <pcap.h>, both define struct bpf_insn. */
+
+typedef std::vector<struct bpf_insn> bpf_prog;
+
+static inline struct bpf_insn bpf_make_insn(uint8_t code, uint8_t dst,
+                                            uint8_t src, int16_t off,
+                                            int32_t imm) {
+    struct bpf_insn insn;
+    insn.code = code;
+    insn.dst_reg = dst;
+    insn.src_reg = src;
+    insn.off = off;
+    insn.imm = imm;
+    return insn;
+}
+
+/* dst = src */
+static inline void bpf_mov_reg(bpf_prog &prog, int dst, int src) {
+    prog.push_back(bpf_make_insn(BPF_ALU64 | BPF_MOV | BPF_X, dst, src, 0, 0));
+}
+
+/* dst = imm */
+static inline void bpf_mov_imm(bpf_prog &prog, int dst, int32_t imm) {
+    prog.push_back(bpf_make_insn(BPF_ALU64 | BPF_MOV | BPF_K, dst, 0, 0, imm));
+}
+
+/* dst op= src */
+static inline void bpf_alu_reg(bpf_prog &prog, int op, int dst, int src) {
+    prog.push_back(bpf_make_insn(BPF_ALU64 | op | BPF_X, dst, src, 0, 0));
+}
+
+/* dst op= imm */
+static inline void bpf_alu_imm(bpf_prog &prog, int op, int dst, int32_t imm) {
+    prog.push_back(bpf_make_insn(BPF_ALU64 | op | BPF_K, dst, 0, 0, imm));
+}
+
+/* dst = *(size *)(src + off) */
+static inline void bpf_load(bpf_prog &prog, int size, int dst, int src,
+                            int16_t off) {
+    prog.push_back(bpf_make_insn(BPF_LDX | size | BPF_MEM, dst, src, off, 0));
+}
+
+/* *(size *)(dst + off) = src */
+static inline void bpf_store_reg(bpf_prog &prog, int size, int dst, int src,
+                                 int16_t off) {
+    prog.push_back(bpf_make_insn(BPF_STX | size | BPF_MEM, dst, src, off, 0));
+}
+
+/* *(size *)(dst + off) = imm */
+static inline void bpf_store_imm(bpf_prog &prog, int size, int dst,
+                                 int16_t off, int32_t imm) {
+    prog.push_back(bpf_make_insn(BPF_ST | size | BPF_MEM, dst, 0, off, imm));
+}
+
+/* lock *(u64 *)(dst + off) += src */
+static inline void bpf_atomic_add(bpf_prog &prog, int dst, int src,
+                                  int16_t off) {
+    prog.push_back(
+        bpf_make_insn(BPF_STX | BPF_DW | BPF_ATOMIC, dst, src, off, BPF_ADD));
+}
+
+/* dst = map fd, takes up two instruction slots */
+static inline void bpf_load_map_fd(bpf_prog &prog, int dst, int map_fd) {
+    prog.push_back(
+        bpf_make_insn(BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0,
+                      map_fd));
+    prog.push_back(bpf_make_insn(0, 0, 0, 0, 0));
+}
+
+/* if (dst op src) goto pc + off, returns the index so off can be patched */
+static inline size_t bpf_jump_reg(bpf_prog &prog, int op, int dst, int src,
+                                  int16_t off) {
+    prog.push_back(bpf_make_insn(BPF_JMP | op | BPF_X, dst, src, off, 0));
+    return prog.size() - 1;
+}
+
+/* if (dst op imm) goto pc + off, returns the index so off can be patched */
+static inline size_t bpf_jump_imm(bpf_prog &prog, int op, int dst,
+                                  int32_t imm, int16_t off) {
+    prog.push_back(bpf_make_insn(BPF_JMP | op | BPF_K, dst, 0, off, imm));
+    return prog.size() - 1;
+}
+
+/* goto pc + off, returns the index so off can be patched */
+static inline size_t bpf_jump(bpf_prog &prog, int16_t off) {
+    prog.push_back(bpf_make_insn(BPF_JMP | BPF_JA, 0, 0, off, 0));
+    return prog.size() - 1;
+}
+
+/* Points the jump at index jump to the next instruction to be emitted */
+static inline void bpf_patch_jump(bpf_prog &prog, size_t jump) {
+    prog[jump].off = prog.size() - jump - 1;
+}
+
+static inline void bpf_call(bpf_prog &prog, int32_t helper) {
+    prog.push_back(bpf_make_insn(BPF_JMP | BPF_CALL, 0, 0, 0, helper));
+}
+
+static inline void bpf_exit(bpf_prog &prog) {
+    prog.push_back(bpf_make_insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+}
+
+#endif
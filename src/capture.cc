@@ -0,0 +1,616 @@
+#include "capture.h"
+
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/if_packet.h>
+#include <net/if_arp.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include "database.h"
+#include "list.h"
+#include "omnis.h"
+#include "sniffer.h"
+
+std::vector<struct capture *> g_captures;
+
+/* Returns 1 if the device should be captured on when no interfaces were
+ * explicitly selected. */
+static int is_default_device(const pcap_if_t *device) {
+    if (device->flags & PCAP_IF_LOOPBACK) return 0;
+    if (!(device->flags & PCAP_IF_UP) || !(device->flags & PCAP_IF_RUNNING))
+        return 0;
+
+    /* The pseudo device "any" would double count every other interface */
+    if (strcmp(device->name, "any") == 0) return 0;
+
+    /* Interfaces without an address can't have any sockets of ours */
+    for (pcap_addr_t *addr = device->addresses; addr != NULL;
+         addr = addr->next) {
+        if (addr->addr && (addr->addr->sa_family == AF_INET ||
+                           addr->addr->sa_family == AF_INET6))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Returns the pcap link type of frames read straight off the device, as the
+ * ring and xdp backends do. Devices without a link layer, such as tun or
+ * wireguard devices, hand over bare ip packets. */
+static int device_datalink(const char *name) {
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) return DLT_EN10MB;
+
+    int ret = ioctl(fd, SIOCGIFHWADDR, &ifr);
+    close(fd);
+    if (ret < 0) return DLT_EN10MB;
+
+    switch (ifr.ifr_hwaddr.sa_family) {
+        case ARPHRD_NONE:
+        case ARPHRD_PPP:
+            return DLT_RAW;
+
+        default:
+            return DLT_EN10MB;
+    }
+}
+
+int capture_open_all() {
+    pcap_if_t *devices, *device;
+    char error_buffer[PCAP_ERRBUF_SIZE];
+
+    if (pcap_findalldevs(&devices, error_buffer)) {
+        fprintf(g_log, "error finding device: %s\n", error_buffer);
+        return 0;
+    }
+
+    for (device = devices; device != NULL; device = device->next) {
+        if (g_args.debug)
+            fprintf(g_log, "device found: %s | %s\n", device->name,
+                    device->description);
+
+        if (g_args.interfaces.empty()) {
+            if (!is_default_device(device)) continue;
+        } else {
+            auto selected = std::find(g_args.interfaces.begin(),
+                                      g_args.interfaces.end(), device->name);
+            if (selected == g_args.interfaces.end()) continue;
+        }
+
+        struct device *dev = new struct device();
+        strncpy(dev->name, device->name, IFNAMSIZ - 1);
+        refresh_local_ip_addresses(dev);
+
+        /* Every interface gets its own fanout group */
+        int group = (getpid() + g_captures.size()) & 0xffff;
+        int opened = 0;
+
+        for (int worker = 0; worker < g_args.workers; worker++) {
+            struct capture *capture = new struct capture;
+            capture->worker = worker;
+
+            /* The capture was registered as an rcu reader when opened, it
+             * has to be removed again before it is freed */
+            if (capture_open(capture, dev) < 0) {
+                rcu_unregister_reader(&capture->rcu);
+                delete capture;
+                break;
+            }
+
+            if (capture_set_filter(capture) < 0)
+                fprintf(g_log,
+                        "Capturing on %s without a kernel filter, ignored "
+                        "packets will be dropped in omnis instead\n",
+                        dev->name);
+
+            if (g_args.workers > 1 && capture_join_fanout(capture, group) < 0) {
+                capture_close(capture);
+                rcu_unregister_reader(&capture->rcu);
+                delete capture;
+                break;
+            }
+
+            /* Workers are pinned round robin over the given cpus */
+            capture->cpu = -1;
+            if (!g_args.cpus.empty())
+                capture->cpu = g_args.cpus[g_captures.size() %
+                                           g_args.cpus.size()];
+
+            g_captures.push_back(capture);
+            opened++;
+        }
+
+        if (opened == 0) {
+            delete dev;
+            continue;
+        }
+
+        db_insert_interface(dev);
+    }
+
+    for (const auto &name : g_args.interfaces) {
+        auto opened = std::find_if(g_captures.begin(), g_captures.end(),
+                                   [&name](const struct capture *capture) {
+                                       return name == capture->device->name;
+                                   });
+        if (opened == g_captures.end())
+            fprintf(g_log, "Could not capture on selected interface %s\n",
+                    name.c_str());
+    }
+
+    pcap_freealldevs(devices);
+    return g_captures.size();
+}
+
+static unsigned int ips_generation = 0;
+
+int device_set_local_ips(struct device *device, struct ip_list *ips) {
+    struct ip_set *ip_set = ip_set_from_list(ips, ips_generation + 1);
+    const struct ip_set *old = device->local_ips.load();
+
+    /* Publishing the same addresses would only rebuild every filter */
+    if (old != NULL && ip_set_equal(old, ip_set)) {
+        free(ip_set);
+        return 0;
+    }
+
+    ips_generation++;
+    device->local_ips.store(ip_set);
+
+    /* Capture threads only use a set inside a read section */
+    if (old != NULL) {
+        rcu_synchronize();
+        free((void *)old);
+    }
+
+    return 1;
+}
+
+void capture_init(struct capture *capture, struct device *device) {
+    capture->device = device;
+    capture->resolve_interval = 0;
+    capture->accounted = 0;
+    capture->resolved = 0;
+    capture->filter_generation = 0;
+    capture->unresolved = flow_table<struct pending_flow>(
+        (size_t)g_args.pending_flows * 2);
+    capture->map_generation = 0;
+    capture->unattributed = 0;
+    rcu_register_reader(&capture->rcu);
+    capture->flows.clear();
+    capture->last_flow_sweep = 0;
+    capture->flow_hits = 0;
+    capture->handle = NULL;
+    capture->datalink = DLT_EN10MB;
+    capture->handler = NULL;
+    capture->packets = 0;
+    capture->last_packets = 0;
+    capture->batch.resize(g_args.batch_size);
+    capture->batch_len = 0;
+    capture->batch_start = 0;
+    capture->sample_rate = g_args.sample_rate;
+    capture->sample_skip = 1;
+    capture->sample_seed = 2463534242u + capture->worker;
+    capture->last_drops = 0;
+    capture->last_adapt = std::time(NULL);
+    capture->calm_intervals = 0;
+    for (struct traffic_epoch &epoch : capture->epochs) {
+        epoch.slots.clear();
+        epoch.current = 0;
+        epoch.interval = std::max(g_args.interval, 1);
+        epoch.sample_rate = 1;
+    }
+    capture->epoch = 0;
+    capture->accounting = false;
+}
+
+int capture_open(struct capture *capture, struct device *device) {
+    capture_init(capture, device);
+
+    fprintf(g_log, "Opening device %s for sniffing (worker %d)\n",
+            device->name, capture->worker);
+
+    int ret;
+    switch (g_args.capture) {
+        case RING_BACKEND:
+            ret = ring_open(&capture->ring, device->name, g_args.ring_size,
+                            g_args.block_timeout);
+            capture->datalink = device_datalink(device->name);
+            break;
+
+        case XDP_BACKEND:
+            ret = xdp_open(&capture->xdp, device->name, g_args.ring_size,
+                           g_args.xdp_native);
+            capture->datalink = device_datalink(device->name);
+            break;
+
+        case PCAP_BACKEND:
+        default: {
+            char error_buffer[PCAP_ERRBUF_SIZE];
+            capture->handle =
+                pcap_open_live(device->name, g_args.snaplen, 1,
+                               g_args.batch_latency, error_buffer);
+
+            if (capture->handle == NULL) {
+                fprintf(g_log, "Could not open device %s with error %s\n",
+                        device->name, error_buffer);
+                return -1;
+            }
+
+            capture->datalink = pcap_datalink(capture->handle);
+            ret = 0;
+            break;
+        }
+    }
+
+    if (ret < 0) return -1;
+
+    /* The only time the link type is looked at, packets are handled by a
+     * handler specialized for it from now on. */
+    capture->handler = packet_handler_for_datalink(capture->datalink);
+    if (capture->handler == NULL) {
+        fprintf(g_log, "Device %s has unsupported link type %d\n",
+                device->name, capture->datalink);
+        capture_close(capture);
+        return -1;
+    }
+
+    return 0;
+}
+
+std::string capture_filter_expression(const struct ip_set *local_ips,
+                                      int datalink) {
+    /* Mirrors should_disregard_packet, which only applies to udp. pcap's tcp
+     * and udp primitives don't look past ipv6 extension headers, so other
+     * ipv6 packets are let through to be walked by the packet handler. */
+    std::string filter =
+        "(tcp or (udp and not port 53 and not port 1900 and not (src port "
+        "5353 and dst port 5353) and not (src port 123 and dst port 123)) or "
+        "(ip6 and not tcp and not udp))";
+
+    std::string hosts;
+    for (size_t i = 0; local_ips != NULL && i < local_ips->len; i++) {
+        char address[INET6_ADDRSTRLEN];
+
+        hosts += hosts.empty() ? "host " : " or host ";
+        hosts += ip_to_string(&local_ips->ips[i], address);
+    }
+
+    if (!hosts.empty()) filter += " and (" + hosts + ")";
+
+    /* Tags the kernel didn't strip, such as the inner one of QinQ frames,
+     * shift every offset so they need their own copy of the filter. */
+    if (datalink == DLT_EN10MB)
+        filter = "(" + filter + ") or (vlan and " + filter + ")";
+
+    return filter;
+}
+
+int capture_set_filter(struct capture *capture) {
+    std::string expression;
+    struct bpf_program program;
+
+    /* The expression holds a copy of the addresses, the set itself is only
+     * needed inside the read section */
+    rcu_read_lock(&capture->rcu);
+    const struct ip_set *local_ips =
+        capture->device->local_ips.load(std::memory_order_acquire);
+    if (local_ips != NULL) capture->filter_generation = local_ips->generation;
+
+    /* An empty expression accepts everything, but still truncates to the
+     * snaplen on the ring backend. */
+    if (g_args.filter)
+        expression = capture_filter_expression(local_ips, capture->datalink);
+    rcu_read_unlock(&capture->rcu);
+
+    if (g_args.debug)
+        fprintf(g_log, "Capture filter for %s: %s\n", capture->device->name,
+                expression.c_str());
+
+    switch (g_args.capture) {
+        case PCAP_BACKEND:
+            if (expression.empty()) return 0;
+
+            if (pcap_compile(capture->handle, &program, expression.c_str(), 1,
+                             PCAP_NETMASK_UNKNOWN) < 0) {
+                fprintf(g_log, "Could not compile capture filter for %s: %s\n",
+                        capture->device->name, pcap_geterr(capture->handle));
+                return -1;
+            }
+
+            if (pcap_setfilter(capture->handle, &program) < 0) {
+                fprintf(g_log, "Could not set capture filter on %s: %s\n",
+                        capture->device->name, pcap_geterr(capture->handle));
+                pcap_freecode(&program);
+                return -1;
+            }
+
+            pcap_freecode(&program);
+            return 0;
+
+        case RING_BACKEND: {
+            /* The ring has no pcap handle, compile against a dead one with
+             * the same link type and attach the classic bpf ourselves. Its
+             * return value is the snaplen, which truncates what the kernel
+             * copies into the ring. */
+            pcap_t *dead = pcap_open_dead(capture->datalink, g_args.snaplen);
+            if (pcap_compile(dead, &program, expression.c_str(), 1,
+                             PCAP_NETMASK_UNKNOWN) < 0) {
+                fprintf(g_log, "Could not compile capture filter for %s: %s\n",
+                        capture->device->name, pcap_geterr(dead));
+                pcap_close(dead);
+                return -1;
+            }
+            pcap_close(dead);
+
+            /* pcap's struct bpf_insn has the same layout as sock_filter */
+            struct sock_fprog fprog;
+            fprog.len = program.bf_len;
+            fprog.filter = (struct sock_filter *)program.bf_insns;
+
+            int ret = setsockopt(capture->ring.fd, SOL_SOCKET,
+                                 SO_ATTACH_FILTER, &fprog, sizeof(fprog));
+            pcap_freecode(&program);
+
+            if (ret < 0) {
+                fprintf(g_log, "Could not attach capture filter on %s: %s\n",
+                        capture->device->name, strerror(errno));
+                return -1;
+            }
+
+            return 0;
+        }
+
+        default:
+            /* The xdp program only ever copies the headers already */
+            return 0;
+    }
+}
+
+void capture_refresh_filter(struct capture *capture) {
+    if (!g_args.filter) return;
+
+    rcu_read_lock(&capture->rcu);
+    const struct ip_set *local_ips =
+        capture->device->local_ips.load(std::memory_order_acquire);
+    bool changed = local_ips != NULL &&
+                   local_ips->generation != capture->filter_generation;
+    rcu_read_unlock(&capture->rcu);
+
+    if (!changed) return;
+
+    if (g_args.debug)
+        fprintf(g_log, "Local addresses of %s changed, updating its filter\n",
+                capture->device->name);
+
+    capture_set_filter(capture);
+}
+
+void capture_close(struct capture *capture) {
+    switch (g_args.capture) {
+        case RING_BACKEND:
+            ring_close(&capture->ring);
+            break;
+
+        case XDP_BACKEND:
+            xdp_close(&capture->xdp);
+            break;
+
+        case PCAP_BACKEND:
+        default:
+            if (capture->handle) pcap_close(capture->handle);
+            capture->handle = NULL;
+            break;
+    }
+}
+
+int capture_join_fanout(struct capture *capture, int group) {
+    int fd;
+    switch (g_args.capture) {
+        case RING_BACKEND:
+            fd = capture->ring.fd;
+            break;
+
+        case PCAP_BACKEND:
+            fd = pcap_fileno(capture->handle);
+            break;
+
+        default:
+            fprintf(g_log,
+                    "Multiple workers are only supported by the pcap and ring "
+                    "capture backends\n");
+            return -1;
+    }
+
+    /* Hash fanout is symmetric, both directions of a flow hash the same */
+    int fanout = group | ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG)
+                          << 16);
+    if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) <
+        0) {
+        fprintf(g_log, "Could not join fanout group %d on device %s: %s\n",
+                group, capture->device->name, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+unsigned long long capture_drops(struct capture *capture) {
+    switch (g_args.capture) {
+        case RING_BACKEND:
+            return capture->ring.drops;
+
+        case XDP_BACKEND:
+            return capture->xdp.drops;
+
+        case PCAP_BACKEND:
+        default: {
+            struct pcap_stat stats;
+            if (capture->handle == NULL ||
+                pcap_stats(capture->handle, &stats) < 0)
+                return 0;
+
+            return (unsigned long long)stats.ps_drop + stats.ps_ifdrop;
+        }
+    }
+}
+
+struct traffic_epoch *capture_begin_accounting(struct capture *capture) {
+    /* Both this and the flip are sequentially consistent. Either the
+     * database thread sees us accounting and waits, or we see its flip. */
+    capture->accounting.store(true);
+    return &capture->epochs[capture->epoch.load()];
+}
+
+void capture_end_accounting(struct capture *capture) {
+    capture->accounting.store(false, std::memory_order_release);
+}
+
+struct traffic_epoch *capture_flip_epoch(struct capture *capture) {
+    int previous = capture->epoch.load(std::memory_order_relaxed);
+    capture->epoch.store(!previous);
+
+    /* Accounting never blocks, this only lasts until the end of a batch */
+    while (capture->accounting.load()) std::this_thread::yield();
+
+    return &capture->epochs[previous];
+}
+
+void traffic_epoch_reset(struct traffic_epoch *epoch) {
+    for (struct traffic_slot &slot : epoch->slots) {
+        std::fill(slot.traffic.begin(), slot.traffic.end(), traffic());
+        slot.start = -1;
+    }
+    epoch->sample_rate = 1;
+}
+
+size_t traffic_epoch_slot(struct traffic_epoch *epoch, time_t start) {
+    size_t unused = epoch->slots.size();
+    for (size_t i = 0; i < epoch->slots.size(); i++) {
+        if (epoch->slots[i].start == start) return i;
+        if (epoch->slots[i].start == -1 && unused == epoch->slots.size())
+            unused = i;
+    }
+
+    if (unused == epoch->slots.size()) epoch->slots.emplace_back();
+
+    epoch->slots[unused].start = start;
+    return unused;
+}
+
+void capture_adapt_sampling(struct capture *capture) {
+    if (!g_args.sample_auto) return;
+
+    time_t now = std::time(NULL);
+    if (now - capture->last_adapt < g_args.interval) return;
+    capture->last_adapt = now;
+
+    unsigned long long drops = capture_drops(capture);
+    unsigned long long dropped = drops - capture->last_drops;
+    capture->last_drops = drops;
+
+    int rate = capture->sample_rate;
+    if (dropped > 0) {
+        capture->calm_intervals = 0;
+        rate = std::min(rate * 2, MAX_SAMPLE_RATE);
+    } else if (rate > g_args.sample_rate && ++capture->calm_intervals >= 3) {
+        capture->calm_intervals = 0;
+        rate = std::max(rate / 2, g_args.sample_rate);
+    }
+
+    if (rate == capture->sample_rate) return;
+
+    fprintf(g_log,
+            "Sampling 1 in %d packets on %s (worker %d), %llu packets were "
+            "dropped in the last %ds\n",
+            rate, capture->device->name, capture->worker, dropped,
+            g_args.interval);
+    capture->sample_rate = rate;
+}
+
+void capture_loop(struct capture *capture) {
+    u_char *args = (u_char *)capture;
+
+    if (capture->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(capture->cpu, &cpus);
+
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (err)
+            fprintf(g_log, "Could not pin worker %d of %s to cpu %d: %s\n",
+                    capture->worker, capture->device->name, capture->cpu,
+                    strerror(err));
+        else if (g_args.debug)
+            fprintf(g_log, "Pinned worker %d of %s to cpu %d\n",
+                    capture->worker, capture->device->name, capture->cpu);
+    }
+
+    switch (g_args.capture) {
+        case RING_BACKEND:
+            ring_loop(&capture->ring, capture->handler, flush_packet_batch,
+                      args);
+            break;
+
+        case XDP_BACKEND:
+            xdp_loop(&capture->xdp, xdp_packet_handler, flush_packet_batch,
+                     args);
+            break;
+
+        case PCAP_BACKEND:
+        default:
+            /* pcap_dispatch returns after every buffer it reads, or when
+             * the timeout (the batch latency) expires on an idle link */
+            while (pcap_dispatch(capture->handle, -1, capture->handler,
+                                 args) >= 0)
+                flush_packet_batch(args);
+
+            fprintf(g_log, "Capture on device %s failed with error %s\n",
+                    capture->device->name, pcap_geterr(capture->handle));
+            break;
+    }
+
+    fprintf(g_log, "Stopped capturing on device %s (worker %d)\n",
+            capture->device->name, capture->worker);
+}
+
+void capture_run_all() {
+    for (struct capture *capture : g_captures)
+        capture->thread = std::thread(capture_loop, capture);
+
+    for (struct capture *capture : g_captures) capture->thread.join();
+}
+
+void capture_report_rates(int seconds) {
+    if (seconds <= 0) return;
+
+    unsigned long long total = 0;
+    for (struct capture *capture : g_captures) {
+        unsigned long long packets =
+            capture->packets.load(std::memory_order_relaxed);
+        unsigned long long delta = packets - capture->last_packets;
+        capture->last_packets = packets;
+        total += delta;
+
+        fprintf(g_log, "capture %s worker %d cpu %d: %llu pkts/s\n",
+                capture->device->name, capture->worker, capture->cpu,
+                delta / seconds);
+    }
+
+    fprintf(g_log, "capture total (%zu workers): %llu pkts/s\n",
+            g_captures.size(), total / seconds);
+}
@@ -0,0 +1,280 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <net/if.h>
+#include <pcap.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "application.h"
+#include "flow_table.h"
+#include "packet.h"
+#include "rcu.h"
+#include "ring.h"
+#include "xdp.h"
+
+/* Highest sample rate --sample auto raises a capture to */
+const int MAX_SAMPLE_RATE = 1024;
+
+/* Seconds a cached flow may go without packets before it is evicted. TCP
+ * flows are normally evicted soon after they close, the timeout only catches
+ * those whose FIN or RST we never saw. */
+const int FLOW_UDP_TIMEOUT = 30;
+const int FLOW_TCP_TIMEOUT = 300;
+
+/* Seconds a closed TCP flow is kept after its last packet, so the final ACK
+ * and any retransmits still find it instead of being looked up again */
+const int FLOW_CLOSED_LINGER = 5;
+
+/* Seconds between scans of the flow cache for idle flows */
+const int FLOW_SWEEP_INTERVAL = 5;
+
+/* Seconds an unresolved flow is held before its traffic is given to the
+ * unattributed application, and the longest wait between its retries. */
+const int PENDING_TTL = 30;
+const int PENDING_MAX_BACKOFF = 8;
+
+/* A network interface omnis is capturing on */
+struct device {
+    char name[IFNAMSIZ]; /* interface name */
+    int id;              /* database interface id */
+
+    /* Local ip addresses assigned to the interface, NULL until first set.
+     * Replaced as a whole by device_set_local_ips() whenever they change,
+     * capture threads only ever load it. */
+    std::atomic<const struct ip_set *> local_ips;
+};
+
+/* A parsed packet waiting in a captures batch to be accounted */
+struct batch_entry {
+    struct packet packet;     /* parsed packet */
+    struct flow_key key;      /* packet hash, local side first */
+    struct application *app;  /* application found for the packet */
+};
+
+/* A flow the capture has already connected to an application */
+struct flow_entry {
+    struct application *app; /* application the flow belongs to */
+    time_t last_seen;        /* timestamp of the flows latest packet */
+    uint8_t protocol;        /* transport protocol of the flow */
+    uint8_t fin; /* FIN seen outgoing (1) and/or incoming (2), closed (4) */
+};
+
+/* Set in flow_entry.fin once a flow is over */
+const uint8_t FLOW_CLOSED = 4;
+
+/* Seconds the database thread keeps waiting for packets of an interval after
+ * it ended, before writing it. Packets delayed in a batch or in the pending
+ * buffer still land in the interval of their own timestamp, those held back
+ * even longer are added to the rows written for it. */
+const int INTERVAL_REORDER_WINDOW = 10;
+
+/* Traffic of packets whose timestamps fall into one interval */
+struct traffic_slot {
+    time_t start; /* start of the interval, -1 while the slot is unused */
+
+    /* Traffic of each application, indexed by application->index. Grown by
+     * the capture thread as new applications are found. */
+    std::vector<struct traffic> traffic;
+};
+
+/* Traffic a capture accounted between two flips by the database thread */
+struct traffic_epoch {
+    /* One slot for every --interval aligned interval the packets fell into,
+     * usually one or two. Only the capture thread adds slots. */
+    std::vector<struct traffic_slot> slots;
+    size_t current; /* slot the latest packet went into */
+    int interval;   /* length of an interval in seconds */
+
+    /* Highest sample rate of the traffic accounted */
+    int sample_rate;
+};
+
+/* Traffic of a flow whose socket is not known yet */
+struct pending_flow {
+    struct traffic traffic;        /* traffic held until the flow resolves */
+    time_t first_seen;             /* timestamp of its first packet */
+    time_t next_retry;             /* when to look it up again */
+    unsigned long long generation; /* map generation it last missed in */
+    int retries;                   /* lookups that missed so far */
+};
+
+/* State belonging to a single capture thread. A pointer to it is given to
+ * the packet handler as its args, so everything in here is only ever touched by
+ * that thread, except for the epoch the database thread drains. */
+struct capture {
+    struct device *device; /* interface being captured on */
+    int worker;            /* index of this worker in the fanout group */
+    int cpu;               /* cpu the thread is pinned to, -1 if not pinned */
+
+    /* Packets seen by this capture, only written by the capture thread */
+    std::atomic<unsigned long long> packets;
+    unsigned long long last_packets; /* packets at the last rate report */
+
+    /* Traffic accounted to each application on this interface, without any
+     * lock. The capture thread accounts into epochs[epoch] while the database
+     * thread drains the other one, see capture_flip_epoch(). */
+    struct traffic_epoch epochs[2];
+    std::atomic<int> epoch;       /* epoch the capture thread accounts into */
+    std::atomic<bool> accounting; /* set while the capture thread accounts */
+
+    /* Traffic of packets that could not be connected to an application yet,
+     * keyed by packet hash. Allocated once for --pending-flows flows and
+     * never grown, flows beyond that are unattributed right away. */
+    flow_table<struct pending_flow> unresolved;
+    unsigned long long map_generation; /* generation of the last map used */
+    unsigned long long resolve_interval; /* packets since last resolve */
+
+    /* Counted in packets scaled by their sample weight, like the traffic
+     * itself, so they still add up while sampling */
+    unsigned long long unattributed; /* packets given up on */
+    unsigned long long accounted;    /* packets accounted, resolved or not */
+    unsigned long long resolved;     /* packets connected to an application */
+
+    /* Flows already connected to an application, looked up before
+     * g_packet_process_map and kept across /proc refreshes. Flows are evicted
+     * once TCP closes them or they go idle. Only the capture thread touches
+     * these. */
+    flow_table<struct flow_entry> flows;
+    time_t last_flow_sweep;            /* when idle flows were last evicted */
+    unsigned long long flow_hits;      /* weighted packets resolved by flows */
+
+    /* Packets parsed but not yet accounted, see flush_packet_batch() */
+    std::vector<struct batch_entry> batch;
+    size_t batch_len;        /* number of packets in the batch */
+    long long batch_start;   /* ms timestamp of the first packet in it */
+
+    unsigned int filter_generation; /* local_ips generation filtered on */
+
+    int datalink;         /* pcap link type (DLT_*) of the captured frames */
+    pcap_handler handler; /* packet handler specialized for the link type */
+
+    /* 1 in sample_rate packets is accounted, standing in for all of them.
+     * Only the capture thread touches these. */
+    int sample_rate;                 /* current sample rate */
+    int sample_skip;                 /* packets left until the next sample */
+    uint32_t sample_seed;            /* xorshift state picking the samples */
+    unsigned long long last_drops;   /* drops seen at the last adaption */
+    time_t last_adapt;               /* when the sample rate was last checked */
+    int calm_intervals;              /* intervals in a row without drops */
+
+    /* Backend specific handles, only the one in use is opened */
+    pcap_t *handle;
+    struct ring ring;
+    struct xdp xdp;
+
+    struct rcu_reader rcu; /* reads g_packet_process_map */
+
+    std::thread thread;
+};
+
+/* All captures opened by capture_open_all() */
+extern std::vector<struct capture *> g_captures;
+
+/* Opens captures for every selected interface using the configured capture
+ * backend. Interfaces are selected with --interface, or if none were given,
+ * every interface that is up, running, has an ipv4 address and isn't a
+ * loopback. With --workers N, N captures are opened per interface and joined
+ * into a PACKET_FANOUT group. Returns the number of captures opened. */
+int capture_open_all();
+
+/* Publishes a new set of local addresses for the device built from the list,
+ * unless it holds the same addresses as the current one. Capture threads only
+ * read the set inside their rcu read section, the old one is freed once none
+ * of them can still be using it. Calls must not overlap, or come from inside
+ * a read section. Returns 1 if a new set was published, 0 if not. */
+int device_set_local_ips(struct device *device, struct ip_list *ips);
+
+/* Resets the per capture state and registers the capture as an rcu reader,
+ * without opening any backend. A capture that is freed afterwards must be
+ * removed with rcu_unregister_reader() first. */
+void capture_init(struct capture *capture, struct device *device);
+
+/* Opens a capture on a single device. Returns 0 on success, -1 on failure. */
+int capture_open(struct capture *capture, struct device *device);
+
+/* Builds a pcap filter expression matching only the packets the packet handler
+ * would account: tcp or udp packets to or from one of the devices local
+ * addresses, minus the udp traffic should_disregard_packet ignores. Ethernet
+ * frames may also carry a vlan tag. */
+std::string capture_filter_expression(const struct ip_set *local_ips,
+                                      int datalink);
+
+/* Compiles the filter expression for the captures device and attaches it to
+ * the capture socket, so ignored packets are dropped in the kernel before
+ * ever being copied to us. The compiled filter also truncates packets to the
+ * configured snaplen. Unless --no-filter was given, then only the snaplen is
+ * applied. Returns 0 on success, -1 on failure. */
+int capture_set_filter(struct capture *capture);
+
+/* Sets the filter again if the devices local addresses changed since it was
+ * last set. Only called by the captures own thread. */
+void capture_refresh_filter(struct capture *capture);
+
+/* Closes whichever backend the capture was opened with. */
+void capture_close(struct capture *capture);
+
+/* Joins the captures socket into the fanout group, packets are spread across
+ * the group by flow hash so a flow is always seen by the same worker.
+ * Returns 0 on success, -1 on failure. */
+int capture_join_fanout(struct capture *capture, int group);
+
+/* Returns the total number of packets the backend dropped so far, either in
+ * the kernel or because its buffer was full. */
+unsigned long long capture_drops(struct capture *capture);
+
+/* Called by the capture thread before it accounts any traffic, returns the
+ * epoch to account it into. Must be followed by capture_end_accounting() as
+ * soon as it is done, the database thread may be waiting on it. */
+struct traffic_epoch *capture_begin_accounting(struct capture *capture);
+
+void capture_end_accounting(struct capture *capture);
+
+/* Called by the database thread once every interval. Switches the capture
+ * thread over to the other epoch, waits until it has stopped accounting into
+ * the previous one and returns that one to be drained. Whoever drains it must
+ * reset it with traffic_epoch_reset() before the next flip. */
+struct traffic_epoch *capture_flip_epoch(struct capture *capture);
+
+/* Zeroes every counter in the epoch and marks its slots unused, keeping
+ * their memory */
+void traffic_epoch_reset(struct traffic_epoch *epoch);
+
+/* Returns the index of the epochs slot for the interval starting at start,
+ * taking an unused slot or adding one if there is none yet. */
+size_t traffic_epoch_slot(struct traffic_epoch *epoch, time_t start);
+
+/* Returns the traffic counters of the application in the interval the
+ * timestamp time falls into */
+inline struct traffic &epoch_traffic(struct traffic_epoch *epoch,
+                                     const struct application *app,
+                                     time_t time) {
+    time_t start = time - time % epoch->interval;
+    if (epoch->slots.empty() || epoch->slots[epoch->current].start != start)
+        epoch->current = traffic_epoch_slot(epoch, start);
+
+    std::vector<struct traffic> &traffic = epoch->slots[epoch->current].traffic;
+    if (app->index >= traffic.size()) traffic.resize(app->index + 1);
+
+    return traffic[app->index];
+}
+
+/* With --sample auto, checks the backends drops once every interval. The
+ * sample rate is doubled whenever packets were dropped, and halved again back
+ * towards --sample's rate after a few intervals without drops. */
+void capture_adapt_sampling(struct capture *capture);
+
+/* Runs the capture loop for the backend in use, only returns on failure. */
+void capture_loop(struct capture *capture);
+
+/* Starts a thread running capture_loop for every capture and waits on them. */
+void capture_run_all();
+
+/* Logs the packet rate of every capture and the total over the last seconds,
+ * used to measure how throughput scales with the number of workers. */
+void capture_report_rates(int seconds);
+
+#endif
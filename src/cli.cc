@@ -1,6 +1,7 @@
 #include "cli.h"
 
 #include <algorithm>
+#include <cmath>
 #include <cstdio>
 #include <ctime>
 #include <unordered_map>
@@ -11,6 +12,19 @@
 #include "database.h"
 #include "human.h"
 
+/* Half width of the 95% confidence interval of a sampled byte count */
+static double error_bound(double variance) {
+    return 1.96 * std::sqrt(variance);
+}
+
+/* Returns true if any of the apps traffic was only estimated by sampling */
+static bool any_sampled(const std::vector<struct application> &apps) {
+    for (const auto &app : apps)
+        if (app.var_rx > 0 || app.var_tx > 0) return true;
+
+    return false;
+}
+
 void display_usage_table(struct timeframe time, enum sort sort, int show) {
     std::unordered_map<std::string, struct application> apps;
     db_fetch_usage_over_timeframe(apps, time);
@@ -46,6 +60,24 @@ void display_usage_table(struct timeframe time, enum sort sort, int show) {
         sorted.resize(show);
     }
 
+    /* Sampled traffic also gets its 95% error bound */
+    if (any_sampled(sorted)) {
+        printf("\n| Application      | Rx        | +/- Rx    | Tx        | "
+               "+/- Tx    |\n");
+        for (const auto &app : sorted) {
+            char rx[15], tx[15], rx_err[15], tx_err[15];
+            printf("-------------------------------------------------------"
+                   "---------------\n");
+            printf("| %-16s | %-9s | %-9s | %-9s | %-9s |\n", app.name,
+                   bytes_to_human(rx, app.pkt_rx),
+                   bytes_to_human(rx_err, error_bound(app.var_rx)),
+                   bytes_to_human(tx, app.pkt_tx),
+                   bytes_to_human(tx_err, error_bound(app.var_tx)));
+        }
+        printf("\n");
+        return;
+    }
+
     printf("\n| Application      | Rx        | Tx        |\n");
     for (const auto &app : sorted) {
         char rx[15], tx[15];
@@ -74,6 +106,26 @@ void display_app_usage_table(std::string &name, struct timeframe start,
            timestamp_to_human(from, labels[0]),
            timestamp_to_human(to, labels[gaps.size() - 1]));
 
+    if (any_sampled(gaps)) {
+        printf("\n| Timeframe | Rx        | +/- Rx    | Tx        | +/- Tx    "
+               "|\n");
+        int i = 0;
+        for (const auto &app : gaps) {
+            char rx[15], tx[15], rx_err[15], tx_err[15], label[30];
+            printf("---------------------------------------------------------"
+                   "------\n");
+            printf("| %-9s | %-9s | %-9s | %-9s | %-9s |\n",
+                   timestamp_to_human(label, labels[i]),
+                   bytes_to_human(rx, app.pkt_rx),
+                   bytes_to_human(rx_err, error_bound(app.var_rx)),
+                   bytes_to_human(tx, app.pkt_tx),
+                   bytes_to_human(tx_err, error_bound(app.var_tx)));
+            i++;
+        }
+        printf("\n");
+        return;
+    }
+
     printf("\n| Timeframe | Rx        | Tx        |\n");
     int i = 0;
     for (const auto &app : gaps) {
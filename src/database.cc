@@ -2,24 +2,44 @@
 
 #include <sys/stat.h>
 
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <filesystem>
+#include <map>
 #include <mutex>
 #include <string>
 #include <thread>
 #include <vector>
 
 #include "application.h"
+#include "capture.h"
 #include "human.h"
 #include "omnis.h"
 #include "proc.h"
+#include "rcu.h"
 
 sqlite3 *db;
 
 std::unordered_map<std::string, int> application_ids;
-time_t time_cursor;
+std::unordered_map<std::string, int> interface_ids;
+
+/* Traffic one capture accounted to an interval, merged from every epoch its
+ * packets were accounted in */
+struct interval_traffic {
+    std::vector<struct traffic> traffic; /* indexed by application->index */
+    int sample_rate = 1;
+};
+
+/* Intervals still waiting on late packets, by their start. Each holds the
+ * traffic of every capture, indexed the same as g_captures. */
+static std::map<time_t, std::vector<struct interval_traffic>> open_intervals;
+
+/* Start of the latest interval written. Traffic turning up for it or an
+ * earlier one is added into the rows already written. */
+static time_t written_until = -1;
 
 /* 5 second interval to deposit into database */
 int update_interval = 5;
@@ -127,11 +147,16 @@ int db_generate_schema() {
         "pktTx          INT                     NOT NULL, "
         "pktRx          INT                     NOT NULL, "
         "pktTcp         INT                     NOT NULL, "
-        "pktUdp         INT                     NOT NULL);"
+        "pktUdp         INT                     NOT NULL, "
+        "interfaceId    INT                     NOT NULL DEFAULT 0, "
+        "sampleRate     INT                     NOT NULL DEFAULT 1);"
         "CREATE TABLE Application("
         "id             INTEGER PRIMARY KEY AUTOINCREMENT   NOT NULL, "
         "name           TEXT UNIQUE                         NOT NULL, "
-        "colorHex       TEXT                                DEFAULT '');";
+        "colorHex       TEXT                                DEFAULT '');"
+        "CREATE TABLE Interface("
+        "id             INTEGER PRIMARY KEY AUTOINCREMENT   NOT NULL, "
+        "name           TEXT UNIQUE                         NOT NULL);";
 
     char *err;
     int ret = sqlite3_exec(db, schema.c_str(), NULL, NULL, &err);
@@ -146,9 +171,67 @@ int db_generate_schema() {
     return 0;
 }
 
+int db_upgrade_schema() {
+    sqlite3_stmt *stmt;
+    char *err;
+
+    /* Sessions are split per interface since interfaces were added, older
+     * rows are kept under interface id 0. */
+    const char *sql =
+        "SELECT COUNT(*) FROM pragma_table_info('Session') WHERE "
+        "name='interfaceId';";
+
+    sqlite3_prepare_v3(db, sql, strlen(sql), 0, &stmt, NULL);
+    sqlite3_step(stmt);
+    int has_interface = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+
+    if (!has_interface) {
+        const char *upgrade =
+            "ALTER TABLE Session ADD COLUMN interfaceId INT NOT NULL DEFAULT 0;"
+            "CREATE TABLE IF NOT EXISTS Interface("
+            "id             INTEGER PRIMARY KEY AUTOINCREMENT   NOT NULL, "
+            "name           TEXT UNIQUE                         NOT NULL);";
+
+        if (sqlite3_exec(db, upgrade, NULL, NULL, &err) != SQLITE_OK) {
+            fprintf(g_log, "Error upgrading database schema with error: %s",
+                    err);
+            exit(1);
+        }
+
+        fprintf(g_log, "Upgraded database schema with interfaces\n");
+    }
+
+    /* Rows from before sampling existed counted every packet */
+    sql = "SELECT COUNT(*) FROM pragma_table_info('Session') WHERE "
+          "name='sampleRate';";
+
+    sqlite3_prepare_v3(db, sql, strlen(sql), 0, &stmt, NULL);
+    sqlite3_step(stmt);
+    int has_sample_rate = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+
+    if (!has_sample_rate) {
+        const char *upgrade =
+            "ALTER TABLE Session ADD COLUMN sampleRate INT NOT NULL DEFAULT 1;";
+
+        if (sqlite3_exec(db, upgrade, NULL, NULL, &err) != SQLITE_OK) {
+            fprintf(g_log, "Error upgrading database schema with error: %s",
+                    err);
+            exit(1);
+        }
+
+        fprintf(g_log, "Upgraded database schema with sample rates\n");
+    }
+
+    return 0;
+}
+
 int db_load() {
-    std::string db_path;
-    root_get_or_create_db_path(&db_path);
+    std::string db_path = ":memory:";
+
+    /* Replays must never touch the real database */
+    if (g_args.replay.empty()) root_get_or_create_db_path(&db_path);
 
     int err = sqlite3_open(db_path.c_str(), &db);
     sqlite3_stmt *stmt;
@@ -172,12 +255,13 @@ int db_load() {
 
     sqlite3_finalize(stmt);
 
+    db_upgrade_schema();
     db_load_applications(application_ids);
+    db_load_interfaces(interface_ids);
 
     if (g_args.daemon)
         fprintf(g_log, "Loaded existing database successfully.\n");
 
-    time_cursor = std::time(NULL);
     return 0;
 }
 
@@ -198,69 +282,199 @@ void db_load_applications(std::unordered_map<std::string, int> &apps) {
     sqlite3_finalize(stmt);
 }
 
+void db_load_interfaces(std::unordered_map<std::string, int> &interfaces) {
+    sqlite3_stmt *stmt;
+    const char *sql = "SELECT id, name FROM Interface;";
+
+    sqlite3_prepare_v3(db, sql, strlen(sql), 0, &stmt, NULL);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        int id = sqlite3_column_int(stmt, 0);
+        std::string name = std::string(
+            reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1)));
+
+        interfaces[name] = id;
+    }
+
+    sqlite3_finalize(stmt);
+}
+
+/* Writes one row for every application with traffic in the interval
+ * starting at start, for each capture. With update set the traffic is first
+ * added to the row already written for the application, if there is one. */
+static void db_insert_interval(
+    sqlite3_stmt *stmt, sqlite3_stmt *update, time_t start,
+    const std::vector<struct interval_traffic> &interval,
+    const std::vector<struct application *> &apps) {
+    for (size_t c = 0; c < g_captures.size(); c++) {
+        struct capture *capture = g_captures[c];
+        const struct interval_traffic &merged = interval[c];
+
+        for (size_t i = 0; i < merged.traffic.size(); i++) {
+            const struct traffic &traffic = merged.traffic[i];
+            struct application *app = apps[i];
+
+            char rx[15], tx[15];
+            if (traffic.pkt_rx == 0 && traffic.pkt_tx == 0) continue;
+
+            /* Applications found by the capture threads only get their
+             * database row once they have traffic to write */
+            if (app->id == 0) db_insert_application(app);
+
+            /* Both statements take the same parameters */
+            bool updated = false;
+            for (sqlite3_stmt *row : {update, stmt}) {
+                if (row == NULL) continue;
+
+                sqlite3_bind_int64(row, 1, start);
+                sqlite3_bind_int(row, 2, g_args.interval);
+                sqlite3_bind_int(row, 3, app->id);
+                sqlite3_bind_int64(row, 4, traffic.pkt_tx);
+                sqlite3_bind_int64(row, 5, traffic.pkt_rx);
+                sqlite3_bind_int64(row, 6, traffic.pkt_tx_c);
+                sqlite3_bind_int64(row, 7, traffic.pkt_rx_c);
+                sqlite3_bind_int64(row, 8, traffic.pkt_tcp);
+                sqlite3_bind_int64(row, 9, traffic.pkt_udp);
+                sqlite3_bind_int(row, 10, capture->device->id);
+                sqlite3_bind_int(row, 11, merged.sample_rate);
+
+                int ret = sqlite3_step(row);
+                if (ret != SQLITE_DONE) {
+                    if (g_args.debug)
+                        fprintf(g_log,
+                                "Commit failed while trying to insert "
+                                "session data: %d\n",
+                                ret);
+                }
+
+                sqlite3_reset(row);
+
+                if (row == update && ret == SQLITE_DONE &&
+                    sqlite3_changes(db) > 0) {
+                    updated = true;
+                    break;
+                }
+            }
+
+            if (g_args.debug && updated)
+                fprintf(g_log, "Added late traffic of %s to interval %lld\n",
+                        app->name, (long long)start);
+
+            if (g_args.verbose) {
+                fprintf(g_log, "[*] %s (%s)\n", app->name,
+                        capture->device->name);
+                fprintf(g_log, "    rx: %s tx: %s\n",
+                        bytes_to_human_overtime(rx, traffic.pkt_rx, 5),
+                        bytes_to_human_overtime(tx, traffic.pkt_tx, 5));
+
+                fprintf(g_log, "    tcp: %llu udp: %llu\n", traffic.pkt_tcp,
+                        traffic.pkt_udp);
+            }
+        }
+    }
+}
+
+/* The database thread reads g_packet_process_map too */
+static struct rcu_reader db_reader;
+
 int db_insert_traffic() {
-    std::unique_lock<std::mutex> lock(g_applications_lock);
+    /* Swap every captures live counters for the empty set first, it never
+     * waits on more than a batch in flight. Everything after works on the
+     * filled snapshots without holding anything the capture path needs. */
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<struct traffic_epoch *> epochs;
+    for (struct capture *capture : g_captures)
+        epochs.push_back(capture_flip_epoch(capture));
+
+    auto swapped = std::chrono::steady_clock::now();
+
+    /* Packets are counted in the interval of their own timestamp, so a
+     * snapshot can hold traffic of several intervals. Gather it by interval
+     * first, an interval is only written once it had time to complete. */
+    for (size_t c = 0; c < epochs.size(); c++) {
+        struct traffic_epoch *epoch = epochs[c];
+
+        for (const struct traffic_slot &slot : epoch->slots) {
+            if (slot.start == -1) continue;
+
+            std::vector<struct interval_traffic> &interval =
+                open_intervals[slot.start];
+            interval.resize(g_captures.size());
+
+            struct interval_traffic &merged = interval[c];
+            if (merged.traffic.size() < slot.traffic.size())
+                merged.traffic.resize(slot.traffic.size());
+            for (size_t i = 0; i < slot.traffic.size(); i++)
+                traffic_add(&merged.traffic[i], &slot.traffic[i]);
+
+            merged.sample_rate =
+                std::max(merged.sample_rate, epoch->sample_rate);
+        }
+
+        traffic_epoch_reset(epoch);
+    }
+
+    time_t closed =
+        std::time(NULL) - g_args.interval - INTERVAL_REORDER_WINDOW;
+
+    /* Every application accounted in a snapshot was resolved from a map
+     * published before the current one, which lists them all. */
+    rcu_read_lock(&db_reader);
+    std::vector<struct application *> apps =
+        g_packet_process_map.load()->apps;
+    rcu_read_unlock(&db_reader);
 
     char *err;
     sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, &err);
 
     std::string sql =
         "INSERT INTO Session (start, durationSec, applicationId, bytesTx, "
-        "bytesRx, pktTx, pktRx, pktTcp, pktUdp) VALUES (?, ?, ?, ?, ?, "
-        "?, ?, ?, ?);";
+        "bytesRx, pktTx, pktRx, pktTcp, pktUdp, interfaceId, sampleRate) "
+        "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);";
 
     sqlite3_stmt *stmt;
     sqlite3_prepare_v3(db, sql.c_str(), sql.size(), 0, &stmt, NULL);
 
-    if (g_args.verbose)
-        fprintf(g_log, "\n[###################################]\n");
-
-    time_cursor += g_args.interval;
-    for (const auto &[name, app] : g_application_map) {
-        char rx[15], tx[15];
-        if (app->pkt_rx > 0 || app->pkt_tx > 0) {
-            sqlite3_bind_int(stmt, 1, time_cursor);
-            sqlite3_bind_int(stmt, 2, g_args.interval);
-            sqlite3_bind_int(stmt, 3, app->id);
-            sqlite3_bind_int(stmt, 4, app->pkt_tx);
-            sqlite3_bind_int(stmt, 5, app->pkt_rx);
-            sqlite3_bind_int(stmt, 6, app->pkt_tx_c);
-            sqlite3_bind_int(stmt, 7, app->pkt_rx_c);
-            sqlite3_bind_int(stmt, 8, app->pkt_tcp);
-            sqlite3_bind_int(stmt, 9, app->pkt_udp);
-
-            int ret = sqlite3_step(stmt);
-            if (ret != SQLITE_DONE) {
-                if (g_args.debug)
-                    fprintf(g_log,
-                            "Commit failed while trying to insert session "
-                            "data: %d\n",
-                            ret);
-            }
+    /* Packets held back longer than the window, such as those of a flow
+     * that stayed pending on an idle link, land in intervals written
+     * already. They are added to those rows instead of writing another. */
+    std::string update_sql =
+        "UPDATE Session SET bytesTx = bytesTx + ?4, bytesRx = bytesRx + ?5, "
+        "pktTx = pktTx + ?6, pktRx = pktRx + ?7, pktTcp = pktTcp + ?8, "
+        "pktUdp = pktUdp + ?9, sampleRate = MAX(sampleRate, ?11) "
+        "WHERE start = ?1 AND durationSec = ?2 AND applicationId = ?3 AND "
+        "interfaceId = ?10;";
 
-            sqlite3_reset(stmt);
-
-            if (g_args.verbose) {
-                fprintf(g_log, "[*] %s\n", name.c_str());
-                fprintf(g_log, "    rx: %s tx: %s\n",
-                        bytes_to_human_overtime(rx, app->pkt_rx, 5),
-                        bytes_to_human_overtime(tx, app->pkt_tx, 5));
+    sqlite3_stmt *update;
+    sqlite3_prepare_v3(db, update_sql.c_str(), update_sql.size(), 0, &update,
+                       NULL);
 
-                fprintf(g_log, "    tcp: %d udp: %d\n", app->pkt_tcp,
-                        app->pkt_udp);
-            }
+    if (g_args.verbose)
+        fprintf(g_log, "\n[###################################]\n");
 
-            app->pkt_rx = 0;
-            app->pkt_tx = 0;
-            app->pkt_rx_c = 0;
-            app->pkt_tx_c = 0;
-            app->pkt_tcp = 0;
-            app->pkt_udp = 0;
-        }
+    while (!open_intervals.empty() &&
+           open_intervals.begin()->first <= closed) {
+        time_t start = open_intervals.begin()->first;
+        db_insert_interval(stmt, start <= written_until ? update : NULL,
+                           start, open_intervals.begin()->second, apps);
+        written_until = std::max(written_until, start);
+        open_intervals.erase(open_intervals.begin());
     }
 
     sqlite3_exec(db, "COMMIT TRANSACTION", NULL, NULL, &err);
     sqlite3_finalize(stmt);
+    sqlite3_finalize(update);
+
+    auto persisted = std::chrono::steady_clock::now();
+
+    if (g_args.debug) {
+        auto swap_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            swapped - start);
+        auto persist_us = std::chrono::duration_cast<
+            std::chrono::microseconds>(persisted - swapped);
+        fprintf(g_log, "Interval swapped in %lld us, persisted in %lld us\n",
+                (long long)swap_us.count(), (long long)persist_us.count());
+    }
 
     return 0;
 }
@@ -297,11 +511,66 @@ int db_insert_application(struct application *app) {
     return new_id;
 }
 
+int db_insert_interface(struct device *device) {
+    auto found = interface_ids.find(device->name);
+    if (found != interface_ids.end()) {
+        device->id = found->second;
+        return found->second;
+    }
+
+    sqlite3_stmt *stmt;
+    const char *sql = "INSERT INTO Interface (name) VALUES (?);";
+
+    sqlite3_prepare_v3(db, sql, strlen(sql), 0, &stmt, NULL);
+    sqlite3_bind_text(stmt, 1, device->name, -1, SQLITE_STATIC);
+
+    int ret = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+
+    if (ret != SQLITE_DONE) {
+        fprintf(g_log,
+                "Error inserting new interface %s into database with err: %s\n",
+                device->name, sqlite3_errmsg(db));
+        return 0;
+    }
+
+    int new_id = sqlite3_last_insert_rowid(db);
+    device->id = new_id;
+    interface_ids[device->name] = new_id;
+
+    if (g_args.debug)
+        fprintf(g_log, "Inserted new interface %s into database\n",
+                device->name);
+
+    return new_id;
+}
+
+std::string db_interface_filter() {
+    if (g_args.interfaces.empty()) return "";
+
+    /* Unknown interfaces get an id no row can have, so they match nothing */
+    std::string filter = " AND interfaceId IN (";
+    for (size_t i = 0; i < g_args.interfaces.size(); i++) {
+        auto found = interface_ids.find(g_args.interfaces[i]);
+        int id = found != interface_ids.end() ? found->second : -1;
+
+        if (i > 0) filter += ", ";
+        filter += std::to_string(id);
+    }
+    filter += ")";
+
+    return filter;
+}
+
 void db_update_loop() {
+    rcu_register_reader(&db_reader);
+
     while (1) {
         std::this_thread::sleep_for(std::chrono::seconds(g_args.interval));
         db_insert_traffic();
 
+        if (g_args.debug) capture_report_rates(g_args.interval);
+
         /* The log file buffer doesn't get flushed for ages if not manually done
          * since we do not output that much information. Force flush it every
          * update interval */
@@ -309,6 +578,15 @@ void db_update_loop() {
     }
 }
 
+/* Variance of a byte count estimated by accounting 1 in rate packets, each
+ * standing in for rate packets. That is (rate - 1) times the sum of the
+ * squared packet sizes, approximated with the mean packet size of the row. */
+static double sampled_variance(double bytes, double packets, int rate) {
+    if (rate <= 1 || packets <= 0) return 0;
+
+    return (rate - 1) * bytes * bytes / packets;
+}
+
 void db_fetch_usage_over_timeframe(
     std::unordered_map<std::string, struct application> &apps,
     struct timeframe time) {
@@ -320,12 +598,12 @@ void db_fetch_usage_over_timeframe(
     for (auto i = application_ids.begin(); i != application_ids.end(); ++i)
         app_ids[i->second] = i->first;
 
-    char sql[256];
     sqlite3_stmt *stmt;
 
-    snprintf(sql, 256, "SELECT * FROM Session WHERE start >= %ld;", start_time);
+    std::string sql = "SELECT * FROM Session WHERE start >= " +
+                      std::to_string(start_time) + db_interface_filter() + ";";
 
-    sqlite3_prepare_v3(db, sql, strlen(sql), 0, &stmt, NULL);
+    sqlite3_prepare_v3(db, sql.c_str(), sql.size(), 0, &stmt, NULL);
     while (sqlite3_step(stmt) == SQLITE_ROW) {
         int id = sqlite3_column_int(stmt, 2);
 
@@ -335,20 +613,30 @@ void db_fetch_usage_over_timeframe(
 
             app.pkt_tx += sqlite3_column_int64(stmt, 3);
             app.pkt_rx += sqlite3_column_int64(stmt, 4);
-            app.pkt_tx_c += sqlite3_column_int(stmt, 5);
-            app.pkt_rx_c += sqlite3_column_int(stmt, 6);
-            app.pkt_tcp += sqlite3_column_int(stmt, 7);
-            app.pkt_udp += sqlite3_column_int(stmt, 8);
+            app.pkt_tx_c += sqlite3_column_int64(stmt, 5);
+            app.pkt_rx_c += sqlite3_column_int64(stmt, 6);
+            app.pkt_tcp += sqlite3_column_int64(stmt, 7);
+            app.pkt_udp += sqlite3_column_int64(stmt, 8);
+            app.var_tx += sampled_variance(sqlite3_column_int64(stmt, 3),
+                                           sqlite3_column_int64(stmt, 5),
+                                           sqlite3_column_int(stmt, 10));
+            app.var_rx += sampled_variance(sqlite3_column_int64(stmt, 4),
+                                           sqlite3_column_int64(stmt, 6),
+                                           sqlite3_column_int(stmt, 10));
         } else {
             struct application new_app;
             strncpy(new_app.name, app_ids[id].c_str(), 16);
 
             new_app.pkt_tx = sqlite3_column_int64(stmt, 3);
             new_app.pkt_rx = sqlite3_column_int64(stmt, 4);
-            new_app.pkt_tx_c = sqlite3_column_int(stmt, 5);
-            new_app.pkt_rx_c = sqlite3_column_int(stmt, 6);
-            new_app.pkt_tcp = sqlite3_column_int(stmt, 7);
-            new_app.pkt_udp = sqlite3_column_int(stmt, 8);
+            new_app.pkt_tx_c = sqlite3_column_int64(stmt, 5);
+            new_app.pkt_rx_c = sqlite3_column_int64(stmt, 6);
+            new_app.pkt_tcp = sqlite3_column_int64(stmt, 7);
+            new_app.pkt_udp = sqlite3_column_int64(stmt, 8);
+            new_app.var_tx = sampled_variance(new_app.pkt_tx, new_app.pkt_tx_c,
+                                              sqlite3_column_int(stmt, 10));
+            new_app.var_rx = sampled_variance(new_app.pkt_rx, new_app.pkt_rx_c,
+                                              sqlite3_column_int(stmt, 10));
 
             apps[new_app.name] = new_app;
         }
@@ -407,15 +695,15 @@ void db_fetch_app_usage_between_timeframes(
         name.resize(15);
     }
 
-    char sql[256];
     sqlite3_stmt *stmt;
 
-    snprintf(sql, 256,
-             "SELECT * FROM Session WHERE (start BETWEEN %ld AND %ld) AND "
-             "applicationId=%d;",
-             start_t, end_t, app_id);
+    std::string sql = "SELECT * FROM Session WHERE (start BETWEEN " +
+                      std::to_string(start_t) + " AND " +
+                      std::to_string(end_t) +
+                      ") AND applicationId=" + std::to_string(app_id) +
+                      db_interface_filter() + ";";
 
-    sqlite3_prepare_v3(db, sql, strlen(sql), 0, &stmt, NULL);
+    sqlite3_prepare_v3(db, sql.c_str(), sql.size(), 0, &stmt, NULL);
     time_t time_edge = 0;
     while (sqlite3_step(stmt) == SQLITE_ROW) {
         time_t start = sqlite3_column_int64(stmt, 0);
@@ -427,10 +715,16 @@ void db_fetch_app_usage_between_timeframes(
 
         time_gap.pkt_tx += sqlite3_column_int64(stmt, 3);
         time_gap.pkt_rx += sqlite3_column_int64(stmt, 4);
-        time_gap.pkt_tx_c += sqlite3_column_int(stmt, 5);
-        time_gap.pkt_rx_c += sqlite3_column_int(stmt, 6);
-        time_gap.pkt_tcp += sqlite3_column_int(stmt, 7);
-        time_gap.pkt_udp += sqlite3_column_int(stmt, 8);
+        time_gap.pkt_tx_c += sqlite3_column_int64(stmt, 5);
+        time_gap.pkt_rx_c += sqlite3_column_int64(stmt, 6);
+        time_gap.pkt_tcp += sqlite3_column_int64(stmt, 7);
+        time_gap.pkt_udp += sqlite3_column_int64(stmt, 8);
+        time_gap.var_tx += sampled_variance(sqlite3_column_int64(stmt, 3),
+                                            sqlite3_column_int64(stmt, 5),
+                                            sqlite3_column_int(stmt, 10));
+        time_gap.var_rx += sampled_variance(sqlite3_column_int64(stmt, 4),
+                                            sqlite3_column_int64(stmt, 6),
+                                            sqlite3_column_int(stmt, 10));
     }
 
     sqlite3_finalize(stmt);
@@ -9,6 +9,8 @@
 
 #include "application.h"
 
+struct device;
+
 struct timeframe {
     int days;
     int hours;
@@ -28,6 +30,9 @@ extern sqlite3 *db;
 /* Holds all of the existing application names and their corresponding id */
 extern std::unordered_map<std::string, int> application_ids;
 
+/* Holds all of the existing interface names and their corresponding id */
+extern std::unordered_map<std::string, int> interface_ids;
+
 /* Sets full database path in path for an omnis that is running as a non-root
  * user. */
 int user_get_or_create_db_path(std::string *path);
@@ -38,6 +43,10 @@ int root_get_or_create_db_path(std::string *path);
 /* Used for creating new sqlite3 databases with the schema we designed. */
 int db_generate_schema();
 
+/* Brings databases created by older versions of omnis up to date with the
+ * current schema. */
+int db_upgrade_schema();
+
 /* Opens an existing database or creates a new one if it doesn't exist. Loads
  * existing application ids and names into application maps */
 int db_load();
@@ -46,15 +55,31 @@ int db_load();
  * application and the key being their associated id */
 void db_load_applications(std::unordered_map<std::string, int> &apps);
 
-/* Offloads application traffic data from g_application_map accumulated during
- * the time interval into the database and resets
- * the application traffic struct values. */
+/* Loads the Interface table into a map of interface names to their id */
+void db_load_interfaces(std::unordered_map<std::string, int> &interfaces);
+
+/* Offloads application traffic data accumulated by every capture into the
+ * database, one row per application per interface for every interval, and
+ * resets the captures traffic. The captures are switched over to fresh
+ * counters before anything is written, so they never wait on the disk.
+ * Traffic is kept by the interval its packets timestamps fall into, and an
+ * interval is only written INTERVAL_REORDER_WINDOW seconds after it ended.
+ * Traffic arriving for an interval after that is added to its rows.
+ * With --debug the time taken by both steps is logged. */
 int db_insert_traffic();
 
 /* Inserts the application name into the application database table,
  * and sets the application id in the struct and also returns it. */
 int db_insert_application(struct application *app);
 
+/* Inserts the interface name into the interface database table if needed,
+ * and sets the interface id in the struct and also returns it. */
+int db_insert_interface(struct device *device);
+
+/* SQL condition restricting Session rows to the interfaces selected with
+ * --interface, or an empty string if none were selected. */
+std::string db_interface_filter();
+
 /* Function for a thread to be spawned off of, simply calls db_insert_traffic()
  * every X secs. */
 void db_update_loop();
@@ -0,0 +1,160 @@
+#ifndef FLOW_TABLE_H
+#define FLOW_TABLE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "packet.h"
+
+/* Open addressing hash table keyed by struct flow_key. Every entry lives in a
+ * single flat array of slots probed linearly, so a lookup is usually one
+ * cache line and nothing is ever allocated besides growing the array.
+ * Entries are removed with backward shift deletion, which keeps probe chains
+ * short without tombstones. Not thread safe, callers do their own locking. */
+template <typename Value>
+struct flow_table {
+    struct slot {
+        struct flow_key key; /* key of the entry */
+        uint32_t hash;       /* cached hash of the key, 0 if slot is empty */
+        Value value;         /* value of the entry */
+    };
+
+    std::vector<struct slot> slots; /* power of 2 number of slots */
+    size_t count;                   /* number of slots in use */
+
+    explicit flow_table(size_t capacity = 1024) : count(0) {
+        size_t size = 16;
+        while (size < capacity) size <<= 1;
+        slots.resize(size);
+    }
+
+    /* Returns a pointer to the value stored for key, or NULL */
+    Value *find(const struct flow_key &key) {
+        uint32_t hash = hash_key(key);
+        size_t mask = slots.size() - 1;
+
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+            struct slot &slot = slots[i];
+            if (slot.hash == 0) return NULL;
+            if (slot.hash == hash && slot.key == key) return &slot.value;
+        }
+    }
+
+    const Value *find(const struct flow_key &key) const {
+        return const_cast<flow_table *>(this)->find(key);
+    }
+
+    /* Returns the value stored for key, inserting a value initialized one if
+     * there is none yet. */
+    Value &operator[](const struct flow_key &key) {
+        if ((count + 1) * 2 > slots.size()) grow();
+
+        uint32_t hash = hash_key(key);
+        size_t mask = slots.size() - 1;
+
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+            struct slot &slot = slots[i];
+            if (slot.hash == hash && slot.key == key) return slot.value;
+
+            if (slot.hash == 0) {
+                slot.key = key;
+                slot.hash = hash;
+                slot.value = Value();
+                count++;
+                return slot.value;
+            }
+        }
+    }
+
+    /* Removes the entry for key, returns true if there was one */
+    bool erase(const struct flow_key &key) {
+        uint32_t hash = hash_key(key);
+        size_t mask = slots.size() - 1;
+
+        size_t i = hash & mask;
+        while (!(slots[i].hash == hash && slots[i].key == key)) {
+            if (slots[i].hash == 0) return false;
+            i = (i + 1) & mask;
+        }
+
+        /* Shift back every following entry that probed past the hole */
+        for (size_t j = (i + 1) & mask; slots[j].hash != 0;
+             j = (j + 1) & mask) {
+            size_t home = slots[j].hash & mask;
+            bool between = i <= j ? (i < home && home <= j)
+                                  : (i < home || home <= j);
+            if (between) continue;
+
+            slots[i] = slots[j];
+            i = j;
+        }
+
+        slots[i].hash = 0;
+        count--;
+        return true;
+    }
+
+    /* Removes every entry, keeping the slot array allocated */
+    void clear() {
+        for (struct slot &slot : slots) slot.hash = 0;
+        count = 0;
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    /* Calls f(key, value) for every entry */
+    template <typename F>
+    void for_each(F f) {
+        for (struct slot &slot : slots)
+            if (slot.hash != 0) f(slot.key, slot.value);
+    }
+
+    /* Calls f(key, value) for every entry, removing those it returns true
+     * for. */
+    template <typename F>
+    void erase_if(F f) {
+        /* Start right after an empty slot so no probe chain wraps around
+         * past where we started. There always is one at a load of 1/2. */
+        size_t mask = slots.size() - 1;
+        size_t start = 0;
+        while (slots[start].hash != 0) start++;
+
+        size_t i = (start + 1) & mask;
+        for (size_t n = 1; n < slots.size();) {
+            /* An erase may shift a later entry into this slot, so only move
+             * on once the slot holds an entry we keep. */
+            if (slots[i].hash != 0 && f(slots[i].key, slots[i].value)) {
+                struct flow_key key = slots[i].key;
+                erase(key);
+                continue;
+            }
+            i = (i + 1) & mask;
+            n++;
+        }
+    }
+
+   private:
+    static uint32_t hash_key(const struct flow_key &key) {
+        uint64_t hash = flow_key_hash()(key);
+        uint32_t folded = hash ^ (hash >> 32);
+        return folded ? folded : 1;
+    }
+
+    void grow() {
+        std::vector<struct slot> old(slots.size() * 2);
+        old.swap(slots);
+        size_t mask = slots.size() - 1;
+
+        for (const struct slot &slot : old) {
+            if (slot.hash == 0) continue;
+
+            size_t i = slot.hash & mask;
+            while (slots[i].hash != 0) i = (i + 1) & mask;
+            slots[i] = slot;
+        }
+    }
+};
+
+#endif
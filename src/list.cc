@@ -4,8 +4,41 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
-void ip_list_push_front(struct ip_list **head, const struct in_addr ip) {
+void ip_from_ipv4(struct in6_addr *ip, in_addr_t ipv4) {
+    memset(ip, 0, sizeof(struct in6_addr));
+    ip->s6_addr[10] = 0xff;
+    ip->s6_addr[11] = 0xff;
+    memcpy(&ip->s6_addr[12], &ipv4, sizeof(ipv4));
+}
+
+int ip_from_string(struct in6_addr *ip, const char *str) {
+    struct in_addr ipv4;
+    if (inet_pton(AF_INET, str, &ipv4) == 1) {
+        ip_from_ipv4(ip, ipv4.s_addr);
+        return 0;
+    }
+
+    return inet_pton(AF_INET6, str, ip) == 1 ? 0 : -1;
+}
+
+int ip_is_unspecified(const struct in6_addr *ip) {
+    if (IN6_IS_ADDR_UNSPECIFIED(ip)) return 1;
+
+    return IN6_IS_ADDR_V4MAPPED(ip) && ip->s6_addr32[3] == 0;
+}
+
+char *ip_to_string(const struct in6_addr *ip, char *str) {
+    if (IN6_IS_ADDR_V4MAPPED(ip))
+        inet_ntop(AF_INET, &ip->s6_addr[12], str, INET6_ADDRSTRLEN);
+    else
+        inet_ntop(AF_INET6, ip, str, INET6_ADDRSTRLEN);
+
+    return str;
+}
+
+void ip_list_push_front(struct ip_list **head, const struct in6_addr &ip) {
     struct ip_list *new_ip = (struct ip_list *)malloc(sizeof(struct ip_list));
 
     new_ip->ip_address = ip;
@@ -13,7 +46,7 @@ void ip_list_push_front(struct ip_list **head, const struct in_addr ip) {
     *head = new_ip;
 }
 
-void ip_list_push_back(struct ip_list **head, const struct in_addr ip) {
+void ip_list_push_back(struct ip_list **head, const struct in6_addr &ip) {
     if (*head == NULL) {
         *head = (struct ip_list *)malloc(sizeof(struct ip_list));
         (*head)->ip_address = ip;
@@ -32,12 +65,10 @@ void ip_list_push_back(struct ip_list **head, const struct in_addr ip) {
     cursor->next->next = NULL;
 }
 
-int ip_list_contains(struct ip_list &ip_list, const in_addr_t ip) {
-    if (ip_list.ip_address.s_addr == ip) return 1;
-
+int ip_list_contains(struct ip_list &ip_list, const struct in6_addr &ip) {
     struct ip_list *cursor = &ip_list;
     while (cursor != NULL) {
-        if (cursor->ip_address.s_addr == ip) {
+        if (IN6_ARE_ADDR_EQUAL(&cursor->ip_address, &ip)) {
             return 1;
         }
         cursor = cursor->next;
@@ -46,6 +77,14 @@ int ip_list_contains(struct ip_list &ip_list, const in_addr_t ip) {
     return 0;
 }
 
+void ip_list_free(struct ip_list *ip_list) {
+    while (ip_list != NULL) {
+        struct ip_list *next = ip_list->next;
+        free(ip_list);
+        ip_list = next;
+    }
+}
+
 void print_ip_list(struct ip_list *ip_list, FILE *fp) {
     struct ip_list *cursor = ip_list;
     if (ip_list == NULL) {
@@ -53,10 +92,78 @@ void print_ip_list(struct ip_list *ip_list, FILE *fp) {
         return;
     }
 
+    char address[INET6_ADDRSTRLEN];
     fprintf(fp, "ip_list: [\n");
     while (cursor != NULL) {
-        fprintf(fp, "          %s\n", inet_ntoa(cursor->ip_address));
+        fprintf(fp, "          %s\n",
+                ip_to_string(&cursor->ip_address, address));
         cursor = cursor->next;
     }
     fprintf(fp, "         ]\n");
 }
+
+static int compare_ips(const void *a, const void *b) {
+    return memcmp(a, b, sizeof(struct in6_addr));
+}
+
+struct ip_set *ip_set_from_list(struct ip_list *ip_list,
+                                unsigned int generation) {
+    size_t len = 0;
+    for (struct ip_list *cursor = ip_list; cursor != NULL;
+         cursor = cursor->next)
+        len++;
+
+    struct ip_set *ip_set = (struct ip_set *)malloc(
+        sizeof(struct ip_set) + len * sizeof(struct in6_addr));
+    ip_set->generation = generation;
+
+    size_t i = 0;
+    for (struct ip_list *cursor = ip_list; cursor != NULL;
+         cursor = cursor->next)
+        ip_set->ips[i++] = cursor->ip_address;
+
+    qsort(ip_set->ips, len, sizeof(struct in6_addr), compare_ips);
+
+    /* Drop duplicates, an address may be listed for more than one prefix */
+    ip_set->len = 0;
+    for (i = 0; i < len; i++) {
+        if (ip_set->len > 0 &&
+            IN6_ARE_ADDR_EQUAL(&ip_set->ips[ip_set->len - 1], &ip_set->ips[i]))
+            continue;
+        ip_set->ips[ip_set->len++] = ip_set->ips[i];
+    }
+
+    return ip_set;
+}
+
+int ip_set_contains(const struct ip_set *ip_set, const struct in6_addr &ip) {
+    /* Hosts rarely have more than a handful of addresses, scanning them is
+     * faster than the branches of a binary search. */
+    if (ip_set->len <= 8) {
+        for (size_t i = 0; i < ip_set->len; i++)
+            if (IN6_ARE_ADDR_EQUAL(&ip_set->ips[i], &ip)) return 1;
+
+        return 0;
+    }
+
+    size_t low = 0, high = ip_set->len;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        int cmp = compare_ips(&ip_set->ips[middle], &ip);
+
+        if (cmp == 0) return 1;
+        if (cmp < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return 0;
+}
+
+int ip_set_equal(const struct ip_set *a, const struct ip_set *b) {
+    if (a == NULL || b == NULL) return a == b;
+
+    return a->len == b->len &&
+           memcmp(a->ips, b->ips, a->len * sizeof(struct in6_addr)) == 0;
+}
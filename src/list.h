@@ -3,22 +3,61 @@
 
 #include <netinet/in.h>
 
+#include <cstddef>
 #include <cstdio>
 
+/* Addresses are kept as ipv6 everywhere, ipv4 ones are stored v4-mapped
+ * (::ffff:a.b.c.d). Dual stack sockets show up the same way in
+ * /proc/net/tcp6, so both end up with the same address. */
 struct ip_list {
     struct ip_list *next;
-    struct in_addr ip_address;
+    struct in6_addr ip_address;
 };
 
+/* Sets ip to the v4-mapped form of the ipv4 address (network byte order) */
+void ip_from_ipv4(struct in6_addr *ip, in_addr_t ipv4);
+
+/* Parses an ipv4 or ipv6 address string. Returns 0 on success, -1 if it is
+ * neither. */
+int ip_from_string(struct in6_addr *ip, const char *str);
+
+/* Returns 1 if the address is unspecified (:: or 0.0.0.0), 0 if not. */
+int ip_is_unspecified(const struct in6_addr *ip);
+
+/* Writes the address into str, which must hold INET6_ADDRSTRLEN chars.
+ * v4-mapped addresses are written as plain ipv4. Returns str. */
+char *ip_to_string(const struct in6_addr *ip, char *str);
+
 /* Push given ip address to front off ip list */
-void ip_list_push_front(struct ip_list **head, const struct in_addr ip);
+void ip_list_push_front(struct ip_list **head, const struct in6_addr &ip);
 
 /* Appends given ip address to back off ip list */
-void ip_list_push_back(struct ip_list **head, const struct in_addr ip);
+void ip_list_push_back(struct ip_list **head, const struct in6_addr &ip);
 
 /* Returns 1 if ip_list contains the ip address given, 0 if not. */
-int ip_list_contains(struct ip_list &ip_list, const in_addr_t ip);
+int ip_list_contains(struct ip_list &ip_list, const struct in6_addr &ip);
+
+/* Frees every element of the list */
+void ip_list_free(struct ip_list *ip_list);
 
 void print_ip_list(struct ip_list *ip_list, FILE *fp);
 
+/* Flat set of addresses sorted as bytes, looked up for every packet. A set is
+ * never modified once built, it is replaced by a new one as a whole. */
+struct ip_set {
+    unsigned int generation; /* tells sets built one after another apart */
+    size_t len;              /* number of addresses */
+    struct in6_addr ips[];   /* sorted addresses without duplicates */
+};
+
+/* Allocates a set holding every address in the list */
+struct ip_set *ip_set_from_list(struct ip_list *ip_list,
+                                unsigned int generation);
+
+/* Returns 1 if the set contains the ip address given, 0 if not. */
+int ip_set_contains(const struct ip_set *ip_set, const struct in6_addr &ip);
+
+/* Returns 1 if both sets hold the same addresses, 0 if not. */
+int ip_set_equal(const struct ip_set *a, const struct ip_set *b);
+
 #endif
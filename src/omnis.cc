@@ -9,14 +9,19 @@
 #include <mutex>
 #include <thread>
 
+#include "address.h"
 #include "args.h"
+#include "capture.h"
 #include "cli.h"
 #include "database.h"
 #include "human.h"
 #include "list.h"
 #include "packet.h"
 #include "proc.h"
+#include "procevents.h"
+#include "replay.h"
 #include "sniffer.h"
+#include "socktrace.h"
 
 FILE *g_log;
 
@@ -82,6 +87,23 @@ void daemonize() {
 int main(int argc, char **argv) {
     parse_args(argc, argv, &g_args);
 
+    if (!g_args.bench_proc.empty()) {
+        g_log = stdout;
+        return bench_proc_net(g_args.bench_proc.c_str()) < 0 ? 1 : 0;
+    }
+
+    if (g_args.check_trace_sockets) {
+        g_log = stdout;
+        return sock_trace_check() < 0 ? 1 : 0;
+    }
+
+    if (!g_args.replay.empty()) {
+        g_log = stdout;
+        db_load();
+
+        return replay_run(g_args.replay.c_str()) < 0 ? 1 : 0;
+    }
+
     if (!g_args.daemon) {
         g_log = stdout;
         db_load();
@@ -104,39 +126,21 @@ int main(int argc, char **argv) {
     daemonize();
     db_load();
 
-    pcap_if_t *devices, *device;
-    pcap_t *handle;
-    int packet_count_limit = 1;
-    int timeout_limit = 100;  // milliseconds
-    char error_buffer[PCAP_ERRBUF_SIZE];
-
-    if (pcap_findalldevs(&devices, error_buffer)) {
-        fprintf(g_log, "error finding device: %s\n", error_buffer);
-        return 1;
-    }
-
-    for (device = devices; device != NULL; device = device->next) {
-        if (g_args.debug)
-            fprintf(g_log, "device found: %s | %s\n", device->name,
-                    device->description);
-    }
-
-    device = devices;
-    fprintf(g_log, "Opening device %s for sniffing\n", device->name);
-    handle = pcap_open_live(device->name, BUFSIZ, packet_count_limit,
-                            timeout_limit, error_buffer);
-
-    if (handle == NULL) {
-        fprintf(g_log, "Could not open device %s with error %s", device->name,
-                error_buffer);
+    if (capture_open_all() == 0) {
+        fprintf(g_log,
+                "No interfaces could be opened for sniffing. Exiting.\n");
         return 2;
     }
 
-    get_local_ip_addresses(device->name);
     refresh_proc_mappings();
 
     std::thread database_update_loop(db_update_loop);
-    pcap_loop(handle, -1, packet_handler, NULL);
+    std::thread proc_refresh_thread(proc_refresh_loop);
+    std::thread address_update_loop(address_monitor_loop);
+    std::thread proc_events_thread(proc_events_loop);
+    std::thread sock_trace_thread;
+    if (g_args.trace_sockets) sock_trace_thread = std::thread(sock_trace_loop);
+    capture_run_all();
 
     return 0;
 }
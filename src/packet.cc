@@ -3,21 +3,26 @@
 #include <arpa/inet.h>
 
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <string>
 
 #include "list.h"
 #include "proc.h"
 #include "sniffer.h"
 
-enum direction find_packet_direction(struct packet *packet) {
-    in_addr_t source_ip = packet->source_ip.s_addr;
-    in_addr_t dest_ip = packet->dest_ip.s_addr;
+enum direction find_packet_direction(struct packet *packet,
+                                     const struct ip_set *local_ips) {
+    const struct in6_addr &source_ip = packet->source_ip;
+    const struct in6_addr &dest_ip = packet->dest_ip;
 
     enum direction direction;
-    if (ip_list_contains(*g_local_ip_list, source_ip)) {
+    if (local_ips == NULL) {
+        direction = NOT_OUR_PACKET;
+    } else if (ip_set_contains(local_ips, source_ip)) {
         direction = OUTGOING_DIRECTION;
     } else {
-        if (ip_list_contains(*g_local_ip_list, dest_ip))
+        if (ip_set_contains(local_ips, dest_ip))
             direction = INCOMING_DIRECTION;
         else
             direction = NOT_OUR_PACKET;
@@ -27,6 +32,160 @@ enum direction find_packet_direction(struct packet *packet) {
     return direction;
 }
 
+void traffic_add(struct traffic *traffic, const struct traffic *other) {
+    traffic->pkt_tx += other->pkt_tx;
+    traffic->pkt_rx += other->pkt_rx;
+    traffic->pkt_tx_c += other->pkt_tx_c;
+    traffic->pkt_rx_c += other->pkt_rx_c;
+    traffic->pkt_tcp += other->pkt_tcp;
+    traffic->pkt_udp += other->pkt_udp;
+}
+
+void account_packet(struct traffic *traffic, const struct packet *packet) {
+    int weight = packet->weight;
+
+    if (packet->direction == OUTGOING_DIRECTION) {
+        traffic->pkt_tx += (unsigned long long)packet->len * weight;
+        traffic->pkt_tx_c += weight;
+    } else if (packet->direction == INCOMING_DIRECTION) {
+        traffic->pkt_rx += (unsigned long long)packet->len * weight;
+        traffic->pkt_rx_c += weight;
+    } else {
+        return;
+    }
+
+    if (packet->protocol == IPPROTO_TCP)
+        traffic->pkt_tcp += weight;
+    else
+        traffic->pkt_udp += weight;
+}
+
+size_t flow_key_hash::operator()(const struct flow_key &key) const {
+    /* Mix the key 8 bytes at a time, multiplying by the golden ratio and
+     * folding the high bits back down after every word. */
+    static_assert(sizeof(struct flow_key) == 36, "flow_key has padding");
+
+    uint64_t words[5] = {0, 0, 0, 0, 0};
+    memcpy(words, &key, sizeof(struct flow_key));
+
+    uint64_t hash = 0;
+    for (uint64_t word : words) {
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 32;
+    }
+
+    return hash;
+}
+
+void flow_key_from_packet(struct flow_key *key, const struct packet *packet) {
+    if (packet->direction == OUTGOING_DIRECTION) {
+        key->local_ip = packet->source_ip;
+        key->remote_ip = packet->dest_ip;
+        key->local_port = packet->source_port;
+        key->remote_port = packet->dest_port;
+    } else {
+        key->local_ip = packet->dest_ip;
+        key->remote_ip = packet->source_ip;
+        key->local_port = packet->dest_port;
+        key->remote_port = packet->source_port;
+    }
+}
+
+void flow_key_from_udp_port(struct flow_key *key, uint16_t port) {
+    memset(key, 0, sizeof(struct flow_key));
+    key->local_port = port;
+}
+
+/* Writes a single "ip:port" side of a packet hash */
+static int endpoint_to_string(char *str, size_t size, const struct in6_addr *ip,
+                              uint16_t port) {
+    char address[INET6_ADDRSTRLEN];
+    ip_to_string(ip, address);
+
+    if (IN6_IS_ADDR_V4MAPPED(ip))
+        return snprintf(str, size, "%s:%d", address, port);
+
+    return snprintf(str, size, "[%s]:%d", address, port);
+}
+
+int flow_key_is_udp_port(const struct flow_key *key) {
+    return ip_is_unspecified(&key->local_ip) &&
+           ip_is_unspecified(&key->remote_ip) && key->remote_port == 0;
+}
+
+char *flow_key_to_string(const struct flow_key *key, char *str) {
+    if (flow_key_is_udp_port(key)) {
+        snprintf(str, HASHKEYSIZE, "UDP-%d", key->local_port);
+        return str;
+    }
+
+    int len = endpoint_to_string(str, HASHKEYSIZE, &key->local_ip,
+                                 key->local_port);
+    str[len++] = '-';
+    endpoint_to_string(str + len, HASHKEYSIZE - len, &key->remote_ip,
+                       key->remote_port);
+
+    return str;
+}
+
+/* Parses a single "ip:port" or "[ip]:port" side of a packet hash */
+static int endpoint_from_string(const char *str, struct in6_addr *ip,
+                                uint16_t *port) {
+    char address[INET6_ADDRSTRLEN];
+    const char *end;
+
+    if (*str == '[') {
+        end = strchr(str, ']');
+        if (end == NULL || end[1] != ':') return -1;
+        str++;
+    } else {
+        end = strrchr(str, ':');
+        if (end == NULL) return -1;
+    }
+
+    size_t len = end - str;
+    if (len >= sizeof(address)) return -1;
+
+    memcpy(address, str, len);
+    address[len] = '\0';
+
+    if (*end == ']') end++;
+    char *rest;
+    long value = strtol(end + 1, &rest, 10);
+    if (*rest != '\0' || value < 0 || value > 65535) return -1;
+
+    *port = value;
+    return ip_from_string(ip, address);
+}
+
+int flow_key_from_string(struct flow_key *key, const char *str) {
+    memset(key, 0, sizeof(struct flow_key));
+
+    int port;
+    char end;
+    if (sscanf(str, "UDP-%d%c", &port, &end) == 1) {
+        if (port < 0 || port > 65535) return -1;
+
+        flow_key_from_udp_port(key, port);
+        return 0;
+    }
+
+    /* ipv6 addresses never contain a '-', so it always seperates the sides */
+    const char *seperator = strchr(str, '-');
+    if (seperator == NULL || (size_t)(seperator - str) >= HASHKEYSIZE)
+        return -1;
+
+    char local[HASHKEYSIZE];
+    memcpy(local, str, seperator - str);
+    local[seperator - str] = '\0';
+
+    if (endpoint_from_string(local, &key->local_ip, &key->local_port) < 0)
+        return -1;
+
+    return endpoint_from_string(seperator + 1, &key->remote_ip,
+                                &key->remote_port);
+}
+
 void print_packet(struct packet *packet, struct application *app, FILE *fp) {
     const char *protocol_string;
     const char *direction_string;
@@ -58,8 +217,9 @@ void print_packet(struct packet *packet, struct application *app, FILE *fp) {
             protocol_string);
     fprintf(fp, "sport: %hu dport: %hu\n", packet->source_port,
             packet->dest_port);
-    fprintf(fp, "sip: %s ", inet_ntoa(packet->source_ip));
-    fprintf(fp, "dip: %s\n", inet_ntoa(packet->dest_ip));
+    char address[INET6_ADDRSTRLEN];
+    fprintf(fp, "sip: %s ", ip_to_string(&packet->source_ip, address));
+    fprintf(fp, "dip: %s\n", ip_to_string(&packet->dest_ip, address));
     fprintf(fp, "length: %d header len: %d\n", packet->len, packet->header_len);
     fprintf(fp, "time: %lld\n", (long long)packet->time);
 
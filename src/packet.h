@@ -3,9 +3,26 @@
 
 #include <netinet/in.h>
 
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <ctime>
 
+#include "application.h"
+#include "list.h"
+
+/* Largest stack of headers packet_handler parses: an ethernet header with two
+ * vlan tags (longer than any other link header), an ipv6 header with up to 64
+ * bytes of extension headers (more than an ipv4 header with options) and a
+ * tcp header with options. Capturing any more than this only copies payload
+ * that is never looked at. */
+const int HEADER_SNAPLEN = 14 + 8 + 40 + 64 + 60;
+
+/* Max length of a packet hash string from flow_key_to_string().
+ * Each side is a bracketed ipv6 address, seperator and max 5 digit port,
+ * then the seperator between both sides and the null char. */
+const int HASHKEYSIZE = (INET6_ADDRSTRLEN + 2 + 1 + 5) * 2 + 1;
+
 /* packet direction */
 enum direction {
     UNKNOWN_DIRECTION,
@@ -16,24 +33,75 @@ enum direction {
 
 struct packet {
     uint8_t protocol;           /* transport protocol used (tcp, udp, ...) */
-    struct in_addr source_ip;   /* source ip address */
-    struct in_addr dest_ip;     /* destination ip address */
+    struct in6_addr source_ip;  /* source ip address, ipv4 is v4-mapped */
+    struct in6_addr dest_ip;    /* destination ip address */
     unsigned short source_port; /* source port */
     unsigned short dest_port;   /* destination port */
-    int len;                    /* Total length of packet */
+    int len;                    /* Total length of packet from ip header */
     int header_len;             /* Length of all headers present combined */
+    int weight;                 /* packets this one stands for when sampling */
+    uint8_t tcp_flags;          /* tcp header flags (TH_FIN, ...), 0 for udp */
     enum direction direction;   /* Is packet sent or received? */
     time_t time;                /* Unix timestamp when packet was captured */
 };
 
+/* The packet hash connecting a packet to the socket it belongs to, in binary
+ * so building and hashing one never formats strings. The local side always
+ * comes first, the same as in /proc/net. Unconnected UDP sockets are only
+ * known by their local port, their key has both addresses unspecified and a
+ * remote port of 0. */
+struct flow_key {
+    struct in6_addr local_ip;  /* local ip address */
+    struct in6_addr remote_ip; /* remote ip address */
+    uint16_t local_port;       /* local port */
+    uint16_t remote_port;      /* remote port */
+
+    /* There is no padding, so the key can be compared as bytes */
+    bool operator==(const struct flow_key &other) const {
+        return memcmp(this, &other, sizeof(struct flow_key)) == 0;
+    }
+};
+
+/* Hash functor for struct flow_key, used by flow_table */
+struct flow_key_hash {
+    size_t operator()(const struct flow_key &key) const;
+};
+
+/* Sets key to the packet hash of the packet, based on its direction */
+void flow_key_from_packet(struct flow_key *key, const struct packet *packet);
+
+/* Sets key to that of an unconnected UDP socket bound to port */
+void flow_key_from_udp_port(struct flow_key *key, uint16_t port);
+
+/* Returns 1 if key is that of an unconnected UDP socket, 0 otherwise */
+int flow_key_is_udp_port(const struct flow_key *key);
+
+/* Writes the key as "sip:sport-dip:dport" into str, which must hold
+ * HASHKEYSIZE chars. ipv6 addresses are bracketed, unconnected UDP sockets
+ * are written as "UDP-port". Returns str. */
+char *flow_key_to_string(const struct flow_key *key, char *str);
+
+/* Parses a string in the format written by flow_key_to_string. Returns 0 on
+ * success, -1 if it is malformed. */
+int flow_key_from_string(struct flow_key *key, const char *str);
+
 /* Prints packet information, primarly intended for debug purposes. */
 void print_packet(struct packet *packet, struct application *app, FILE *fp);
 
 /*
- * Uses the previously found values from get_local_ip_addresses to determine if
- * the packet is being received or transmitted. Sets the packet direction value
- * in the provided struct, and returns the direction enum value.
+ * Uses the local ip addresses of the device the packet was captured on to
+ * determine if the packet is being received or transmitted. Sets the packet
+ * direction value in the provided struct, and returns the direction enum
+ * value.
  */
-enum direction find_packet_direction(struct packet *packet);
+enum direction find_packet_direction(struct packet *packet,
+                                     const struct ip_set *local_ips);
+
+/* Adds the packet to the traffic counters based on its direction, scaled by
+ * its sampling weight */
+void account_packet(struct traffic *traffic, const struct packet *packet);
+
+/* Adds every counter of other to traffic */
+void traffic_add(struct traffic *traffic, const struct traffic *other);
 
 #endif
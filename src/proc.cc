@@ -4,149 +4,984 @@
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
 #include <memory>
+#include <mutex>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "database.h"
 #include "omnis.h"
+#include "rcu.h"
+#include "sockdiag.h"
 
 extern int errno;
 
-/* ipv6 size + seperator, max 5 digit port number + seperator,
- * ipv6 size + seperator, max 5 digit port number + null char. */
-const int HASHKEYSIZE = (INET6_ADDRSTRLEN + 5) + 1 + (INET6_ADDRSTRLEN + 5) + 1;
+std::atomic<struct process_map *> g_packet_process_map(
+    new struct process_map());
 
-std::mutex g_applications_lock;
+std::vector<std::unique_ptr<struct application>> g_applications;
 
-std::unordered_map<std::string, std::shared_ptr<struct application>>
-    g_packet_process_map;
+struct application *g_unattributed = NULL;
 
-std::unordered_map<std::string, std::shared_ptr<struct application>>
-    g_application_map;
+std::unordered_map<std::string, uint32_t> g_application_index;
 
 // temporary maps to use to combine into global g_packet_process_map
-std::unordered_map<std::string, unsigned long> temp_inode_map;
-std::unordered_map<unsigned long, std::shared_ptr<struct application>>
-    temp_process_map;
+flow_table<unsigned long> temp_inode_map;
+std::vector<unsigned long> temp_udp_port_map(65536, 0);
+std::unordered_map<unsigned long, uint32_t> temp_process_map;
+
+/* Every process seen by the last refresh, by pid */
+static std::unordered_map<pid_t, struct pid_entry> pid_cache;
+static unsigned long long pid_scan = 0;
+
+/* Socket inodes no cached process owned after the last refresh */
+static std::unordered_set<unsigned long> unowned_inodes;
+
+/* Guard the refresh requests of the capture threads */
+static std::mutex refresh_lock;
+static std::condition_variable refresh_wanted;
+static bool refresh_requested = false;
+static std::vector<struct flow_lookup> lookup_queue;
+static std::vector<struct socket_owner> owner_queue;
+static bool events_queued = false;
+
+/* A socket traced or looked up on its own, and the application owning it */
+struct found_socket {
+    struct flow_key key; /* the flows key, for UDP only its local port */
+    uint8_t protocol;    /* IPPROTO_TCP, or IPPROTO_UDP for the port */
+    struct application *app;
+};
+
+/* Sockets found since the last map was published, waiting for the next one.
+ * Without a refresh in the meantime they get one of their own once due. */
+static std::vector<struct found_socket> found_sockets;
+static std::chrono::steady_clock::time_point found_sockets_due;
+
+/* Guard the process events of the listener thread. events_lost is set when
+ * some never made it into the queue, until the next walk of /proc. */
+static std::mutex event_lock;
+static std::vector<struct process_event> event_queue;
+static bool events_live = false;
+static bool events_lost = false;
+
+/* When the whole map was last built, looking up single flows only ever adds
+ * sockets so it is rebuilt every so often to drop those that closed. */
+static time_t last_full_refresh = 0;
+
+/* sock_diag socket of the refresh thread, opened on first use. Once it
+ * turned out not to work the /proc/net tables are read instead. */
+static int diag_fd = -1;
+static bool diag_failed = false;
+
+/* Points every socket inode of the cached processes at their application */
+static void fill_process_map() {
+    temp_process_map.clear();
 
-void refresh_proc_mappings() {
-    /* TODO: lazy? Could we avoid having to deallocate all these pointers?
-     * Perhaps keep a running set of pid's in /proc and only refresh all if we
-     * can't find the new socket in a new pid folder? */
-    g_packet_process_map.clear();
+    for (const auto &entry : pid_cache) {
+        if (entry.second.app < 0) continue;
 
-    refresh_proc_pid_mapping();
-    refresh_proc_net_mapping("/proc/net/tcp");
-    refresh_proc_net_mapping("/proc/net/udp");
-    refresh_proc_net_mapping("/proc/net/raw");
-    for (const auto &elem : temp_inode_map) {
-        auto found = temp_process_map.find(elem.second);
+        for (unsigned long inode : entry.second.inodes)
+            temp_process_map[inode] = entry.second.app;
+    }
+}
+
+/* Remembers which of the sockets just read from /proc/net no cached process
+ * owns. Returns true if any of them was not unowned the last time already. */
+static bool update_unowned_inodes() {
+    std::unordered_set<unsigned long> unowned;
+    auto check = [&unowned](unsigned long inode) {
+        if (inode != 0 && temp_process_map.count(inode) == 0)
+            unowned.insert(inode);
+    };
+
+    temp_inode_map.for_each(
+        [&check](const struct flow_key &key, unsigned long inode) {
+            check(inode);
+        });
+    for (unsigned long inode : temp_udp_port_map) check(inode);
+
+    bool changed = false;
+    for (unsigned long inode : unowned)
+        if (unowned_inodes.count(inode) == 0) changed = true;
+
+    unowned_inodes.swap(unowned);
+    return changed;
+}
+
+/* Applies the queued process events to the pid cache. Forked and execed
+ * processes are marked to be scanned, exited ones to be dropped once the
+ * next map is published with their sockets in it. walking is true
+ * when /proc is walked right after, which catches up on any lost events.
+ * Returns true if the cache is known to hold every process without a walk. */
+static bool apply_process_events(bool walking) {
+    std::vector<struct process_event> events;
+    bool complete;
+    {
+        std::unique_lock<std::mutex> lock(event_lock);
+        events.swap(event_queue);
+        complete = events_live && !events_lost;
+        if (walking) events_lost = false;
+    }
+
+    for (const struct process_event &event : events) {
+        if (event.type == PROCESS_EXITED) {
+            auto exited = pid_cache.find(event.pid);
+            if (exited != pid_cache.end()) exited->second.exited = true;
+            continue;
+        }
+
+        struct pid_entry &cached = pid_cache[event.pid];
+        cached.seen = 0;
+        cached.exited = false;
+
+        if (event.type == PROCESS_EXECED) {
+            memcpy(cached.comm, event.comm, sizeof(cached.comm));
+            continue;
+        }
+
+        /* A fork runs the same program until it execs, if ever */
+        auto parent = pid_cache.find(event.parent);
+        if (parent != pid_cache.end())
+            memcpy(cached.comm, parent->second.comm, sizeof(cached.comm));
+        else
+            cached.comm[0] = '\0';
+    }
+
+    return complete;
+}
+
+/* Scans the cached processes that events or their number of open files say
+ * changed, without walking /proc for new ones. Only valid while
+ * apply_process_events() says the cache is complete. */
+static void refresh_changed_pids() {
+    pid_scan++;
+    size_t rescanned = 0;
+
+    char pid[16], fd_dir_name[30];
+    for (auto &entry : pid_cache) {
+        struct pid_entry &cached = entry.second;
+        if (cached.exited) continue;
+
+        snprintf(pid, sizeof(pid), "%d", entry.first);
+        snprintf(fd_dir_name, sizeof(fd_dir_name), "/proc/%s/fd", pid);
+
+        /* Gone already, its exit event is still on the way */
+        struct stat fd_dir;
+        if (stat(fd_dir_name, &fd_dir) < 0) {
+            cached.exited = true;
+            continue;
+        }
+
+        if (cached.seen == 0 || cached.fd_count != fd_dir.st_size) {
+            cached.fd_count = fd_dir.st_size;
+            handle_pid_dir(pid, &cached);
+            rescanned++;
+        }
+
+        cached.seen = pid_scan;
+    }
+
+    if (g_args.debug)
+        fprintf(g_log, "Rescanned %zu of %zu processes after events\n",
+                rescanned, pid_cache.size());
+
+    fill_process_map();
+}
+
+/* Reads the file descriptors of the processes events just said forked or
+ * execed, before they get the chance to exit again. Their sockets are only
+ * mapped by the next refresh, but are known to it even if they are gone by
+ * then. */
+static void refresh_event_pids() {
+    apply_process_events(false);
+
+    size_t scanned = 0;
+    char pid[16], fd_dir_name[30];
+    for (auto &entry : pid_cache) {
+        struct pid_entry &cached = entry.second;
+        if (cached.seen != 0 || cached.exited) continue;
+
+        snprintf(pid, sizeof(pid), "%d", entry.first);
+        snprintf(fd_dir_name, sizeof(fd_dir_name), "/proc/%s/fd", pid);
+
+        struct stat fd_dir;
+        if (stat(fd_dir_name, &fd_dir) < 0) {
+            cached.exited = true;
+            continue;
+        }
+
+        cached.fd_count = fd_dir.st_size;
+        handle_pid_dir(pid, &cached);
+        cached.seen = pid_scan;
+        scanned++;
+    }
+
+    if (g_args.verbose)
+        fprintf(g_log, "Scanned %zu processes after events\n", scanned);
+}
+
+/* Drops the processes that exited, once a map with their sockets is out */
+static void drop_exited_pids() {
+    for (auto it = pid_cache.begin(); it != pid_cache.end();) {
+        if (it->second.exited)
+            it = pid_cache.erase(it);
+        else
+            ++it;
+    }
+}
+
+/* Reads the file descriptors of every cached process again */
+static void rescan_all_pids() {
+    char pid[16];
+    for (auto &entry : pid_cache) {
+        if (entry.second.exited) continue;
+
+        snprintf(pid, sizeof(pid), "%d", entry.first);
+        handle_pid_dir(pid, &entry.second);
+    }
+
+    fill_process_map();
+}
+
+/* Returns true if sock_diag can be used, opening diag_fd if needed */
+static bool sock_diag_available() {
+    if (diag_fd >= 0) return true;
+    if (diag_failed) return false;
+
+    diag_fd = sock_diag_open();
+    if (diag_fd < 0) {
+        diag_failed = true;
+        fprintf(g_log, "Reading sockets from /proc/net instead\n");
+        return false;
+    }
+
+    return true;
+}
+
+/* Gives up on sock_diag after a failed request */
+static void sock_diag_disable(const char *request) {
+    fprintf(g_log,
+            "sock_diag %s failed: %s, reading sockets from /proc/net "
+            "instead\n",
+            request, strerror(errno));
+
+    close(diag_fd);
+    diag_fd = -1;
+    diag_failed = true;
+}
+
+static void handle_diag_socket(const struct diag_socket *socket,
+                               int protocol) {
+    add_socket(&socket->key, socket->inode, protocol);
+}
+
+/* Dumps every TCP and UDP socket over sock_diag. Returns -1 if that failed
+ * and the /proc/net tables have to be read instead. */
+static int refresh_diag_sockets(bool ipv6) {
+    if (!sock_diag_available()) return -1;
+
+    /* TIME_WAIT and half open sockets have no inode yet, and listening ones
+     * carry no packets of their own. Unconnected UDP sockets are closed. */
+    uint32_t tcp_states = ~((1u << TCP_TIME_WAIT) | (1u << TCP_SYN_RECV) |
+                            (1u << TCP_LISTEN));
+
+    int families[] = {AF_INET, AF_INET6};
+    for (int family : families) {
+        if (family == AF_INET6 && !ipv6) continue;
+
+        if (sock_diag_dump(diag_fd, family, IPPROTO_TCP, tcp_states,
+                           handle_diag_socket) < 0 ||
+            sock_diag_dump(diag_fd, family, IPPROTO_UDP, ~0u,
+                           handle_diag_socket) < 0) {
+            sock_diag_disable("dump");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Returns true if the socket is only known by its local port */
+static bool socket_is_unconnected(const struct flow_key *key) {
+    return (ip_is_unspecified(&key->local_ip) ||
+            ip_is_unspecified(&key->remote_ip)) &&
+           key->local_port != 0;
+}
+
+/* Queues a socket for the next map published */
+static void add_found_socket(const struct flow_key *key, int protocol,
+                             struct application *app) {
+    if (found_sockets.empty())
+        found_sockets_due = std::chrono::steady_clock::now() +
+                            std::chrono::milliseconds(PROC_PUBLISH_DELAY_MS);
+
+    found_sockets.push_back({*key, (uint8_t)protocol, app});
+}
+
+/* Returns true if the map already gives the socket to its application */
+static bool found_socket_known(const struct process_map *map,
+                               const struct found_socket &socket) {
+    if (socket.protocol == IPPROTO_UDP)
+        return map->udp_ports[socket.key.local_port] == socket.app;
+
+    const uint32_t *found = map->flows.find(socket.key);
+    return found != NULL && *found == socket.app->index;
+}
+
+/* Adds the waiting sockets to a map about to be published. Added last, a
+ * whole refresh would drop the sockets that were already closed again. */
+static void add_found_sockets(struct process_map *map) {
+    size_t added = 0;
+    for (const struct found_socket &socket : found_sockets) {
+        if (found_socket_known(map, socket)) continue;
+
+        if (socket.protocol == IPPROTO_UDP)
+            map->udp_ports[socket.key.local_port] = socket.app;
+        else
+            map->flows[socket.key] = socket.app->index;
+        added++;
+    }
+
+    if (g_args.debug && added > 0)
+        fprintf(g_log, "Added %zu sockets found on their own\n", added);
+
+    found_sockets.clear();
+}
+
+/* Adds every socket collected in temp_inode_map and temp_udp_port_map that a
+ * process owns to the map, and empties both. */
+static void add_owned_sockets(struct process_map *map) {
+    for (size_t port = 0; port < temp_udp_port_map.size(); port++) {
+        unsigned long inode = temp_udp_port_map[port];
+        if (inode == 0) continue;
+
+        auto found = temp_process_map.find(inode);
+        if (found != temp_process_map.end())
+            map->udp_ports[port] = g_applications[found->second].get();
+
+        temp_udp_port_map[port] = 0;
+    }
+
+    temp_inode_map.for_each([map](const struct flow_key &key,
+                                  unsigned long inode) {
+        auto found = temp_process_map.find(inode);
         if (found != temp_process_map.end())
-            g_packet_process_map[elem.first] = found->second;
+            map->flows[key] = found->second;
         else {
-            if (g_args.debug)
+            if (g_args.debug) {
+                char hash[HASHKEYSIZE];
                 fprintf(
                     g_log,
                     "Could not find socket with inode %lu in any corresponding "
                     "/proc/pid/fd, with hash %s\n",
-                    elem.second, elem.first.c_str());
+                    inode, flow_key_to_string(&key, hash));
+            }
         }
-    }
+    });
 
-    /* Should we clear these? Perhaps reuse some for efficiency */
     temp_inode_map.clear();
     temp_process_map.clear();
 }
 
+void refresh_proc_mappings() {
+    struct process_map *old = g_packet_process_map.load();
+
+    /* Sized for as many sockets as last time, so it rarely has to grow */
+    struct process_map *map = new struct process_map(old->flows.size() * 2);
+    last_full_refresh = std::time(NULL);
+
+    /* The sockets are read before the processes, a socket created in
+     * between is simply left for the next refresh. The ipv6 tables are
+     * missing when ipv6 is disabled in the kernel. */
+    bool ipv6 = access("/proc/net/tcp6", R_OK) == 0;
+    if (refresh_diag_sockets(ipv6) < 0) {
+        refresh_proc_net_mapping("/proc/net/tcp", IPPROTO_TCP);
+        refresh_proc_net_mapping("/proc/net/udp", IPPROTO_UDP);
+
+        if (ipv6) {
+            refresh_proc_net_mapping("/proc/net/tcp6", IPPROTO_TCP);
+            refresh_proc_net_mapping("/proc/net/udp6", IPPROTO_UDP);
+        }
+    }
+
+    refresh_proc_net_mapping("/proc/net/raw", IPPROTO_RAW);
+    if (ipv6) refresh_proc_net_mapping("/proc/net/raw6", IPPROTO_RAW);
+
+    refresh_proc_pid_mapping();
+
+    /* A process can swap a socket for another without its number of open
+     * files changing, or run on a kernel that doesn't count them. New
+     * sockets without an owner are the only sign of that, so only then is
+     * every process read again. */
+    if (update_unowned_inodes()) {
+        if (g_args.debug)
+            fprintf(g_log, "Found new unowned sockets, rescanning all %zu "
+                           "processes\n",
+                    pid_cache.size());
+
+        rescan_all_pids();
+        update_unowned_inodes();
+    }
+
+    add_owned_sockets(map);
+    add_found_sockets(map);
+    process_map_publish(map);
+}
+
+int refresh_proc_flows(const std::vector<struct flow_lookup> &lookups) {
+    if (std::time(NULL) - last_full_refresh >= PROC_FULL_REFRESH_INTERVAL ||
+        !sock_diag_available())
+        return -1;
+
+    std::vector<std::pair<struct diag_socket, int>> sockets;
+    for (const struct flow_lookup &lookup : lookups) {
+        struct diag_socket socket;
+        int found =
+            sock_diag_find(diag_fd, &lookup.key, lookup.protocol, &socket);
+        if (found < 0) {
+            sock_diag_disable("lookup");
+            return -1;
+        }
+
+        /* The socket is gone, or the flow was never ours */
+        if (found == 0 || socket.inode == 0) continue;
+
+        if (g_args.verbose)
+            fprintf(g_log, "Found socket with inode %lu of uid %u\n",
+                    socket.inode, socket.uid);
+
+        sockets.push_back({socket, lookup.protocol});
+    }
+
+    if (sockets.empty()) return 0;
+
+    if (apply_process_events(false))
+        refresh_changed_pids();
+    else
+        refresh_proc_pid_mapping();
+
+    /* Same as for a whole refresh, a socket nobody seems to own means some
+     * process changed without its number of open files changing. */
+    for (const auto &found : sockets) {
+        if (temp_process_map.count(found.first.inode) == 0) {
+            rescan_all_pids();
+            break;
+        }
+    }
+
+    /* Everything in the current map still holds. Rather than copying all of
+     * it for a few sockets, they wait for the next map published. */
+    for (const auto &found : sockets) {
+        const struct diag_socket &socket = found.first;
+        auto owner = temp_process_map.find(socket.inode);
+        if (owner == temp_process_map.end()) continue;
+
+        struct application *app = g_applications[owner->second].get();
+        if (!socket_is_unconnected(&socket.key))
+            add_found_socket(&socket.key, found.second, app);
+        else if (found.second == IPPROTO_UDP)
+            add_found_socket(&socket.key, IPPROTO_UDP, app);
+    }
+    temp_process_map.clear();
+
+    return 0;
+}
+
+void process_map_publish(struct process_map *map) {
+    struct process_map *old = g_packet_process_map.load();
+
+    if (g_unattributed == NULL)
+        g_unattributed = get_or_create_application("unattributed");
+
+    map->apps.clear();
+    for (const auto &app : g_applications) map->apps.push_back(app.get());
+    map->generation = old->generation + 1;
+
+    g_packet_process_map.store(map);
+
+    /* Capture threads may still be looking packets up in the old map */
+    rcu_synchronize();
+    delete old;
+
+    drop_exited_pids();
+}
+
+void request_proc_refresh() {
+    std::unique_lock<std::mutex> lock(refresh_lock);
+    refresh_requested = true;
+    refresh_wanted.notify_one();
+}
+
+void request_proc_lookup(const struct flow_lookup *lookups, size_t count) {
+    std::unique_lock<std::mutex> lock(refresh_lock);
+    if (lookup_queue.size() + count > PROC_LOOKUP_MAX)
+        refresh_requested = true;
+    else
+        lookup_queue.insert(lookup_queue.end(), lookups, lookups + count);
+    refresh_wanted.notify_one();
+}
+
+void request_socket_owners(const struct socket_owner *owners, size_t count) {
+    std::unique_lock<std::mutex> lock(refresh_lock);
+    if (owner_queue.size() + count > PROC_OWNERS_MAX) return;
+
+    owner_queue.insert(owner_queue.end(), owners, owners + count);
+    refresh_wanted.notify_one();
+}
+
+/* Publishes a copy of the current map with the waiting sockets added,
+ * unless it already has every one of them */
+static void publish_found_sockets() {
+    struct process_map *current = g_packet_process_map.load();
+
+    bool known = std::all_of(found_sockets.begin(), found_sockets.end(),
+                             [current](const struct found_socket &socket) {
+                                 return found_socket_known(current, socket);
+                             });
+    if (known) {
+        found_sockets.clear();
+        return;
+    }
+
+    struct process_map *map = new struct process_map(*current);
+    add_found_sockets(map);
+    process_map_publish(map);
+}
+
+void process_event_push(const struct process_event *event) {
+    {
+        std::unique_lock<std::mutex> lock(event_lock);
+        if (event_queue.size() >= PROC_EVENTS_MAX) {
+            event_queue.clear();
+            events_lost = true;
+        }
+
+        if (events_lost) return;
+        event_queue.push_back(*event);
+    }
+
+    /* Exits have nothing to read, they wait for whatever comes next */
+    if (event->type == PROCESS_EXITED) return;
+
+    std::unique_lock<std::mutex> lock(refresh_lock);
+    if (events_queued) return;
+
+    events_queued = true;
+    refresh_wanted.notify_one();
+}
+
+void process_events_set_live(bool live) {
+    std::unique_lock<std::mutex> lock(event_lock);
+    events_live = live;
+    events_lost = true;
+}
+
+void process_events_lost() {
+    std::unique_lock<std::mutex> lock(event_lock);
+    event_queue.clear();
+    events_lost = true;
+}
+
+void proc_refresh_loop() {
+    std::vector<struct flow_lookup> lookups;
+    std::vector<struct socket_owner> owners;
+
+    while (1) {
+        bool full, events;
+        {
+            /* Sockets already found only need a wake once they are due */
+            std::unique_lock<std::mutex> lock(refresh_lock);
+            auto wanted = [] {
+                return refresh_requested || events_queued ||
+                       (found_sockets.empty() &&
+                        (!lookup_queue.empty() || !owner_queue.empty()));
+            };
+            if (found_sockets.empty())
+                refresh_wanted.wait(lock, wanted);
+            else
+                refresh_wanted.wait_until(lock, found_sockets_due, wanted);
+
+            full = refresh_requested;
+            refresh_requested = false;
+            events = events_queued;
+            events_queued = false;
+            lookups.swap(lookup_queue);
+            lookup_queue.clear();
+            owners.swap(owner_queue);
+            owner_queue.clear();
+        }
+
+        for (const struct socket_owner &owner : owners)
+            add_found_socket(&owner.key, owner.protocol,
+                             get_or_create_application(owner.comm));
+        owners.clear();
+
+        if (events) refresh_event_pids();
+
+        if (full || (!lookups.empty() && refresh_proc_flows(lookups) < 0))
+            refresh_proc_mappings();
+        lookups.clear();
+
+        /* Any whole refresh above took the found sockets along already */
+        if (!found_sockets.empty() &&
+            (found_sockets.size() >= PROC_OWNERS_MAX ||
+             std::chrono::steady_clock::now() >= found_sockets_due))
+            publish_found_sockets();
+    }
+}
+
+struct application *get_or_create_application(const char *name) {
+    auto found = g_application_index.emplace(name, g_applications.size());
+    if (!found.second) return g_applications[found.first->second].get();
+
+    struct application *app = new struct application(name);
+    app->index = found.first->second;
+    g_applications.emplace_back(app);
+
+    return app;
+}
+
+/* Unpacks an address from a /proc/net table. ipv4 addresses are 8 hex digits
+ * and ipv6 ones 32, both made of 32 bit words in host byte order. Returns 0 on
+ * success, -1 if the address is malformed. */
+static int unpack_proc_net_address(const char *packed, struct in6_addr *ip) {
+    size_t len = strlen(packed);
+    if (len != 8 && len != 32) return -1;
+
+    uint32_t words[4];
+    for (size_t i = 0; i < len / 8; i++) {
+        char word[9];
+        memcpy(word, packed + i * 8, 8);
+        word[8] = '\0';
+        words[i] = strtoul(word, NULL, 16);
+    }
+
+    if (len == 8)
+        ip_from_ipv4(ip, words[0]);
+    else
+        memcpy(ip->s6_addr32, words, sizeof(words));
+
+    return 0;
+}
+
+/* Value of a hex digit, without a branch: '0'-'9' only have the low nibble
+ * set, 'A'-'F' and 'a'-'f' have bit 6 set and a low nibble 9 short. */
+static inline uint32_t hex_digit(unsigned char c) {
+    return (c & 0xf) + 9 * (c >> 6);
+}
+
+/* Decodes the 8 hex digits at p, the first being the most significant. On
+ * little endian all 8 are converted at once in a single 64 bit word and
+ * their nibbles then packed together pairwise. */
+static inline uint32_t hex_word(const char *p) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+
+    const uint64_t nibbles = 0x0f0f0f0f0f0f0f0full;
+    const uint64_t pairs = 0x000f000f000f000full;
+    const uint64_t bytes = 0x000000ff000000ffull;
+
+    v = (v & nibbles) + 9 * ((v >> 6) & 0x0101010101010101ull);
+    v = ((v & pairs) << 4) | ((v >> 8) & pairs);
+    v = ((v & bytes) << 8) | ((v >> 16) & bytes);
+    return (uint32_t)(((v & 0xffff) << 16) | ((v >> 32) & 0xffff));
+#else
+    uint32_t value = 0;
+    for (int i = 0; i < 8; i++) value = value << 4 | hex_digit(p[i]);
+    return value;
+#endif
+}
+
+/* Parses an "address:port" column at p, the address being 8 or 32 hex digits
+ * and the port 4. Returns a pointer past it, or NULL if malformed. */
+static const char *parse_proc_net_endpoint(const char *p, const char *end,
+                                           struct in6_addr *ip,
+                                           uint16_t *port) {
+    const char *colon = (const char *)memchr(p, ':', end - p);
+    if (colon == NULL || end - colon < 5) return NULL;
+
+    if (colon - p == 8) {
+        ip_from_ipv4(ip, hex_word(p));
+    } else if (colon - p == 32) {
+        for (int i = 0; i < 4; i++) ip->s6_addr32[i] = hex_word(p + i * 8);
+    } else {
+        return NULL;
+    }
+
+    const char *digits = colon + 1;
+    *port = hex_digit(digits[0]) << 12 | hex_digit(digits[1]) << 8 |
+            hex_digit(digits[2]) << 4 | hex_digit(digits[3]);
+
+    return digits + 4;
+}
+
+static inline const char *skip_spaces(const char *p, const char *end) {
+    while (p < end && *p == ' ') p++;
+    return p;
+}
+
+int parse_proc_net_line(const char *line, const char *end,
+                        struct flow_key *key, unsigned long *inode) {
+    /* "sl:" */
+    const char *p = skip_spaces(line, end);
+    p = (const char *)memchr(p, ':', end - p);
+    if (p == NULL) return -1;
+
+    p = parse_proc_net_endpoint(skip_spaces(p + 1, end), end, &key->local_ip,
+                                &key->local_port);
+    if (p == NULL) return -1;
+
+    p = parse_proc_net_endpoint(skip_spaces(p, end), end, &key->remote_ip,
+                                &key->remote_port);
+    if (p == NULL) return -1;
+
+    /* st, tx_queue:rx_queue, tr:tm->when, retrnsmt, uid and timeout */
+    for (int i = 0; i < 6; i++) {
+        p = skip_spaces(p, end);
+        while (p < end && *p != ' ') p++;
+    }
+
+    p = skip_spaces(p, end);
+    if (p == end || *p < '0' || *p > '9') return -1;
+
+    unsigned long value = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+        value = value * 10 + (*p - '0');
+    *inode = value;
+
+    return 0;
+}
+
 /* Credit to nethogs for a lot of these ideas.
- * https://github.com/raboof/nethogs */
-void handle_proc_net_line(const char *buffer) {
+ * https://github.com/raboof/nethogs
+ * Parses a line with sscanf, only kept to compare parse_proc_net_line()
+ * against in the benchmark. */
+static int scan_proc_net_line(const char *buffer, struct flow_key *key,
+                              unsigned long *inode) {
     char packed_source[64], packed_dest[64];
     int source_port, dest_port;
-    unsigned long inode;
 
     /* Unpack the information from a /proc/net/tcp line. */
     int matches =
         sscanf(buffer,
-               "%*d: %64[0-9A-Fa-f]:%X %64[0-9A-Fa-f]:%X %*X "
+               "%*d: %63[0-9A-Fa-f]:%X %63[0-9A-Fa-f]:%X %*X "
                "%*X:%*X %*X:%*X %*X %*d %*d %ld %*512s\n",
-               packed_source, &source_port, packed_dest, &dest_port, &inode);
+               packed_source, &source_port, packed_dest, &dest_port, inode);
+
+    if (matches != 5 || source_port > 65535 || dest_port > 65535) return -1;
+
+    /* packet hash is sip:sport-dip:dport */
+    if (unpack_proc_net_address(packed_source, &key->local_ip) < 0 ||
+        unpack_proc_net_address(packed_dest, &key->remote_ip) < 0)
+        return -1;
+    key->local_port = source_port;
+    key->remote_port = dest_port;
 
-    if (matches != 5) {
+    return 0;
+}
+
+void handle_proc_net_line(const char *buffer, int protocol) {
+    struct flow_key key;
+    unsigned long inode;
+    if (parse_proc_net_line(buffer, buffer + strlen(buffer), &key, &inode) <
+        0) {
         fprintf(g_log, "Malformed line buffer from handle_proc_net_line\n");
         return;
     }
 
+    add_socket(&key, inode, protocol);
+}
+
+void add_socket(const struct flow_key *key, unsigned long inode,
+                int protocol) {
     /* Don't update map if the socket is in TIME_WAIT state. */
     if (inode == 0) return;
 
-    struct in_addr source_ip, dest_ip;
-    sscanf(packed_source, "%X", &source_ip.s_addr);
-    sscanf(packed_dest, "%X", &dest_ip.s_addr);
-
     /* Unconnected UDP streams will appear in /proc/net/udp as having a local
      * address of 0.0.0.0:port and a rem address of 0.0.0.0:0 making it
      * impossible to identify these streams while capturing packets with our
-     * normal packet hash method. These streams will uniquely have only the UDP
-     * port number as the key as opposed to the entire packet hash. Will only be
-     * accessed by udp packets. */
-    if ((source_ip.s_addr == 0 || dest_ip.s_addr == 0) && source_port != 0) {
-        char port_hash[10];
-        snprintf(port_hash, 10, "UDP-%d", source_port);
+     * normal packet hash method. These streams are only known by their port,
+     * which indexes the udp_ports table of the map directly. Listening TCP
+     * and unbound raw sockets look the same but never carry a packet of
+     * their own, so they are left out. */
+    if (socket_is_unconnected(key)) {
+        if (protocol != IPPROTO_UDP) return;
 
         if (g_args.verbose)
             fprintf(g_log, "Adding unconnected UDP Stream with port %d\n",
-                    source_port);
+                    key->local_port);
 
-        temp_inode_map[port_hash] = inode;
+        temp_udp_port_map[key->local_port] = inode;
         return;
     }
 
-    /* packet hash is sip:sport-dip:dport */
-    char hash[HASHKEYSIZE];
-    char source_str[INET6_ADDRSTRLEN], dest_str[INET6_ADDRSTRLEN];
+    if (g_args.verbose) {
+        char hash[HASHKEYSIZE];
+        fprintf(g_log, "HASH: %s\n", flow_key_to_string(key, hash));
+    }
 
-    inet_ntop(AF_INET, &source_ip, source_str, INET6_ADDRSTRLEN);
-    inet_ntop(AF_INET, &dest_ip, dest_str, INET6_ADDRSTRLEN);
+    temp_inode_map[*key] = inode;
+}
 
-    snprintf(hash, HASHKEYSIZE, "%s:%d-%s:%d", source_str, source_port,
-             dest_str, dest_port);
+/* Reads the whole file into buffer, which is reused and only ever grows.
+ * Returns the number of bytes read, or -1 on failure. */
+static ssize_t read_whole_file(const char *filename,
+                               std::vector<char> &buffer) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
 
-    if (g_args.verbose)
-        fprintf(
-            g_log, "HASHKEYSIZE: %d HASH: %s, | \tsource %s:%d \tdest %s:%d\n",
-            HASHKEYSIZE, hash, source_str, source_port, dest_str, dest_port);
+    if (buffer.empty()) buffer.resize(1 << 18);
+
+    size_t len = 0;
+    while (1) {
+        if (len == buffer.size()) buffer.resize(buffer.size() * 2);
+
+        ssize_t ret = read(fd, buffer.data() + len, buffer.size() - len);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+
+            close(fd);
+            return -1;
+        }
+        if (ret == 0) break;
 
-    temp_inode_map[hash] = inode;
+        len += ret;
+    }
+
+    close(fd);
+    return len;
 }
 
-void refresh_proc_net_mapping(const char *filename) {
-    FILE *proc_net = fopen(filename, "r");
-    if (proc_net == NULL) {
+/* Calls f(line, end) for every line of the table in buffer after the header,
+ * end pointing at its newline. Returns the number of lines. */
+template <typename F>
+static size_t for_each_proc_net_line(const char *buffer, size_t len, F f) {
+    const char *end = buffer + len;
+    const char *line = (const char *)memchr(buffer, '\n', len);
+    if (line == NULL) return 0;
+
+    size_t lines = 0;
+    for (line++; line < end;) {
+        const char *newline = (const char *)memchr(line, '\n', end - line);
+        if (newline == NULL) newline = end;
+
+        f(line, newline);
+        lines++;
+        line = newline + 1;
+    }
+
+    return lines;
+}
+
+void refresh_proc_net_mapping(const char *filename, int protocol) {
+    /* Kept between refreshes, a table is read with a handful of reads */
+    static std::vector<char> buffer;
+
+    ssize_t len = read_whole_file(filename, buffer);
+    if (len < 0) {
         fprintf(g_log, "Could not access %s, error: %s, exiting.", filename,
                 strerror(errno));
         exit(1);
     }
 
-    char buffer[8192];
+    for_each_proc_net_line(
+        buffer.data(), len, [protocol](const char *line, const char *end) {
+            struct flow_key key;
+            unsigned long inode;
+            if (parse_proc_net_line(line, end, &key, &inode) < 0) {
+                fprintf(g_log, "Malformed line in /proc/net table\n");
+                return;
+            }
 
-    // First line is the header, unneeded.
-    fgets(buffer, sizeof(buffer), proc_net);
+            add_socket(&key, inode, protocol);
+        });
+}
 
-    do {
-        if (fgets(buffer, sizeof(buffer), proc_net)) {
-            handle_proc_net_line(buffer);
-        }
-    } while (!feof(proc_net));
+int bench_proc_net(const char *filename) {
+    std::vector<char> buffer;
+    ssize_t len = read_whole_file(filename, buffer);
+    if (len < 0) {
+        fprintf(g_log, "Could not read %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    /* sscanf needs its lines terminated */
+    std::vector<std::string> lines;
+    for_each_proc_net_line(buffer.data(), len,
+                           [&lines](const char *line, const char *end) {
+                               lines.emplace_back(line, end);
+                           });
+    if (lines.empty()) {
+        fprintf(g_log, "%s holds no sockets\n", filename);
+        return -1;
+    }
 
-    fclose(proc_net);
+    /* Both parsers have to agree on every line first */
+    size_t mismatches = 0;
+    for (const std::string &line : lines) {
+        struct flow_key scanned, parsed;
+        unsigned long scanned_inode = 0, parsed_inode = 0;
+        memset(&scanned, 0, sizeof(scanned));
+        memset(&parsed, 0, sizeof(parsed));
+
+        int scan_ret = scan_proc_net_line(line.c_str(), &scanned,
+                                          &scanned_inode);
+        int parse_ret = parse_proc_net_line(
+            line.data(), line.data() + line.size(), &parsed, &parsed_inode);
+        if (scan_ret != parse_ret ||
+            (scan_ret == 0 &&
+             (!(scanned == parsed) || scanned_inode != parsed_inode)))
+            mismatches++;
+    }
+
+    /* Enough rounds for about a million lines */
+    size_t rounds = std::max<size_t>(1, 1000000 / lines.size());
+    struct flow_key key;
+    unsigned long inode, checksum = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; round++)
+        for (const std::string &line : lines)
+            if (scan_proc_net_line(line.c_str(), &key, &inode) == 0)
+                checksum += inode;
+    auto scanned = std::chrono::steady_clock::now();
+
+    for (size_t round = 0; round < rounds; round++)
+        for_each_proc_net_line(buffer.data(), len,
+                               [&](const char *line, const char *end) {
+                                   if (parse_proc_net_line(line, end, &key,
+                                                           &inode) == 0)
+                                       checksum += inode;
+                               });
+    auto parsed = std::chrono::steady_clock::now();
+
+    double total = (double)rounds * lines.size();
+    double scan_s = std::chrono::duration<double>(scanned - start).count();
+    double parse_s = std::chrono::duration<double>(parsed - scanned).count();
+
+    fprintf(g_log, "Parsed %zu lines of %s %zu times (checksum %lu)\n",
+            lines.size(), filename, rounds, checksum);
+    fprintf(g_log, "  sscanf:     %12.0f lines/s\n", total / scan_s);
+    fprintf(g_log, "  hex parser: %12.0f lines/s, %.1fx\n", total / parse_s,
+            scan_s / parse_s);
+    if (mismatches > 0)
+        fprintf(g_log, "  %zu lines parsed differently\n", mismatches);
+
+    return mismatches > 0 ? -1 : 0;
 }
 
 void refresh_proc_pid_mapping() {
@@ -159,15 +994,63 @@ void refresh_proc_pid_mapping() {
         std::exit(1);
     }
 
+    /* Without events, or after losing some, a process may have execed
+     * without us knowing so its comm is read again on a rescan */
+    bool events = apply_process_events(true);
+
+    pid_scan++;
+    size_t rescanned = 0;
+
     dirent *entry;
     while ((entry = readdir(proc))) {
-        if (entry_is_pid_dir(entry)) {
-            handle_pid_dir(entry->d_name);
-        } else {
+        if (!entry_is_pid_dir(entry)) continue;
+
+        unsigned long long start_time;
+        if (get_pid_start_time(entry->d_name, &start_time) < 0) continue;
+
+        /* On newer kernels the size of the fd directory is the number of
+         * open files, which is what changes when sockets come and go. */
+        pid_t pid = atoi(entry->d_name);
+        char fd_dir_name[30];
+        snprintf(fd_dir_name, sizeof(fd_dir_name), "/proc/%d/fd", pid);
+
+        struct stat fd_dir;
+        off_t fd_count = stat(fd_dir_name, &fd_dir) == 0 ? fd_dir.st_size : 0;
+
+        /* An exited process keeps its sockets until the next map is out, a
+         * new one under its pid comes with a fork event or a new start
+         * time. */
+        struct pid_entry &cached = pid_cache[pid];
+        if (cached.exited && (events || cached.start_time == start_time)) {
+            cached.seen = pid_scan;
             continue;
         }
+        cached.exited = false;
+
+        if (cached.seen == 0 || cached.start_time != start_time ||
+            cached.fd_count != fd_count) {
+            if (!events ||
+                (cached.start_time != 0 && cached.start_time != start_time))
+                cached.comm[0] = '\0';
+
+            cached.start_time = start_time;
+            cached.fd_count = fd_count;
+            handle_pid_dir(entry->d_name, &cached);
+            rescanned++;
+        }
+
+        cached.seen = pid_scan;
     }
     closedir(proc);
+
+    for (auto &entry : pid_cache)
+        if (entry.second.seen != pid_scan) entry.second.exited = true;
+
+    if (g_args.debug)
+        fprintf(g_log, "Rescanned %zu of %zu processes\n", rescanned,
+                pid_cache.size());
+
+    fill_process_map();
 }
 
 int entry_is_pid_dir(dirent *entry) {
@@ -181,7 +1064,10 @@ int entry_is_pid_dir(dirent *entry) {
     return 1;
 }
 
-void handle_pid_dir(const char *pid) {
+void handle_pid_dir(const char *pid, struct pid_entry *cached) {
+    cached->inodes.clear();
+    cached->app = -1;
+
     char fd_dir_name[30];
     size_t dirlen = 10 + strlen(pid);
     snprintf(fd_dir_name, dirlen, "/proc/%s/fd", pid);
@@ -197,19 +1083,6 @@ void handle_pid_dir(const char *pid) {
         return;
     }
 
-    int has_socket = 0, new_app = 0;
-    char comm[16];
-    get_comm_name(comm, pid);
-
-    std::shared_ptr<struct application> app;
-    auto found = g_application_map.find(comm);
-    if (found != g_application_map.end()) {
-        app = found->second;
-        new_app = 0;
-    } else {
-        new_app = 1;
-    }
-
     dirent *entry;
     while ((entry = readdir(fd_dir))) {
         /* file descriptors are always symbolic links */
@@ -228,19 +1101,15 @@ void handle_pid_dir(const char *pid) {
         if (strncmp(link_name, "socket:[", 8) == 0) {
             unsigned long inode = string_to_ulong(link_name + 8);
 
-            /* If this is the first socket found for the process, initalize
-             * application values. If we have already found a socket for this
-             * process, point its inode key to the same application. */
-            if (!has_socket && new_app) {
-                has_socket = 1;
-
-                app = std::make_shared<struct application>(comm);
-                db_insert_application(&(*app));
-
-                g_application_map[comm] = app;
+            /* If this is the first socket found for the process, find or
+             * initalize its application. Processes without any socket never
+             * need their comm read. */
+            if (cached->app < 0) {
+                if (cached->comm[0] == '\0') get_comm_name(cached->comm, pid);
+                cached->app = get_or_create_application(cached->comm)->index;
             }
 
-            temp_process_map[inode] = app;
+            cached->inodes.push_back(inode);
         }
     }
     closedir(fd_dir);
@@ -248,6 +1117,31 @@ void handle_pid_dir(const char *pid) {
     return;
 }
 
+int get_pid_start_time(const char *pid, unsigned long long *start_time) {
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/%s/stat", pid);
+
+    FILE *stat_file = fopen(path, "r");
+    if (stat_file == NULL) return -1;
+
+    char buffer[1024];
+    size_t len = fread(buffer, 1, sizeof(buffer) - 1, stat_file);
+    fclose(stat_file);
+    buffer[len] = '\0';
+
+    /* The comm in parentheses may hold spaces and parentheses itself, the
+     * fields after it start from the last ')'. starttime is the 20th. */
+    char *fields = strrchr(buffer, ')');
+    if (fields == NULL ||
+        sscanf(fields + 1,
+               " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d "
+               "%*d %*d %*d %*d %llu",
+               start_time) != 1)
+        return -1;
+
+    return 0;
+}
+
 void get_comm_name(char *target, const char *pid) {
     char path[21];
     snprintf(path, sizeof(path), "/proc/%s/comm", pid);
@@ -261,7 +1155,8 @@ void get_comm_name(char *target, const char *pid) {
         return;
     }
 
-    fscanf(comm, "%s", target);
+    /* target holds 16 chars, as much as the kernel keeps of a comm */
+    if (fscanf(comm, "%15s", target) != 1) target[0] = '\0';
 
     fclose(comm);
 }
@@ -2,14 +2,18 @@
 #define PROC_H
 
 #include <dirent.h>
+#include <netinet/in.h>
 #include <sys/types.h>
 
+#include <atomic>
 #include <memory>
-#include <mutex>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include "application.h"
+#include "flow_table.h"
+#include "packet.h"
 
 /* /proc/net/tcp lists information about all open sockets on your system.
  * To see for yourself, simply call "cat /proc/net/tcp" in your terminal!
@@ -19,42 +23,212 @@
 
 /* key idea: We need a way to connect a packet to a socket on the system.
  * The way we achieve this is by creating a map from information in
- * /proc/net/tcp & udp and connect a hash key based on source ip, source
- * port, dest ip, and dest port with its associated program that owns the
- * socket's inode.
+ * /proc/net/tcp & udp (and their ipv6 counterparts) and connect a hash key
+ * based on source ip, source port, dest ip, and dest port with its associated
+ * program that owns the socket's inode.
  */
-extern std::unordered_map<std::string, std::shared_ptr<struct application>>
-    g_packet_process_map;
-
-/* Instead of a packet hash being the key, this map has each applications name
- * from a pruned cmdline as a key. */
-extern std::unordered_map<std::string, std::shared_ptr<struct application>>
-    g_application_map;
-
-/* Lock for all maps that have a struct application pointer for a value.
- * Since they all share the same set of application pointers it makes sense to
- * just have a single mutex for all of them.
- * Not a reader/writer lock since when we dump the current intervals application
- * data into the database we also reset all of the values. */
-extern std::mutex g_applications_lock;
-
-/* Max length of packet hash key for g_packet_process_map */
-extern const int HASHKEYSIZE;
-
-/* Refresh both /proc/%d/fd for all pid's and /proc/net/tcp & udp.
+struct process_map {
+    flow_table<uint32_t> flows; /* packet hash to index into apps */
+
+    /* Unconnected UDP sockets are only known by their local port, so they
+     * get a table indexed by it directly instead of a hash lookup. NULL where
+     * no such socket is bound. */
+    std::vector<struct application *> udp_ports;
+
+    /* g_applications as it was when the map was published, so readers never
+     * touch the vector while it grows. */
+    std::vector<struct application *> apps;
+
+    unsigned long long generation; /* counts up with every published map */
+
+    explicit process_map(size_t capacity = 1024)
+        : flows(capacity), udp_ports(65536, NULL), generation(0) {}
+};
+
+/* Returns the application owning the socket of the flow in map, or NULL if
+ * there is none. UDP flows are checked against unconnected sockets first. */
+inline struct application *process_map_find(const struct process_map *map,
+                                            const struct flow_key *key,
+                                            bool udp) {
+    if (udp) {
+        struct application *app = map->udp_ports[key->local_port];
+        if (app != NULL) return app;
+    }
+
+    const uint32_t *found = map->flows.find(*key);
+    return found != NULL ? map->apps[*found] : NULL;
+}
+
+/* What the last scan of a process found, so the next refresh can skip it if
+ * nothing changed. A pid is only trusted to still be the same process while
+ * its start time is, or while process events say so. */
+struct pid_entry {
+    unsigned long long start_time; /* clock ticks after boot it started at */
+    off_t fd_count;        /* size of /proc/pid/fd, 0 on kernels before 6.2 */
+    int app;               /* index of its application, -1 without sockets */
+    std::vector<unsigned long> inodes; /* inodes of its open sockets */
+    unsigned long long seen; /* refresh it was last seen in, 0 to rescan */
+    bool exited;             /* gone, dropped once the next map is published */
+    char comm[16];           /* its comm, empty until read */
+};
+
+/* The current map. It is never modified once published, a refresh builds a
+ * new one off to the side and swaps it in with process_map_publish(). Read it
+ * inside an rcu read section, lookups never wait on a refresh. */
+extern std::atomic<struct process_map *> g_packet_process_map;
+
+/* Every application found so far, indexed by application->index. Only ever
+ * appended to, by whichever single thread refreshes the map. Other threads
+ * use the apps of a published map instead. The index is what traffic
+ * counters are kept by, an application never moves or gets freed. */
+extern std::vector<std::unique_ptr<struct application>> g_applications;
+
+/* Application that traffic never connected to a socket is accounted to, so
+ * it shows up instead of silently vanishing. Created with the first map that
+ * is published, before any capture starts. */
+extern struct application *g_unattributed;
+
+/* Interns application names, each pruned cmdline name maps to the index of
+ * its application in g_applications. */
+extern std::unordered_map<std::string, uint32_t> g_application_index;
+
+/* Returns the application with the given name, creating it and adding it to
+ * g_application_index and g_applications if it is new. Its database id is left
+ * at 0 for the database thread to fill in. Only called by the thread building
+ * the next map. */
+struct application *get_or_create_application(const char *name);
+
+/* Publishes a newly built map as g_packet_process_map, taking a snapshot of
+ * g_applications into it first. The map it replaces is freed once no reader
+ * can still be using it. Only one thread may publish at a time. */
+void process_map_publish(struct process_map *map);
+
+/* Asks the refresh thread to build a new map from /proc, returns right away.
+ * Requests made while a refresh is running are served by the next one. */
+void request_proc_refresh();
+
+/* Seconds after which looking up single flows is no longer enough and the
+ * whole map is built again, dropping sockets that were closed meanwhile */
+const int PROC_FULL_REFRESH_INTERVAL = 60;
+
+/* More flows than this waiting to be looked up are served by building the
+ * whole map instead */
+const size_t PROC_LOOKUP_MAX = 32;
+
+/* A flow whose socket a capture thread could not find */
+struct flow_lookup {
+    struct flow_key key; /* the flows key */
+    uint8_t protocol;    /* IPPROTO_TCP or IPPROTO_UDP */
+};
+
+/* Asks the refresh thread to find the sockets of the flows, returns right
+ * away. They are looked up one by one with refresh_proc_flows(), unless too
+ * many are waiting or that fails, then the whole map is refreshed. */
+void request_proc_lookup(const struct flow_lookup *lookups, size_t count);
+
+/* A socket and the application owning it, as traced in the kernel */
+struct socket_owner {
+    struct flow_key key; /* the flows key, for UDP only its local port */
+    uint8_t protocol;    /* IPPROTO_TCP or IPPROTO_UDP */
+    char comm[16];       /* comm of the process using the socket */
+};
+
+/* More traced owners than this waiting for the refresh thread are dropped,
+ * their flows are left to be found through /proc */
+const size_t PROC_OWNERS_MAX = 4096;
+
+/* Milliseconds sockets traced or looked up on their own wait for a refresh to
+ * publish them with, before they get a copy of the current map of their
+ * own */
+const int PROC_PUBLISH_DELAY_MS = 250;
+
+/* Asks the refresh thread to add the owners to the next map it publishes,
+ * returns right away. UDP owners take their whole local port. */
+void request_socket_owners(const struct socket_owner *owners, size_t count);
+
+/* A fork, exec or exit reported by the proc connector, see procevents.h */
+enum process_event_type { PROCESS_FORKED, PROCESS_EXECED, PROCESS_EXITED };
+
+struct process_event {
+    enum process_event_type type;
+    pid_t pid;     /* the process, never one of its other threads */
+    pid_t parent;  /* the process that forked it, for PROCESS_FORKED */
+    char comm[16]; /* its comm right after the exec, for PROCESS_EXECED */
+};
+
+/* More process events than this waiting for the refresh thread are dropped,
+ * the next refresh then walks /proc instead */
+const size_t PROC_EVENTS_MAX = 65536;
+
+/* Queues a process event for the refresh thread to apply to its pid cache.
+ * While events arrive, looking up single flows only visits processes the
+ * events or their number of open files say changed, without walking /proc.
+ * Forks inherit the comm of their parent and execs bring their own, so a
+ * process is named before its first socket is found. Forks and execs wake the
+ * refresh thread to read the sockets of the process while it still runs, an
+ * exited one keeps them until the next map is published. */
+void process_event_push(const struct process_event *event);
+
+/* Tells the refresh thread whether process events are being received. While
+ * they are not, or after some were lost, refreshes walk /proc to find new
+ * processes. */
+void process_events_set_live(bool live);
+void process_events_lost();
+
+/* Runs refresh_proc_mappings() or refresh_proc_flows() whenever either is
+ * requested. Sockets traced or looked up on their own are published with the
+ * next refresh, or with a copy of the current map once they waited
+ * PROC_PUBLISH_DELAY_MS or PROC_OWNERS_MAX of them are pending. Never
+ * returns. */
+void proc_refresh_loop();
+
+/* Refresh both /proc/%d/fd for all pid's and /proc/net/tcp & udp, plus tcp6
+ * & udp6 when the kernel has ipv6.
  * Creates map that has a key representing the a hash of the source ip & port,
- * and destination ip & port together. The values of the map are pointers to
- * applications. Results update g_packet_process_map*/
+ * and destination ip & port together. The values of the map are indices of
+ * applications. The new map is built without any lock and then published, so
+ * capture threads keep looking packets up in the old one meanwhile. */
 void refresh_proc_mappings();
 
-/* Refresh either /proc/net/tcp or /proc/net/udp */
-void refresh_proc_net_mapping(const char *filename);
-void handle_proc_net_line(const char *buffer);
-
-/* Refresh all file descriptors in each pid folder in /proc */
+/* Looks up the sockets of the flows over sock_diag, reading only processes
+ * that changed, and adds them to the next map published. Returns -1 if
+ * sock_diag can't be used or the map is due for a whole refresh, which is
+ * then left to the caller. */
+int refresh_proc_flows(const std::vector<struct flow_lookup> &lookups);
+
+/* Refresh a single /proc/net socket table such as /proc/net/tcp or
+ * /proc/net/udp6, protocol being the IPPROTO_* of its sockets. */
+void refresh_proc_net_mapping(const char *filename, int protocol);
+void handle_proc_net_line(const char *buffer, int protocol);
+
+/* Parses the line of a /proc/net/tcp, udp or raw table (or their ipv6
+ * counterparts) from line up to end into key and inode, without sscanf. The
+ * fixed width hex columns are decoded 8 digits at a time. Returns 0 on
+ * success, -1 if the line is malformed. */
+int parse_proc_net_line(const char *line, const char *end,
+                        struct flow_key *key, unsigned long *inode);
+
+/* Parses every line of the /proc/net table in filename with both sscanf and
+ * parse_proc_net_line(), checks they agree and prints the lines/s of each.
+ * Returns 0 on success, -1 on failure or if they disagree. */
+int bench_proc_net(const char *filename);
+
+/* Records a socket read from /proc/net or sock_diag for the next map */
+void add_socket(const struct flow_key *key, unsigned long inode, int protocol);
+
+/* Refresh the socket inodes of each pid folder in /proc. Only processes that
+ * are new, or whose number of open files changed, have their file
+ * descriptors read again, the rest come from the pid cache. Processes that
+ * exited are dropped from it. */
 void refresh_proc_pid_mapping();
 int entry_is_pid_dir(dirent *entry);
-void handle_pid_dir(const char *pid);
+
+/* Reads every file descriptor of pid into its cache entry */
+void handle_pid_dir(const char *pid, struct pid_entry *cached);
+
+/* Sets start_time to the start time of pid from /proc/pid/stat. Returns -1 if
+ * the process is gone. */
+int get_pid_start_time(const char *pid, unsigned long long *start_time);
 
 /* Get /proc/pid/comm for a process. This is the closest thing to the "name" of
  * the program as you can get other than the cmdline. Only issue is that some
@@ -0,0 +1,159 @@
+#include "procevents.h"
+
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/netlink.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include "omnis.h"
+#include "proc.h"
+
+/* Sends op, PROC_CN_MCAST_LISTEN or PROC_CN_MCAST_IGNORE, to the proc
+ * connector */
+static int proc_events_send(int fd, enum proc_cn_mcast_op op) {
+    alignas(struct nlmsghdr) char buffer[NLMSG_SPACE(sizeof(struct cn_msg) +
+                                                     sizeof(op))];
+    memset(buffer, 0, sizeof(buffer));
+
+    struct nlmsghdr *header = (struct nlmsghdr *)buffer;
+    header->nlmsg_len = NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(op));
+    header->nlmsg_type = NLMSG_DONE;
+    header->nlmsg_pid = getpid();
+
+    struct cn_msg *message = (struct cn_msg *)NLMSG_DATA(header);
+    message->id.idx = CN_IDX_PROC;
+    message->id.val = CN_VAL_PROC;
+    message->len = sizeof(op);
+    memcpy(message->data, &op, sizeof(op));
+
+    while (send(fd, buffer, header->nlmsg_len, 0) < 0) {
+        if (errno == EINTR) continue;
+
+        return -1;
+    }
+
+    return 0;
+}
+
+int proc_events_open() {
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+    if (fd < 0) {
+        fprintf(g_log, "Could not open proc connector socket: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = CN_IDX_PROC;
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(g_log, "Could not bind proc connector socket: %s\n",
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (proc_events_send(fd, PROC_CN_MCAST_LISTEN) < 0) {
+        fprintf(g_log, "Could not subscribe to process events: %s\n",
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Converts a proc connector event, returns false for the ones of no interest
+ * such as threads coming and going */
+static bool process_event_from_msg(struct process_event *event,
+                                   const struct proc_event *msg) {
+    char pid[16];
+
+    switch (msg->what) {
+        case proc_event::PROC_EVENT_FORK:
+            if (msg->event_data.fork.child_pid !=
+                msg->event_data.fork.child_tgid)
+                return false;
+
+            event->type = PROCESS_FORKED;
+            event->pid = msg->event_data.fork.child_tgid;
+            event->parent = msg->event_data.fork.parent_tgid;
+            return true;
+
+        case proc_event::PROC_EVENT_EXEC:
+            event->type = PROCESS_EXECED;
+            event->pid = msg->event_data.exec.process_tgid;
+
+            /* Read now, it may well be gone by the time its socket is found */
+            event->comm[0] = '\0';
+            snprintf(pid, sizeof(pid), "%d", event->pid);
+            get_comm_name(event->comm, pid);
+            return true;
+
+        case proc_event::PROC_EVENT_EXIT:
+            if (msg->event_data.exit.process_pid !=
+                msg->event_data.exit.process_tgid)
+                return false;
+
+            event->type = PROCESS_EXITED;
+            event->pid = msg->event_data.exit.process_tgid;
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+void proc_events_loop() {
+    int fd = proc_events_open();
+    if (fd < 0) {
+        fprintf(g_log, "New processes will only be found by walking /proc\n");
+        return;
+    }
+
+    process_events_set_live(true);
+
+    alignas(struct nlmsghdr) char buffer[16384];
+    while (1) {
+        ssize_t len = recv(fd, buffer, sizeof(buffer), 0);
+        if (len < 0) {
+            if (errno == EINTR) continue;
+
+            /* Too many events at once overflowed the socket, the refresh
+             * thread has to find out what changed by itself. */
+            if (errno == ENOBUFS) {
+                process_events_lost();
+                continue;
+            }
+
+            fprintf(g_log, "Reading process events from netlink failed: %s\n",
+                    strerror(errno));
+            break;
+        }
+
+        for (struct nlmsghdr *message = (struct nlmsghdr *)buffer;
+             NLMSG_OK(message, len); message = NLMSG_NEXT(message, len)) {
+            if (message->nlmsg_type == NLMSG_ERROR ||
+                message->nlmsg_type == NLMSG_NOOP)
+                continue;
+
+            struct cn_msg *cn = (struct cn_msg *)NLMSG_DATA(message);
+            if (cn->id.idx != CN_IDX_PROC || cn->id.val != CN_VAL_PROC)
+                continue;
+
+            struct process_event event;
+            if (process_event_from_msg(&event, (struct proc_event *)cn->data))
+                process_event_push(&event);
+        }
+    }
+
+    process_events_set_live(false);
+    close(fd);
+}
@@ -0,0 +1,21 @@
+#ifndef PROCEVENTS_H
+#define PROCEVENTS_H
+
+/* Short lived processes can open a socket, send their traffic and exit in
+ * between two refreshes, and walking /proc to find new processes costs more
+ * the more of them there are. A NETLINK_CONNECTOR socket subscribed to the
+ * proc connector (cn_proc) is told of every fork, exec and exit as it
+ * happens instead. The comm of a process is read right at its exec, and the
+ * events are handed to the refresh thread to keep its pid cache current. The
+ * kernel only allows this with CAP_NET_ADMIN, without it /proc is walked as
+ * before. */
+
+/* Opens the proc connector socket and subscribes it to process events.
+ * Returns the socket, or -1 on failure with the reason written to g_log. */
+int proc_events_open();
+
+/* Passes every process event to process_event_push(). Never returns unless
+ * reading from netlink fails. */
+void proc_events_loop();
+
+#endif
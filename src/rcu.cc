@@ -0,0 +1,51 @@
+#include "rcu.h"
+
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static std::mutex readers_lock;
+static std::vector<struct rcu_reader *> readers;
+
+/* Starts at 1, a reader storing 0 is outside of any read section */
+static std::atomic<unsigned long long> generation(1);
+
+void rcu_register_reader(struct rcu_reader *reader) {
+    reader->active.store(0);
+
+    std::unique_lock<std::mutex> lock(readers_lock);
+    readers.push_back(reader);
+}
+
+void rcu_unregister_reader(struct rcu_reader *reader) {
+    std::unique_lock<std::mutex> lock(readers_lock);
+    readers.erase(std::remove(readers.begin(), readers.end(), reader),
+                  readers.end());
+}
+
+void rcu_read_lock(struct rcu_reader *reader) {
+    /* Sequentially consistent, so the writer either sees us active or we
+     * load whatever pointer it published before bumping the generation. */
+    reader->active.store(generation.load());
+}
+
+void rcu_read_unlock(struct rcu_reader *reader) {
+    reader->active.store(0, std::memory_order_release);
+}
+
+void rcu_synchronize() {
+    unsigned long long target = generation.fetch_add(1) + 1;
+
+    std::unique_lock<std::mutex> lock(readers_lock);
+    for (struct rcu_reader *reader : readers) {
+        /* Readers that entered at the new generation already see the new
+         * pointer, only older ones need to leave first. */
+        while (1) {
+            unsigned long long active = reader->active.load();
+            if (active == 0 || active >= target) break;
+
+            std::this_thread::yield();
+        }
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef RCU_H
+#define RCU_H
+
+#include <atomic>
+
+/* Minimal read-copy-update for data the capture threads read on every batch.
+ * A writer never modifies published data, it builds a new copy off to the
+ * side, swaps the pointer readers load and calls rcu_synchronize() before
+ * freeing the old copy. Readers only ever store to their own struct, they
+ * never wait on a writer. */
+
+/* One per reading thread, registered once with rcu_register_reader() */
+struct rcu_reader {
+    /* rcu generation seen when the read section was entered, 0 outside */
+    std::atomic<unsigned long long> active;
+};
+
+/* Adds the reader to the set rcu_synchronize() waits on. It must stay valid
+ * until it is removed again with rcu_unregister_reader(). */
+void rcu_register_reader(struct rcu_reader *reader);
+
+/* Removes the reader, which must be outside of any read section. It may be
+ * freed once this returns. */
+void rcu_unregister_reader(struct rcu_reader *reader);
+
+/* Pointers loaded between these stay valid until rcu_read_unlock(). Read
+ * sections must be short and must not nest. */
+void rcu_read_lock(struct rcu_reader *reader);
+
+void rcu_read_unlock(struct rcu_reader *reader);
+
+/* Waits until every reader that could still hold a pointer swapped out
+ * before this call has left its read section. Must not be called from
+ * inside a read section. */
+void rcu_synchronize();
+
+#endif
@@ -0,0 +1,235 @@
+#include "replay.h"
+
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <pcap.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "database.h"
+#include "list.h"
+#include "omnis.h"
+#include "proc.h"
+#include "sniffer.h"
+
+int replay_load_fixture(const char *filename, struct ip_list **ips) {
+    FILE *fixture = fopen(filename, "r");
+    if (fixture == NULL) {
+        fprintf(g_log, "Could not open fixture file %s: %s\n", filename,
+                strerror(errno));
+        return -1;
+    }
+
+    /* Fixture mappings never change, the map is published once at the end */
+    struct process_map *map = new struct process_map();
+
+    char line[512];
+    int line_nr = 0, mappings = 0;
+    while (fgets(line, sizeof(line), fixture)) {
+        line_nr++;
+
+        char key[128], value[64];
+        int matches = sscanf(line, "%127s %63s", key, value);
+        if (matches <= 0 || key[0] == '#') continue;
+
+        if (matches != 2) {
+            fprintf(g_log, "Malformed line %d in fixture file %s\n", line_nr,
+                    filename);
+            fclose(fixture);
+            delete map;
+            return -1;
+        }
+
+        if (strcmp(key, "local") == 0) {
+            struct in6_addr ip_address;
+            if (ip_from_string(&ip_address, value) < 0) {
+                fprintf(g_log,
+                        "Invalid local address %s on line %d in fixture file "
+                        "%s\n",
+                        value, line_nr, filename);
+                fclose(fixture);
+                delete map;
+                return -1;
+            }
+
+            ip_list_push_back(ips, ip_address);
+            continue;
+        }
+
+        /* Application names are pruned the same as a /proc/pid/comm */
+        value[15] = '\0';
+
+        struct application *app = get_or_create_application(value);
+
+        struct flow_key flow;
+        if (flow_key_from_string(&flow, key) < 0) {
+            fprintf(g_log,
+                    "Invalid packet hash %s on line %d in fixture file %s\n",
+                    key, line_nr, filename);
+            fclose(fixture);
+            delete map;
+            return -1;
+        }
+
+        if (flow_key_is_udp_port(&flow))
+            map->udp_ports[flow.local_port] = app;
+        else
+            map->flows[flow] = app->index;
+        mappings++;
+    }
+
+    fclose(fixture);
+    process_map_publish(map);
+
+    if (g_args.debug)
+        fprintf(g_log, "Loaded %d mappings from fixture file %s\n", mappings,
+                filename);
+
+    return 0;
+}
+
+void replay_snapshot_proc(struct ip_list **ips) {
+    refresh_proc_mappings();
+
+    struct if_nameindex *interfaces = if_nameindex();
+    if (interfaces == NULL) return;
+
+    for (struct if_nameindex *i = interfaces; i->if_index != 0; i++) {
+        if (!g_args.interfaces.empty() &&
+            std::find(g_args.interfaces.begin(), g_args.interfaces.end(),
+                      i->if_name) == g_args.interfaces.end())
+            continue;
+
+        get_local_ip_addresses(i->if_name, ips);
+    }
+
+    if_freenameindex(interfaces);
+}
+
+int replay_run(const char *filename) {
+    char error_buffer[PCAP_ERRBUF_SIZE];
+
+    struct ip_list *local_ips = NULL;
+    if (!g_args.fixture.empty()) {
+        if (replay_load_fixture(g_args.fixture.c_str(), &local_ips) < 0)
+            return -1;
+    } else {
+        replay_snapshot_proc(&local_ips);
+    }
+
+    struct device *device = new struct device();
+    strncpy(device->name, "replay", IFNAMSIZ - 1);
+    device_set_local_ips(device, local_ips);
+
+    if (local_ips == NULL)
+        fprintf(g_log,
+                "No local addresses are known, every packet will be "
+                "ignored\n");
+    ip_list_free(local_ips);
+
+    struct capture *capture = new struct capture;
+    capture->worker = 0;
+    capture->cpu = -1;
+    capture_init(capture, device);
+
+    capture->handle = pcap_open_offline(filename, error_buffer);
+    if (capture->handle == NULL) {
+        fprintf(g_log, "Could not open %s for replay: %s\n", filename,
+                error_buffer);
+        return -1;
+    }
+
+    capture->datalink = pcap_datalink(capture->handle);
+    capture->handler = packet_handler_for_datalink(capture->datalink);
+    if (capture->handler == NULL) {
+        fprintf(g_log, "Replay of %s failed, link type %d is not supported\n",
+                filename, capture->datalink);
+        pcap_close(capture->handle);
+        return -1;
+    }
+
+    u_char *args = (u_char *)capture;
+    auto start = std::chrono::steady_clock::now();
+
+    int ret = pcap_loop(capture->handle, -1, capture->handler, args);
+    flush_packet_batch(args);
+    flush_unresolved_packets(capture);
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start);
+
+    if (ret == PCAP_ERROR) {
+        fprintf(g_log, "Replay of %s failed with error %s\n", filename,
+                pcap_geterr(capture->handle));
+        pcap_close(capture->handle);
+        return -1;
+    }
+
+    replay_report(capture, filename, elapsed.count());
+    pcap_close(capture->handle);
+
+    return 0;
+}
+
+void replay_report(const struct capture *capture, const char *filename,
+                   long long elapsed_ns) {
+    unsigned long long packets =
+        capture->packets.load(std::memory_order_relaxed);
+    double seconds = elapsed_ns / 1e9;
+
+    fprintf(g_log, "Replayed %s: %llu packets in %.3f s\n", filename, packets,
+            seconds);
+    fprintf(g_log, "  %.0f packets/s, %.1f ns/packet\n",
+            seconds > 0 ? packets / seconds : 0.0,
+            packets ? (double)elapsed_ns / packets : 0.0);
+    if (g_args.sample_rate > 1 || g_args.sample_auto)
+        fprintf(g_log, "  sampling 1 in %d packets at the end\n",
+                capture->sample_rate);
+    fprintf(g_log, "  resolve hit rate: %.1f%% (%llu of %llu accounted)\n",
+            capture->accounted ? 100.0 * capture->resolved / capture->accounted
+                               : 0.0,
+            capture->resolved, capture->accounted);
+    fprintf(g_log, "  unattributed: %llu packets\n", capture->unattributed);
+    fprintf(g_log, "  flow cache hits: %.1f%% (%zu flows cached at the end)\n",
+            capture->accounted
+                ? 100.0 * capture->flow_hits / capture->accounted
+                : 0.0,
+            capture->flows.size());
+
+    /* Nothing flips the epoch during a replay, its slots hold every interval
+     * of the capture */
+    const struct traffic_epoch &epoch = capture->epochs[capture->epoch];
+    std::vector<struct traffic> totals(g_applications.size(), traffic());
+    for (const struct traffic_slot &slot : epoch.slots)
+        for (size_t i = 0; i < slot.traffic.size(); i++)
+            traffic_add(&totals[i], &slot.traffic[i]);
+
+    std::vector<std::pair<struct application *, struct traffic>> apps;
+    for (size_t i = 0; i < totals.size(); i++) {
+        const struct traffic &traffic = totals[i];
+        if (traffic.pkt_rx_c == 0 && traffic.pkt_tx_c == 0) continue;
+
+        apps.push_back({g_applications[i].get(), traffic});
+    }
+
+    /* Largest total first */
+    std::sort(apps.begin(), apps.end(), [](const auto &a, const auto &b) {
+        return a.second.pkt_rx + a.second.pkt_tx >
+               b.second.pkt_rx + b.second.pkt_tx;
+    });
+
+    fprintf(g_log, "\n%-16s %14s %14s %10s %10s %10s %10s\n", "application",
+            "tx bytes", "rx bytes", "tx pkts", "rx pkts", "tcp", "udp");
+    for (const auto &e : apps)
+        fprintf(g_log, "%-16s %14llu %14llu %10llu %10llu %10llu %10llu\n",
+                e.first->name, e.second.pkt_tx, e.second.pkt_rx,
+                e.second.pkt_tx_c, e.second.pkt_rx_c, e.second.pkt_tcp,
+                e.second.pkt_udp);
+}
@@ -0,0 +1,41 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "capture.h"
+
+/* Offline replay of a recorded pcap file through the same dissection,
+ * direction detection and flow to application accounting the daemon uses.
+ * Nothing is written to the real database, an in memory one is used instead.
+ *
+ * Packets are connected to applications using either a fixture file, or if
+ * none was given, a single snapshot of /proc taken before the replay starts
+ * that is never refreshed. A fixture file has one mapping per line:
+ *
+ *   # comment
+ *   local 192.168.1.20
+ *   192.168.1.20:51234-140.82.112.4:443 firefox
+ *   [2001:db8::20]:40312-[2606:4700::1111]:443 curl
+ *   UDP-5353 avahi-daemon
+ *
+ * "local" lines give the local addresses used to tell the direction of each
+ * packet, every other line maps a packet hash (local side first, as in
+ * /proc/net) to an application name. */
+
+/* Loads the fixture file into g_packet_process_map and appends its local
+ * addresses to ips. Returns 0 on success, -1 on failure. */
+int replay_load_fixture(const char *filename, struct ip_list **ips);
+
+/* Takes the frozen /proc snapshot and appends the local addresses of the
+ * interfaces selected with --interface, or of every interface, to ips. */
+void replay_snapshot_proc(struct ip_list **ips);
+
+/* Replays the pcap file and prints a report of the throughput and accounting
+ * afterwards. Returns 0 on success, -1 on failure. */
+int replay_run(const char *filename);
+
+/* Prints packets/s, ns/packet, the resolve hit rate and per application
+ * totals for a finished replay that took elapsed_ns nanoseconds. */
+void replay_report(const struct capture *capture, const char *filename,
+                   long long elapsed_ns);
+
+#endif
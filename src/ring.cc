@@ -0,0 +1,230 @@
+#include "ring.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/if_ether.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include "omnis.h"
+
+/* Each block is 1 MiB, the ring size argument is therefore also the number of
+ * blocks in the ring. Frames are only used by the kernel for bookkeeping in
+ * TPACKET_V3, packets are packed tightly inside of a block. */
+static const unsigned int RING_BLOCK_SIZE = 1 << 20;
+static const unsigned int RING_FRAME_SIZE = 2048;
+
+int ring_open(struct ring *ring, const char *device_name,
+              unsigned int ring_size, unsigned int block_timeout) {
+    memset(ring, 0, sizeof(struct ring));
+    ring->fd = -1;
+
+    unsigned int ifindex = if_nametoindex(device_name);
+    if (ifindex == 0) {
+        fprintf(g_log, "Could not find interface index for device %s: %s\n",
+                device_name, strerror(errno));
+        return -1;
+    }
+
+    ring->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (ring->fd < 0) {
+        fprintf(g_log, "Could not open AF_PACKET socket for device %s: %s\n",
+                device_name, strerror(errno));
+        return -1;
+    }
+
+    int version = TPACKET_V3;
+    if (setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version,
+                   sizeof(version)) < 0) {
+        fprintf(g_log, "TPACKET_V3 is not supported for device %s: %s\n",
+                device_name, strerror(errno));
+        ring_close(ring);
+        return -1;
+    }
+
+    if (ring_size == 0) ring_size = 1;
+
+    ring->block_size = RING_BLOCK_SIZE;
+    ring->block_nr = ring_size;
+
+    struct tpacket_req3 req;
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = ring->block_size;
+    req.tp_block_nr = ring->block_nr;
+    req.tp_frame_size = RING_FRAME_SIZE;
+    req.tp_frame_nr = (ring->block_size * ring->block_nr) / RING_FRAME_SIZE;
+    req.tp_retire_blk_tov = block_timeout;
+    req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
+
+    if (setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) <
+        0) {
+        fprintf(g_log,
+                "Could not create %u MiB receive ring for device %s: %s\n",
+                ring_size, device_name, strerror(errno));
+        ring_close(ring);
+        return -1;
+    }
+
+    ring->map_len = (size_t)ring->block_size * ring->block_nr;
+    ring->map = (uint8_t *)mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_LOCKED, ring->fd, 0);
+    if (ring->map == MAP_FAILED) {
+        /* Locking may fail from RLIMIT_MEMLOCK, an unlocked ring still works */
+        ring->map = (uint8_t *)mmap(NULL, ring->map_len,
+                                    PROT_READ | PROT_WRITE, MAP_SHARED,
+                                    ring->fd, 0);
+    }
+
+    if (ring->map == MAP_FAILED) {
+        fprintf(g_log, "Could not mmap receive ring for device %s: %s\n",
+                device_name, strerror(errno));
+        ring->map = NULL;
+        ring_close(ring);
+        return -1;
+    }
+
+    ring->blocks =
+        (struct iovec *)malloc(ring->block_nr * sizeof(struct iovec));
+    for (unsigned int i = 0; i < ring->block_nr; i++) {
+        ring->blocks[i].iov_base = ring->map + (i * ring->block_size);
+        ring->blocks[i].iov_len = ring->block_size;
+    }
+
+    struct sockaddr_ll addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_ALL);
+    addr.sll_ifindex = ifindex;
+
+    if (bind(ring->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(g_log, "Could not bind AF_PACKET socket to device %s: %s\n",
+                device_name, strerror(errno));
+        ring_close(ring);
+        return -1;
+    }
+
+    /* Promiscuous mode to match what pcap_open_live was opened with */
+    struct packet_mreq mreq;
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = ifindex;
+    mreq.mr_type = PACKET_MR_PROMISC;
+    if (setsockopt(ring->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq,
+                   sizeof(mreq)) < 0) {
+        if (g_args.debug)
+            fprintf(g_log, "Could not set device %s promiscuous: %s\n",
+                    device_name, strerror(errno));
+    }
+
+    if (g_args.debug)
+        fprintf(g_log,
+                "Opened TPACKET_V3 ring on %s with %u blocks of %u bytes, "
+                "block timeout %ums\n",
+                device_name, ring->block_nr, ring->block_size, block_timeout);
+
+    return 0;
+}
+
+unsigned long long ring_update_stats(struct ring *ring) {
+    struct tpacket_stats_v3 stats;
+    socklen_t len = sizeof(stats);
+
+    if (getsockopt(ring->fd, SOL_PACKET, PACKET_STATISTICS, &stats, &len) <
+        0)
+        return 0;
+
+    ring->drops += stats.tp_drops;
+    ring->frozen += stats.tp_freeze_q_cnt;
+
+    return stats.tp_drops;
+}
+
+/* Hands every packet inside of a retired block to the callback, the data
+ * pointers given point straight into the ring. */
+static void walk_block(struct tpacket_block_desc *block,
+                       pcap_handler callback, u_char *args) {
+    uint32_t num_pkts = block->hdr.bh1.num_pkts;
+    struct tpacket3_hdr *frame =
+        (struct tpacket3_hdr *)((uint8_t *)block +
+                                block->hdr.bh1.offset_to_first_pkt);
+
+    struct pcap_pkthdr header;
+    for (uint32_t i = 0; i < num_pkts; i++) {
+        header.ts.tv_sec = frame->tp_sec;
+        header.ts.tv_usec = frame->tp_nsec / 1000;
+        header.caplen = frame->tp_snaplen;
+        header.len = frame->tp_len;
+
+        callback(args, &header, (const u_char *)frame + frame->tp_mac);
+
+        frame = (struct tpacket3_hdr *)((uint8_t *)frame +
+                                        frame->tp_next_offset);
+    }
+}
+
+int ring_loop(struct ring *ring, pcap_handler callback, flush_handler flush,
+              u_char *args) {
+    struct pollfd pfd;
+    memset(&pfd, 0, sizeof(pfd));
+    pfd.fd = ring->fd;
+    pfd.events = POLLIN | POLLERR;
+
+    time_t last_stats = std::time(NULL);
+    while (1) {
+        /* The poll timeout below guarantees this is reached at least once
+         * every interval, even on an idle link. */
+        time_t now = std::time(NULL);
+        if (now - last_stats >= g_args.interval) {
+            unsigned long long dropped = ring_update_stats(ring);
+            if (dropped)
+                fprintf(g_log,
+                        "Receive ring dropped %llu packets in the last %lds "
+                        "(%llu total, ring full %llu times)\n",
+                        dropped, (long)(now - last_stats), ring->drops,
+                        ring->frozen);
+
+            last_stats = now;
+        }
+
+        struct tpacket_block_desc *block =
+            (struct tpacket_block_desc *)ring->blocks[ring->cursor].iov_base;
+
+        if ((block->hdr.bh1.block_status & TP_STATUS_USER) == 0) {
+            if (poll(&pfd, 1, g_args.interval * 1000) < 0 && errno != EINTR) {
+                fprintf(g_log, "Polling receive ring failed: %s\n",
+                        strerror(errno));
+                return -1;
+            }
+            continue;
+        }
+
+        /* Block status must be read before any of the packets in it */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        walk_block(block, callback, args);
+        flush(args);
+
+        /* Give the block back to the kernel only once we are done with it */
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+        ring->cursor = (ring->cursor + 1) % ring->block_nr;
+    }
+
+    return 0;
+}
+
+void ring_close(struct ring *ring) {
+    if (ring->map) munmap(ring->map, ring->map_len);
+    if (ring->fd >= 0) close(ring->fd);
+    free(ring->blocks);
+
+    ring->map = NULL;
+    ring->blocks = NULL;
+    ring->fd = -1;
+}
@@ -0,0 +1,50 @@
+#ifndef RING_H
+#define RING_H
+
+#include <linux/if_packet.h>
+#include <pcap.h>
+#include <sys/uio.h>
+
+#include <cstdint>
+
+/* Native AF_PACKET capture using a TPACKET_V3 memory mapped block ring.
+ * The kernel fills fixed size blocks with as many packets as fit and only
+ * hands a block over to us once it is full or the block timeout retires it.
+ * Packets are then read directly out of the shared mapping, avoiding the
+ * per packet copy and wakeup libpcap's default path costs. */
+struct ring {
+    int fd;                    /* AF_PACKET socket */
+    uint8_t *map;              /* start of the mmap'd ring */
+    size_t map_len;            /* total length of the mapping */
+    struct iovec *blocks;      /* start address of each block in the ring */
+    unsigned int block_size;   /* size of a single block in bytes */
+    unsigned int block_nr;     /* number of blocks in the ring */
+    unsigned int cursor;       /* next block we expect the kernel to retire */
+    unsigned long long drops;  /* packets dropped by the kernel so far */
+    unsigned long long frozen; /* times the ring filled up completely */
+};
+
+/* Opens a TPACKET_V3 ring on the device with a total size of ring_size MiB.
+ * Blocks not filled within block_timeout milliseconds are retired early so
+ * quiet links still get their packets processed promptly.
+ * Returns 0 on success, -1 on failure with the reason written to g_log. */
+int ring_open(struct ring *ring, const char *device_name,
+              unsigned int ring_size, unsigned int block_timeout);
+
+/* Called once a backend has handed over every packet it had for now */
+typedef void (*flush_handler)(u_char *args);
+
+/* Walks every block the kernel retires, calling callback for each packet in
+ * the same way pcap_loop would, then flush once the block is done. Never
+ * returns unless polling fails. */
+int ring_loop(struct ring *ring, pcap_handler callback, flush_handler flush,
+              u_char *args);
+
+/* Reads the kernel ring statistics (which reset on every read) and adds them
+ * to the running totals in the ring. Returns the number of newly dropped
+ * packets since the last call. */
+unsigned long long ring_update_stats(struct ring *ring);
+
+void ring_close(struct ring *ring);
+
+#endif
@@ -1,9 +1,11 @@
 #include "sniffer.h"
 
 #include <ifaddrs.h>
+#include <linux/if_ether.h>
 #include <net/ethernet.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/ip6.h>
 #include <netinet/tcp.h>
 #include <netinet/udp.h>
 #include <pcap.h>
@@ -12,43 +14,126 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+
 #include "list.h"
 #include "omnis.h"
 #include "packet.h"
 #include "proc.h"
+#include "rcu.h"
+
+/* Adds the held traffic to the application, in the interval the flows first
+ * packet was seen in */
+static void account_pending(struct traffic_epoch *epoch,
+                            struct application *app,
+                            const struct pending_flow &pending) {
+    traffic_add(&epoch_traffic(epoch, app, pending.first_seen),
+                &pending.traffic);
+}
 
-std::unordered_map<std::string, struct unresolved_buffer> unresolved_packets;
-struct ip_list *g_local_ip_list;
-
-void try_resolve_packets() {
-    if (unresolved_packets.empty()) return;
-
-    refresh_proc_mappings();
-    for (const auto &e : unresolved_packets) {
-        auto found = g_packet_process_map.find(e.first);
-        if (found != g_packet_process_map.end()) {
-            found->second->pkt_tx += e.second.pkt_tx;
-            found->second->pkt_rx += e.second.pkt_rx;
-            found->second->pkt_tx_c += e.second.pkt_tx_c;
-            found->second->pkt_rx_c += e.second.pkt_rx_c;
-            found->second->pkt_tcp += e.second.pkt_tcp;
-            found->second->pkt_udp += e.second.pkt_udp;
-
-            if (g_args.debug)
-                fprintf(g_log, "Connected previously lost packets to %s\n",
-                        found->second->name);
-        } else {
-            if (g_args.debug)
+void try_resolve_packets(struct capture *capture, time_t now) {
+    if (capture->unresolved.empty()) return;
+
+    rcu_read_lock(&capture->rcu);
+    const struct process_map *map = g_packet_process_map.load();
+    struct traffic_epoch *epoch = capture_begin_accounting(capture);
+    /* Flows that missed are looked up on their own, unless there are more
+     * than that is worth, see request_proc_lookup() */
+    struct flow_lookup lookups[PROC_LOOKUP_MAX + 1];
+    size_t missed = 0;
+
+    capture->unresolved.erase_if([&](const struct flow_key &key,
+                                     struct pending_flow &pending) {
+        if (now < pending.next_retry) return false;
+
+        /* Looking a flow up again in the map it already missed in is
+         * pointless, unless it is a replays frozen map. */
+        if (map->generation > pending.generation || !g_args.replay.empty()) {
+            struct application *app =
+                process_map_find(map, &key, pending.traffic.pkt_udp != 0);
+            if (app != NULL) {
+                account_pending(epoch, app, pending);
+                capture->resolved +=
+                    pending.traffic.pkt_tx_c + pending.traffic.pkt_rx_c;
+
+                if (g_args.debug)
+                    fprintf(g_log, "Connected previously lost packets to %s\n",
+                            app->name);
+                return true;
+            }
+
+            pending.generation = map->generation;
+        }
+
+        if (now - pending.first_seen >= PENDING_TTL) {
+            if (g_args.debug) {
+                char hash[HASHKEYSIZE];
                 fprintf(g_log,
-                        "Couldn't connect packets (tx: %llu rx: %llu tcp: %d "
-                        "udp %d) with "
+                        "Couldn't connect packets (tx: %llu rx: %llu tcp: %llu "
+                        "udp %llu) with "
                         "hash %s\n",
-                        e.second.pkt_tx, e.second.pkt_rx, e.second.pkt_tcp,
-                        e.second.pkt_udp, e.first.c_str());
+                        pending.traffic.pkt_tx, pending.traffic.pkt_rx,
+                        pending.traffic.pkt_tcp, pending.traffic.pkt_udp,
+                        flow_key_to_string(&key, hash));
+            }
+
+            account_pending(epoch, g_unattributed, pending);
+            capture->unattributed +=
+                pending.traffic.pkt_tx_c + pending.traffic.pkt_rx_c;
+            return true;
         }
-    }
 
-    unresolved_packets.clear();
+        /* Back off exponentially, a flow whose socket is gone for good
+         * shouldn't have /proc rescanned for it over and over. */
+        pending.retries++;
+        pending.next_retry =
+            now + std::min(1 << std::min(pending.retries, 16),
+                           PENDING_MAX_BACKOFF);
+        if (missed <= PROC_LOOKUP_MAX) {
+            lookups[missed].key = key;
+            lookups[missed].protocol =
+                pending.traffic.pkt_udp != 0 ? IPPROTO_UDP : IPPROTO_TCP;
+            missed++;
+        }
+        return false;
+    });
+
+    capture_end_accounting(capture);
+    rcu_read_unlock(&capture->rcu);
+
+    if (missed == 0 || !g_args.replay.empty()) return;
+
+    if (missed > PROC_LOOKUP_MAX)
+        request_proc_refresh();
+    else
+        request_proc_lookup(lookups, missed);
+}
+
+void flush_unresolved_packets(struct capture *capture) {
+    rcu_read_lock(&capture->rcu);
+    const struct process_map *map = g_packet_process_map.load();
+    struct traffic_epoch *epoch = capture_begin_accounting(capture);
+
+    capture->unresolved.for_each([&](const struct flow_key &key,
+                                     const struct pending_flow &pending) {
+        unsigned long long packets =
+            pending.traffic.pkt_tx_c + pending.traffic.pkt_rx_c;
+
+        struct application *app =
+            process_map_find(map, &key, pending.traffic.pkt_udp != 0);
+        if (app != NULL) {
+            account_pending(epoch, app, pending);
+            capture->resolved += packets;
+        } else {
+            account_pending(epoch, g_unattributed, pending);
+            capture->unattributed += packets;
+        }
+    });
+
+    capture_end_accounting(capture);
+    rcu_read_unlock(&capture->rcu);
+
+    capture->unresolved.clear();
 }
 
 int should_disregard_packet(const struct packet *packet) {
@@ -76,38 +161,144 @@ int should_disregard_packet(const struct packet *packet) {
     return 0;
 }
 
-void get_local_ip_addresses(const char *device_name) {
+void get_local_ip_addresses(const char *name, struct ip_list **ips) {
     struct ifaddrs *interface_addresses, *ifaddress;
     if (getifaddrs(&interface_addresses) < 0) {
         fprintf(g_log,
                 "Unable to access local interface addresses from ifaddrs for "
                 "device %s. Exiting.",
-                device_name);
+                name);
         exit(1);
     }
 
+    /* The any device captures on every interface, so every address of any
+     * interface is one of its own */
+    bool any = strcmp(name, "any") == 0;
+
     for (ifaddress = interface_addresses; ifaddress != NULL;
          ifaddress = ifaddress->ifa_next) {
         if (ifaddress->ifa_addr == NULL) continue;
-        if (strcmp(ifaddress->ifa_name, device_name) != 0) continue;
+        if (!any && strcmp(ifaddress->ifa_name, name) != 0) continue;
 
-        struct in_addr ip_address;
-        ip_address.s_addr =
-            ((struct sockaddr_in *)ifaddress->ifa_addr)->sin_addr.s_addr;
+        int family = ifaddress->ifa_addr->sa_family;
+        if (family != AF_INET && family != AF_INET6) continue;
 
-        if (g_args.debug)
-            fprintf(g_log, "Local IP Address found for device %s: %s\n",
-                    device_name, inet_ntoa(ip_address));
+        struct in6_addr ip_address;
+        if (family == AF_INET)
+            ip_from_ipv4(
+                &ip_address,
+                ((struct sockaddr_in *)ifaddress->ifa_addr)->sin_addr.s_addr);
+        else
+            ip_address =
+                ((struct sockaddr_in6 *)ifaddress->ifa_addr)->sin6_addr;
 
-        /* If address starts with 192.168.x.x push to the front of the list */
-        if (ip_address.s_addr >= 43200) {
-            ip_list_push_front(&g_local_ip_list, ip_address);
-        } else {
-            ip_list_push_back(&g_local_ip_list, ip_address);
+        if (g_args.debug) {
+            char address[INET6_ADDRSTRLEN];
+            fprintf(g_log, "Local IP Address found for device %s: %s\n",
+                    name, ip_to_string(&ip_address, address));
         }
+
+        ip_list_push_back(ips, ip_address);
     }
 
-    free(interface_addresses);
+    freeifaddrs(interface_addresses);
+}
+
+int refresh_local_ip_addresses(struct device *device) {
+    struct ip_list *ips = NULL;
+    get_local_ip_addresses(device->name, &ips);
+
+    int changed = device_set_local_ips(device, ips);
+    ip_list_free(ips);
+
+    return changed;
+}
+
+int handle_ipv4_packet(struct packet *packet, const u_char *buffer, int offset,
+                       unsigned int caplen, unsigned int len) {
+    if (offset + sizeof(struct iphdr) > caplen) return -1;
+
+    struct iphdr *ip_header = (struct iphdr *)(buffer + offset);
+
+    /* Byte accounting uses the ip total length since only the headers are
+     * captured. Segmentation offloaded packets may have it unset. */
+    unsigned short ip_len = ntohs(ip_header->tot_len);
+
+    packet->len = ip_len ? offset + ip_len : len;
+    packet->protocol = ip_header->protocol;
+    ip_from_ipv4(&packet->source_ip, ip_header->saddr);
+    ip_from_ipv4(&packet->dest_ip, ip_header->daddr);
+
+    /* Only the first fragment carries the transport header */
+    if (ntohs(ip_header->frag_off) & IP_OFFMASK) return -1;
+
+    return offset + ip_header->ihl * 4;
+}
+
+int handle_ipv6_packet(struct packet *packet, const u_char *buffer, int offset,
+                       unsigned int caplen, unsigned int len) {
+    if (offset + sizeof(struct ip6_hdr) > caplen) return -1;
+
+    struct ip6_hdr *ip6_header = (struct ip6_hdr *)(buffer + offset);
+
+    /* Jumbograms have a payload length of 0 */
+    unsigned short payload_len = ntohs(ip6_header->ip6_plen);
+
+    packet->len =
+        payload_len ? offset + sizeof(struct ip6_hdr) + payload_len : len;
+    packet->source_ip = ip6_header->ip6_src;
+    packet->dest_ip = ip6_header->ip6_dst;
+
+    /* Walk the extension headers until we reach the transport header */
+    uint8_t next_header = ip6_header->ip6_nxt;
+    offset += sizeof(struct ip6_hdr);
+    while (1) {
+        switch (next_header) {
+            case IPPROTO_TCP:
+            case IPPROTO_UDP:
+                packet->protocol = next_header;
+                return offset;
+
+            case IPPROTO_HOPOPTS:
+            case IPPROTO_ROUTING:
+            case IPPROTO_DSTOPTS:
+            case IPPROTO_MH: {
+                if (offset + sizeof(struct ip6_ext) > caplen) return -1;
+
+                struct ip6_ext *ext = (struct ip6_ext *)(buffer + offset);
+                next_header = ext->ip6e_nxt;
+                offset += (ext->ip6e_len + 1) * 8;
+                break;
+            }
+
+            case IPPROTO_AH: {
+                if (offset + sizeof(struct ip6_ext) > caplen) return -1;
+
+                /* The authentication header length is in 4 byte units */
+                struct ip6_ext *ext = (struct ip6_ext *)(buffer + offset);
+                next_header = ext->ip6e_nxt;
+                offset += (ext->ip6e_len + 2) * 4;
+                break;
+            }
+
+            case IPPROTO_FRAGMENT: {
+                if (offset + sizeof(struct ip6_frag) > caplen) return -1;
+
+                /* Only the first fragment carries the transport header */
+                struct ip6_frag *frag = (struct ip6_frag *)(buffer + offset);
+                if (frag->ip6f_offlg & IP6F_OFF_MASK) return -1;
+
+                next_header = frag->ip6f_nxt;
+                offset += sizeof(struct ip6_frag);
+                break;
+            }
+
+            /* ESP hides the transport header, anything else isn't tcp or
+             * udp at all. */
+            default:
+                return -1;
+        }
+    }
 }
 
 void handle_tcp_packet(struct packet *packet, const u_char *buffer,
@@ -118,6 +309,7 @@ void handle_tcp_packet(struct packet *packet, const u_char *buffer,
     packet->header_len = offset + tcp_header->doff * 4;
     packet->source_port = ntohs(tcp_header->source);
     packet->dest_port = ntohs(tcp_header->dest);
+    packet->tcp_flags = tcp_header->th_flags;
 }
 
 void handle_udp_packet(struct packet *packet, const u_char *buffer,
@@ -128,29 +320,189 @@ void handle_udp_packet(struct packet *packet, const u_char *buffer,
     packet->header_len = offset + sizeof(udp_header);
     packet->source_port = ntohs(udp_header->source);
     packet->dest_port = ntohs(udp_header->dest);
+    packet->tcp_flags = 0;
+}
+
+/* Link layer dissectors, one per supported pcap link type. Each returns the
+ * offset of the network header and sets ethertype to the protocol found
+ * there, or returns -1 if the frame is too short. */
+typedef int (*link_dissector)(const u_char *buffer, unsigned int caplen,
+                              uint16_t *ethertype);
+
+/* Skips any 802.1Q or 802.1ad (QinQ) tags at offset. Every tag is followed by
+ * the ethertype of what comes after it. */
+static inline int strip_vlan_tags(const u_char *buffer, unsigned int caplen,
+                                  int offset, uint16_t *ethertype) {
+    while (*ethertype == ETH_P_8021Q || *ethertype == ETH_P_8021AD ||
+           *ethertype == ETH_P_QINQ1) {
+        if (offset + 4 > (int)caplen) return -1;
+
+        *ethertype = ntohs(*(const uint16_t *)(buffer + offset + 2));
+        offset += 4;
+    }
+
+    return offset;
+}
+
+static int ethernet_header(const u_char *buffer, unsigned int caplen,
+                           uint16_t *ethertype) {
+    if (caplen < sizeof(struct ethhdr)) return -1;
+
+    struct ethhdr *eth_header = (struct ethhdr *)buffer;
+    *ethertype = ntohs(eth_header->h_proto);
+
+    return strip_vlan_tags(buffer, caplen, sizeof(struct ethhdr), ethertype);
+}
+
+/* Linux cooked capture, used by the "any" device. The protocol is the last
+ * field of the 16 byte header. */
+static int sll_header(const u_char *buffer, unsigned int caplen,
+                      uint16_t *ethertype) {
+    if (caplen < 16) return -1;
+
+    *ethertype = ntohs(*(const uint16_t *)(buffer + 14));
+    return strip_vlan_tags(buffer, caplen, 16, ethertype);
+}
+
+/* Linux cooked capture v2, the protocol is the first field of the 20 byte
+ * header. */
+static int sll2_header(const u_char *buffer, unsigned int caplen,
+                       uint16_t *ethertype) {
+    if (caplen < 20) return -1;
+
+    *ethertype = ntohs(*(const uint16_t *)buffer);
+    return strip_vlan_tags(buffer, caplen, 20, ethertype);
+}
+
+/* No link layer header at all, as on tun devices. The ip version tells which
+ * protocol it is. */
+static int raw_header(const u_char *buffer, unsigned int caplen,
+                      uint16_t *ethertype) {
+    if (caplen < 1) return -1;
+
+    switch (buffer[0] >> 4) {
+        case 4:
+            *ethertype = ETH_P_IP;
+            return 0;
+
+        case 6:
+            *ethertype = ETH_P_IPV6;
+            return 0;
+
+        default:
+            return -1;
+    }
 }
 
-unsigned long long resolve_interval = 0;
-void packet_handler(u_char *args, const struct pcap_pkthdr *header,
-                    const u_char *buffer) {
-    // skip over ethernet header ( always 14 bytes ) and use ip header
-    struct iphdr *ip_header = (struct iphdr *)(buffer + sizeof(struct ethhdr));
-    unsigned short ip_header_len = ip_header->ihl * 4;
+/* BSD loopback, a 4 byte address family. DLT_NULL has it in the byte order of
+ * the capturing host and DLT_LOOP in network order, so accept either. */
+static int loopback_header(const u_char *buffer, unsigned int caplen,
+                           uint16_t *ethertype) {
+    if (caplen < 4) return -1;
+
+    uint32_t family = *(const uint32_t *)buffer;
+    if (family > 0xffff) family = __builtin_bswap32(family);
+
+    switch (family) {
+        case 2: /* AF_INET everywhere */
+            *ethertype = ETH_P_IP;
+            return 4;
+
+        case 10: /* AF_INET6 on Linux, then the BSDs and macOS */
+        case 24:
+        case 28:
+        case 30:
+            *ethertype = ETH_P_IPV6;
+            return 4;
+
+        default:
+            return -1;
+    }
+}
+
+/* Returns the number of packets until the next sampled one, uniform over
+ * 1..2N-1 so it averages to N. A plain every Nth packet counter aliases with
+ * periodic traffic such as request/response pairs, the xorshift with a fixed
+ * seed avoids that while keeping runs reproducible. */
+static inline int next_sample_gap(struct capture *capture) {
+    uint32_t x = capture->sample_seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    capture->sample_seed = x;
+
+    return 1 + x % (2 * capture->sample_rate - 1);
+}
+
+/*
+ * Function handler that is hooked with libpcap to be executed everytime a
+ * packet is captured. This is the source of where most of the logic in
+ * Omnis branches from. Packets are parsed here and added to the captures
+ * batch, which is flushed once full or once it has waited longer than
+ * --batch-latency.
+ *
+ * It is specialized for every link layer dissector, so the link type is only
+ * branched on once when the capture is opened.
+ *
+ * args is the struct capture the packet was captured by,
+ * header is the base packet header provided by pcap,
+ * buffer is the raw packet string caught by pcap.
+ */
+template <link_dissector dissect_link>
+static void packet_handler(u_char *args, const struct pcap_pkthdr *header,
+                           const u_char *buffer) {
+    struct capture *capture = (struct capture *)args;
+    capture->packets.store(
+        capture->packets.load(std::memory_order_relaxed) + 1,
+        std::memory_order_relaxed);
+
+    /* 1 in N sampling, the packet we keep stands for all N */
+    if (--capture->sample_skip > 0) return;
+    capture->sample_skip = next_sample_gap(capture);
+
+    struct batch_entry &entry = capture->batch[capture->batch_len];
+    struct packet &packet = entry.packet;
+    packet.weight = capture->sample_rate;
+
+    uint16_t ethertype;
+    int offset = dissect_link(buffer, header->caplen, &ethertype);
+    if (offset < 0) return;
+
+    switch (ethertype) {
+        case ETH_P_IP:
+            offset = handle_ipv4_packet(&packet, buffer, offset,
+                                        header->caplen, header->len);
+            break;
+
+        case ETH_P_IPV6:
+            offset = handle_ipv6_packet(&packet, buffer, offset,
+                                        header->caplen, header->len);
+            break;
+
+        default:
+            return;
+    }
+
+    if (offset < 0) return;
 
-    struct packet packet;
-    packet.len = header->len;
     packet.time = header->ts.tv_sec;
-    packet.source_ip.s_addr = ip_header->saddr;
-    packet.dest_ip.s_addr = ip_header->daddr;
-    find_packet_direction(&packet);
 
-    int offset = ip_header_len + sizeof(struct ethhdr);
-    switch (ip_header->protocol) {
+    /* The set may be replaced and freed as soon as the read section ends */
+    rcu_read_lock(&capture->rcu);
+    find_packet_direction(
+        &packet, capture->device->local_ips.load(std::memory_order_acquire));
+    rcu_read_unlock(&capture->rcu);
+
+    switch (packet.protocol) {
         case IPPROTO_TCP:
+            if (offset + sizeof(struct tcphdr) > header->caplen) return;
+
             handle_tcp_packet(&packet, buffer, offset);
             break;
 
         case IPPROTO_UDP:
+            if (offset + sizeof(struct udphdr) > header->caplen) return;
+
             handle_udp_packet(&packet, buffer, offset);
             if (should_disregard_packet(&packet)) return;
 
@@ -160,82 +512,206 @@ void packet_handler(u_char *args, const struct pcap_pkthdr *header,
             return;
     }
 
-    char hash[HASHKEYSIZE];
-    char sip[INET6_ADDRSTRLEN], dip[INET6_ADDRSTRLEN];
-    strcpy(sip, inet_ntoa(packet.source_ip));
-    strcpy(dip, inet_ntoa(packet.dest_ip));
+    flow_key_from_packet(&entry.key, &packet);
 
-    if (packet.direction == OUTGOING_DIRECTION)
-        snprintf(hash, HASHKEYSIZE, "%s:%d-%s:%d", sip, packet.source_port, dip,
-                 packet.dest_port);
-    else
-        snprintf(hash, HASHKEYSIZE, "%s:%d-%s:%d", dip, packet.dest_port, sip,
-                 packet.source_port);
+    long long now = header->ts.tv_sec * 1000LL + header->ts.tv_usec / 1000;
+    if (capture->batch_len == 0) capture->batch_start = now;
+    capture->batch_len++;
 
-    /* Lock application maps so we can insert/update data */
-    std::unique_lock<std::mutex> lock(g_applications_lock);
+    if (capture->batch_len == capture->batch.size() ||
+        now - capture->batch_start >= g_args.batch_latency)
+        flush_packet_batch(args);
+}
 
-    /* Every 500 packets captured we try to resolve any unresolved packets.
-     * This is completely arbitrary, and something else could be better.
-     * Could a timed interval potentially be better? */
-    if (resolve_interval > 100) {
-        try_resolve_packets();
-        resolve_interval = 0;
+pcap_handler packet_handler_for_datalink(int datalink) {
+    switch (datalink) {
+        case DLT_EN10MB:
+            return packet_handler<ethernet_header>;
+
+        case DLT_LINUX_SLL:
+            return packet_handler<sll_header>;
+
+        case DLT_LINUX_SLL2:
+            return packet_handler<sll2_header>;
+
+        case DLT_RAW:
+        case DLT_IPV4:
+        case DLT_IPV6:
+            return packet_handler<raw_header>;
+
+        case DLT_NULL:
+        case DLT_LOOP:
+            return packet_handler<loopback_header>;
+
+        default:
+            return NULL;
     }
+}
 
-    // TODO: Can we somehow avoid calling find twice for connected UDP sockets?
-    /* Try finding unconnected UDP sockets */
-    auto found = g_packet_process_map.end();
-    if (packet.protocol == IPPROTO_UDP) {
-        char port_hash[10];
-        if (packet.direction == OUTGOING_DIRECTION)
-            snprintf(port_hash, 10, "UDP-%d", packet.source_port);
-        else
-            snprintf(port_hash, 10, "UDP-%d", packet.dest_port);
+/* Updates a cached flow with one of its packets. A TCP reset or a FIN in
+ * both directions closes it, it then lingers for FLOW_CLOSED_LINGER seconds
+ * after its last packet. A SYN on the same addresses opens it again. */
+static void update_flow(struct flow_entry *flow, const struct packet *packet) {
+    flow->last_seen = packet->time;
+
+    if ((flow->fin & FLOW_CLOSED) && (packet->tcp_flags & TH_SYN) &&
+        !(packet->tcp_flags & (TH_RST | TH_FIN)))
+        flow->fin = 0;
+
+    if (packet->tcp_flags & TH_RST) flow->fin |= FLOW_CLOSED;
+    if (packet->tcp_flags & TH_FIN)
+        flow->fin |= packet->direction == OUTGOING_DIRECTION ? 1 : 2;
+
+    if ((flow->fin & 3) == 3) flow->fin |= FLOW_CLOSED;
+}
+
+/* Evicts flows that have been idle for longer than their timeout. Packet
+ * timestamps are used as the clock so a replay ages flows the same way. */
+static void expire_flows(struct capture *capture, time_t now) {
+    if (now - capture->last_flow_sweep < FLOW_SWEEP_INTERVAL) return;
+    capture->last_flow_sweep = now;
+
+    capture->flows.erase_if([now](const struct flow_key &key,
+                                  const struct flow_entry &flow) {
+        int timeout = flow.fin & FLOW_CLOSED ? FLOW_CLOSED_LINGER
+                      : flow.protocol == IPPROTO_TCP ? FLOW_TCP_TIMEOUT
+                                                     : FLOW_UDP_TIMEOUT;
+        return now - flow.last_seen > timeout;
+    });
+}
+
+/* Connects each packet in the batch to an application, if it can. Packets of
+ * flows seen before are resolved from the captures own flow cache, only the
+ * rest are looked up in g_packet_process_map. That is only read inside an rcu
+ * read section, a refresh publishing a new map never blocks it. */
+static void resolve_batch(struct capture *capture) {
+    size_t misses = 0;
+
+    for (size_t i = 0; i < capture->batch_len; i++) {
+        struct batch_entry &entry = capture->batch[i];
+
+        struct flow_entry *flow = capture->flows.find(entry.key);
+        if (flow == NULL) {
+            entry.app = NULL;
+            misses++;
+            continue;
+        }
 
-        found = g_packet_process_map.find(port_hash);
+        entry.app = flow->app;
+        capture->flow_hits += entry.packet.weight;
+        update_flow(flow, &entry.packet);
     }
 
-    /* Try finding TCP or connected UDP sockets. */
-    if (found == g_packet_process_map.end()) {
-        found = g_packet_process_map.find(hash);
+    if (misses == 0) return;
+
+    rcu_read_lock(&capture->rcu);
+    const struct process_map *map = g_packet_process_map.load();
+    capture->map_generation = map->generation;
+
+    for (size_t i = 0; i < capture->batch_len; i++) {
+        struct batch_entry &entry = capture->batch[i];
+        const struct packet &packet = entry.packet;
+        if (entry.app != NULL) continue;
+
+        /* An earlier packet of the batch may have cached the flow already,
+         * and possibly closed it, which must not be undone. */
+        struct flow_entry *cached = capture->flows.find(entry.key);
+        if (cached != NULL) {
+            entry.app = cached->app;
+            update_flow(cached, &packet);
+            continue;
+        }
+
+        /* Applications are never freed, so the raw pointer stays valid after
+         * the read section ends even if the map is replaced meanwhile. */
+        entry.app = process_map_find(map, &entry.key,
+                                     packet.protocol == IPPROTO_UDP);
+        if (entry.app == NULL) continue;
+
+        struct flow_entry &flow = capture->flows[entry.key];
+        flow.app = entry.app;
+        flow.protocol = packet.protocol;
+        flow.fin = 0;
+        update_flow(&flow, &packet);
     }
 
-    if (found == g_packet_process_map.end()) {
-        /* Packets that do not already have an associated application will be
-         * put into the unresolved_packets map which will act as a buffer for a
-         * connection dictated by its packet hash. This is to reduce the amount
-         * of times we call refresh_proc_mappings() overall. */
-
-        if (packet.direction == OUTGOING_DIRECTION) {
-            unresolved_packets[hash].pkt_tx += packet.len;
-            unresolved_packets[hash].pkt_tx_c++;
-            packet.protocol == IPPROTO_TCP ? unresolved_packets[hash].pkt_tcp++
-                                           : unresolved_packets[hash].pkt_udp++;
-
-        } else if (packet.direction == INCOMING_DIRECTION) {
-            unresolved_packets[hash].pkt_rx += packet.len;
-            unresolved_packets[hash].pkt_rx_c++;
-            packet.protocol == IPPROTO_TCP ? unresolved_packets[hash].pkt_tcp++
-                                           : unresolved_packets[hash].pkt_udp++;
+    rcu_read_unlock(&capture->rcu);
+}
+
+void flush_packet_batch(u_char *args) {
+    struct capture *capture = (struct capture *)args;
+
+    capture_adapt_sampling(capture);
+    capture_refresh_filter(capture);
+    if (capture->batch_len == 0) return;
+
+    resolve_batch(capture);
+    expire_flows(capture, capture->batch[capture->batch_len - 1].packet.time);
+
+    /* Nothing is locked, the database thread only drains the other epoch */
+    struct traffic_epoch *epoch = capture_begin_accounting(capture);
+
+    for (size_t i = 0; i < capture->batch_len; i++) {
+        struct batch_entry &entry = capture->batch[i];
+
+        if (entry.app == NULL) {
+            /* Packets that do not already have an associated application
+             * will be put into the unresolved map which will act as a buffer
+             * for a connection dictated by its packet hash. This is to
+             * reduce the amount of times we call refresh_proc_mappings()
+             * overall. */
+            struct pending_flow *pending = capture->unresolved.find(entry.key);
+            if (pending == NULL &&
+                capture->unresolved.size() < (size_t)g_args.pending_flows) {
+                pending = &capture->unresolved[entry.key];
+                pending->first_seen = entry.packet.time;
+                pending->next_retry = entry.packet.time;
+                pending->generation = capture->map_generation;
+            }
+
+            if (pending != NULL) {
+                account_packet(&pending->traffic, &entry.packet);
+            } else {
+                /* Full, a port scan or flood must not grow it any further */
+                account_packet(&epoch_traffic(epoch, g_unattributed,
+                                              entry.packet.time),
+                               &entry.packet);
+                capture->unattributed += entry.packet.weight;
+            }
+        } else {
+            account_packet(&epoch_traffic(epoch, entry.app, entry.packet.time),
+                           &entry.packet);
+            capture->resolved += entry.packet.weight;
         }
 
-        resolve_interval++;
-        return;
+        capture->accounted += entry.packet.weight;
+        if (entry.packet.weight > epoch->sample_rate)
+            epoch->sample_rate = entry.packet.weight;
     }
 
-    /* After this point, the packet successfully resolved to an application */
-    std::shared_ptr<struct application> app;
-    app = found->second;
-    if (packet.direction == OUTGOING_DIRECTION) {
-        app->pkt_tx += packet.len;
-        app->pkt_tx_c++;
-        packet.protocol == IPPROTO_TCP ? app->pkt_tcp++ : app->pkt_udp++;
-    } else if (packet.direction == INCOMING_DIRECTION) {
-        app->pkt_rx += packet.len;
-        app->pkt_rx_c++;
-        packet.protocol == IPPROTO_TCP ? app->pkt_tcp++ : app->pkt_udp++;
+    capture_end_accounting(capture);
+
+    time_t now = capture->batch[capture->batch_len - 1].packet.time;
+    capture->resolve_interval += capture->batch_len;
+    capture->batch_len = 0;
+
+    /* Every 100 packets captured we try to resolve any unresolved packets.
+     * This is completely arbitrary, and something else could be better.
+     * Could a timed interval potentially be better? */
+    if (capture->resolve_interval > 100) {
+        try_resolve_packets(capture, now);
+        capture->resolve_interval = 0;
     }
+}
+
+void xdp_packet_handler(u_char *args, const struct timeval *ts,
+                        const u_char *frame, unsigned int caplen,
+                        unsigned int len) {
+    struct pcap_pkthdr header;
+    header.ts = *ts;
+    header.caplen = caplen;
+    header.len = len;
 
-    resolve_interval++;
+    struct capture *capture = (struct capture *)args;
+    capture->handler(args, &header, frame);
 }
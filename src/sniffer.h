@@ -3,23 +3,26 @@
 
 #include <pcap.h>
 
+#include "capture.h"
 #include "packet.h"
 
-/* Temporary struct for unresolved packets to store their summed information */
-struct unresolved_buffer {
-    unsigned long long pkt_rx; /* packets received in bytes */
-    unsigned long long pkt_tx; /* packets transmitted in bytes */
-    int pkt_rx_c;              /* number of packets received */
-    int pkt_tx_c;              /* number of packets transmitted */
-    int pkt_tcp;               /* number of tcp packets */
-    int pkt_udp;               /* number of udp packets */
-};
+/* Searchs the named interface for all local ip addresses belonging to it and
+ * appends them to ips. The any device gets those of every interface. */
+void get_local_ip_addresses(const char *name, struct ip_list **ips);
 
-/* Global linked list of all local ip addresses for the target device */
-extern struct ip_list *g_local_ip_list;
+/* Reads the devices local ip addresses again and publishes them as its new
+ * set of local addresses. Returns 1 if they changed, 0 if not. */
+int refresh_local_ip_addresses(struct device *device);
 
-/* Searchs device interface for all local ip addresses belonging to it. */
-void get_local_ip_addresses(const char *device_name);
+/* Parse the ip header at offset into the packet, caplen and len being those
+ * of the whole frame. Returns the offset of the transport header, or -1 if
+ * the packet has none we can account (non first fragments, ESP, ...). The
+ * ipv6 variant walks any extension headers to find it. */
+int handle_ipv4_packet(struct packet *packet, const u_char *buffer, int offset,
+                       unsigned int caplen, unsigned int len);
+
+int handle_ipv6_packet(struct packet *packet, const u_char *buffer, int offset,
+                       unsigned int caplen, unsigned int len);
 
 void handle_tcp_packet(struct packet *packet, const u_char *buffer, int offset);
 
@@ -29,20 +32,35 @@ void handle_udp_packet(struct packet *packet, const u_char *buffer, int offset);
  * Packets to be ignored include DNS, MDNS , and SSDP traffic. */
 int should_disregard_packet(const struct packet *packet);
 
-/* Attempts to connect any pending packet buffers inside the unresolved_packets
- * map to an application. We only need to call refresh_proc_mappings() once to
- * achieve this for all of the packets in the map. */
-void try_resolve_packets();
-
-/*
- * Function handler that is hooked with libpcap to be executed everytime a
- * packet is captured. This is the source of where most of the logic in
- * Omnis branches from.
- *
- * args are additional arguments to the handler,
- * header is the base packet header provided by pcap,
- * buffer is the raw packet string caught by pcap.
- */
-void packet_handler(u_char *args, const struct pcap_pkthdr *header,
-                    const u_char *buffer);
+/* Attempts to connect the pending flows inside the captures unresolved map
+ * that are due for a retry to an application. Flows are only looked up again
+ * in a map newer than the one they missed in, if there is none yet the
+ * refresh thread is asked to find their sockets. Every miss doubles the wait
+ * until the next retry, up to PENDING_MAX_BACKOFF seconds. Flows still
+ * unresolved PENDING_TTL seconds after their first packet are accounted to
+ * g_unattributed. now is the timestamp of the latest packet. */
+void try_resolve_packets(struct capture *capture, time_t now);
+
+/* Looks every pending flow up one last time, accounting those that still
+ * miss to g_unattributed, and empties the unresolved map. */
+void flush_unresolved_packets(struct capture *capture);
+
+/* Returns the packet handler specialized for the pcap link type (DLT_*), or
+ * NULL if the link type isn't supported. Supported are ethernet with any
+ * 802.1Q/QinQ tags, Linux cooked captures (SLL and SLL2, as on the "any"
+ * device), raw ip as on tun devices, and BSD style loopback. The handler
+ * parses each packet and adds it to the batch of the capture given as args. */
+pcap_handler packet_handler_for_datalink(int datalink);
+
+/* Looks up every packet in the captures batch in g_packet_process_map, then
+ * adds them all to the captures current traffic epoch without any lock.
+ * Backends also call this whenever they run out of packets for the moment,
+ * so a partial batch never waits on the next packet. args is the capture. */
+void flush_packet_batch(u_char *args);
+
+/* Adapts frames read by the XDP backend to the captures handler, frame points
+ * directly into the XDP ring buffer. */
+void xdp_packet_handler(u_char *args, const struct timeval *ts,
+                        const u_char *frame, unsigned int caplen,
+                        unsigned int len);
 #endif
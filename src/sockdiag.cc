@@ -0,0 +1,184 @@
+#include "sockdiag.h"
+
+#include <linux/inet_diag.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include "list.h"
+#include "omnis.h"
+
+int sock_diag_open() {
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+    if (fd < 0) {
+        fprintf(g_log, "Could not open sock_diag socket: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Sends a single inet_diag request to the kernel */
+static int sock_diag_send(int fd, const struct inet_diag_req_v2 *request,
+                          uint16_t flags) {
+    struct {
+        struct nlmsghdr header;
+        struct inet_diag_req_v2 request;
+    } message;
+    memset(&message, 0, sizeof(message));
+
+    message.header.nlmsg_len = sizeof(message);
+    message.header.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+    message.header.nlmsg_flags = NLM_F_REQUEST | flags;
+    message.request = *request;
+
+    struct sockaddr_nl kernel;
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+
+    while (sendto(fd, &message, sizeof(message), 0,
+                  (struct sockaddr *)&kernel, sizeof(kernel)) < 0) {
+        if (errno == EINTR) continue;
+
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Converts the inet_diag record of a socket */
+static void diag_socket_from_msg(struct diag_socket *socket,
+                                 const struct inet_diag_msg *msg) {
+    if (msg->idiag_family == AF_INET) {
+        ip_from_ipv4(&socket->key.local_ip, msg->id.idiag_src[0]);
+        ip_from_ipv4(&socket->key.remote_ip, msg->id.idiag_dst[0]);
+    } else {
+        memcpy(&socket->key.local_ip, msg->id.idiag_src,
+               sizeof(struct in6_addr));
+        memcpy(&socket->key.remote_ip, msg->id.idiag_dst,
+               sizeof(struct in6_addr));
+    }
+
+    socket->key.local_port = ntohs(msg->id.idiag_sport);
+    socket->key.remote_port = ntohs(msg->id.idiag_dport);
+    socket->inode = msg->idiag_inode;
+    socket->uid = msg->idiag_uid;
+    socket->state = msg->idiag_state;
+    socket->cookie = (uint64_t)msg->id.idiag_cookie[1] << 32 |
+                     msg->id.idiag_cookie[0];
+}
+
+/* Reads the replies to a request until it is done, passing every socket to
+ * handler. Returns the number of sockets, or -1 with errno set if the kernel
+ * failed the request. */
+static int sock_diag_receive(int fd, int protocol, diag_socket_handler handler,
+                             struct diag_socket *last) {
+    alignas(struct nlmsghdr) char buffer[32768];
+    int sockets = 0;
+
+    while (1) {
+        ssize_t len = recv(fd, buffer, sizeof(buffer), 0);
+        if (len < 0) {
+            if (errno == EINTR) continue;
+
+            return -1;
+        }
+
+        for (struct nlmsghdr *message = (struct nlmsghdr *)buffer;
+             NLMSG_OK(message, len); message = NLMSG_NEXT(message, len)) {
+            if (message->nlmsg_type == NLMSG_DONE) return sockets;
+
+            if (message->nlmsg_type == NLMSG_ERROR) {
+                struct nlmsgerr *error = (struct nlmsgerr *)NLMSG_DATA(message);
+                if (error->error == 0) return sockets;
+
+                errno = -error->error;
+                return -1;
+            }
+
+            if (message->nlmsg_type != SOCK_DIAG_BY_FAMILY) continue;
+
+            diag_socket_from_msg(last,
+                                 (struct inet_diag_msg *)NLMSG_DATA(message));
+            sockets++;
+
+            if (handler != NULL) handler(last, protocol);
+        }
+
+        /* A lookup of a single socket ends with its only reply */
+        if (handler == NULL && sockets > 0) return sockets;
+    }
+}
+
+int sock_diag_dump(int fd, int family, int protocol, uint32_t states,
+                   diag_socket_handler handler) {
+    struct inet_diag_req_v2 request;
+    memset(&request, 0, sizeof(request));
+    request.sdiag_family = family;
+    request.sdiag_protocol = protocol;
+    request.idiag_states = states;
+
+    if (sock_diag_send(fd, &request, NLM_F_DUMP) < 0) return -1;
+
+    struct diag_socket socket;
+    return sock_diag_receive(fd, protocol, handler, &socket) < 0 ? -1 : 0;
+}
+
+/* Looks up the socket in a single family, see sock_diag_find() */
+static int sock_diag_find_family(int fd, int family, const struct flow_key *key,
+                                 int protocol, struct diag_socket *socket) {
+    struct inet_diag_req_v2 request;
+    memset(&request, 0, sizeof(request));
+    request.sdiag_family = family;
+    request.sdiag_protocol = protocol;
+    request.idiag_states = ~0u;
+    request.id.idiag_cookie[0] = INET_DIAG_NOCOOKIE;
+    request.id.idiag_cookie[1] = INET_DIAG_NOCOOKIE;
+
+    /* TCP lookups take the local side as the source. UDP ones have them
+     * swapped in the kernel for historical reasons. */
+    const struct in6_addr *source = &key->local_ip;
+    const struct in6_addr *dest = &key->remote_ip;
+    uint16_t source_port = key->local_port, dest_port = key->remote_port;
+    if (protocol == IPPROTO_UDP) {
+        std::swap(source, dest);
+        std::swap(source_port, dest_port);
+    }
+
+    request.id.idiag_sport = htons(source_port);
+    request.id.idiag_dport = htons(dest_port);
+    if (family == AF_INET) {
+        request.id.idiag_src[0] = source->s6_addr32[3];
+        request.id.idiag_dst[0] = dest->s6_addr32[3];
+    } else {
+        memcpy(request.id.idiag_src, source, sizeof(struct in6_addr));
+        memcpy(request.id.idiag_dst, dest, sizeof(struct in6_addr));
+    }
+
+    if (sock_diag_send(fd, &request, 0) < 0) return -1;
+
+    int found = sock_diag_receive(fd, protocol, NULL, socket);
+    if (found < 0) return errno == ENOENT ? 0 : -1;
+
+    return found > 0;
+}
+
+int sock_diag_find(int fd, const struct flow_key *key, int protocol,
+                   struct diag_socket *socket) {
+    if (!IN6_IS_ADDR_V4MAPPED(&key->local_ip))
+        return sock_diag_find_family(fd, AF_INET6, key, protocol, socket);
+
+    /* ipv4 flows may also belong to a dual stack ipv6 socket */
+    int found = sock_diag_find_family(fd, AF_INET, key, protocol, socket);
+    if (found != 0) return found;
+
+    return sock_diag_find_family(fd, AF_INET6, key, protocol, socket);
+}
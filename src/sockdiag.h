@@ -0,0 +1,42 @@
+#ifndef SOCKDIAG_H
+#define SOCKDIAG_H
+
+#include <stdint.h>
+
+#include "packet.h"
+
+/* Instead of having the kernel format every socket into the /proc/net text
+ * tables only for us to parse them again, a NETLINK_SOCK_DIAG socket gets the
+ * same sockets as binary inet_diag records. The kernel filters a dump by
+ * socket state, and can look up a single socket by its exact addresses and
+ * ports, so resolving one unknown flow doesn't need a dump at all. */
+
+/* A socket as reported by sock_diag */
+struct diag_socket {
+    struct flow_key key; /* local and remote address and port */
+    unsigned long inode; /* inode of the socket, 0 for TIME_WAIT sockets */
+    uint32_t uid;        /* user owning the socket */
+    uint8_t state;       /* TCP_* state, unconnected udp sockets are closed */
+    uint64_t cookie;     /* socket cookie, as BPF programs see it too */
+};
+
+/* Called for every socket of a dump, protocol being its IPPROTO_* */
+typedef void (*diag_socket_handler)(const struct diag_socket *socket,
+                                    int protocol);
+
+/* Opens a sock_diag netlink socket. Returns the socket, or -1 on failure with
+ * the reason written to g_log. */
+int sock_diag_open();
+
+/* Dumps every socket of the family (AF_INET or AF_INET6) and protocol
+ * (IPPROTO_TCP or IPPROTO_UDP) that is in one of states, a mask of 1 << TCP_*
+ * bits, calling handler for each. Returns 0, or -1 on failure. */
+int sock_diag_dump(int fd, int family, int protocol, uint32_t states,
+                   diag_socket_handler handler);
+
+/* Looks up the socket the flow belongs to. Returns 1 and fills socket if it
+ * was found, 0 if there is none, or -1 on failure. */
+int sock_diag_find(int fd, const struct flow_key *key, int protocol,
+                   struct diag_socket *socket);
+
+#endif
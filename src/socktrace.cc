@@ -0,0 +1,698 @@
+#include "socktrace.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <mntent.h>
+#include <netinet/in.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bpf_insn.h"
+#include "omnis.h"
+#include "proc.h"
+#include "sockdiag.h"
+
+/* Size of the ring buffer, records are small and read right away */
+static const size_t SOCK_TRACE_RING_SIZE = 1 << 20;
+
+/* UDP sockets remembered as having sent already, so only their first
+ * sendmsg() is traced */
+static const uint32_t SOCK_TRACE_SENT_MAX = 65536;
+
+/* Connecting sockets and listening ports remembered by the loop, both are
+ * forgotten all at once when they grow past this */
+static const size_t SOCK_TRACE_PENDING_MAX = 65536;
+
+/* Where each program gets the socket from */
+enum sock_trace_ctx {
+    SOCK_ADDR_CTX, /* struct bpf_sock_addr of connect() and sendmsg() */
+    SOCK_CTX,      /* struct bpf_sock of bind() and release */
+    SOCK_OPS_CTX,  /* struct bpf_sock_ops, for both established events */
+};
+
+static const struct sock_trace_hook {
+    uint32_t prog_type;
+    uint32_t attach_type;
+    enum sock_trace_ctx ctx;
+    enum sock_trace_event event;
+    bool ipv6; /* which addresses of the context are readable */
+    const char *name;
+} SOCK_TRACE_HOOKS[SOCK_TRACE_PROGS] = {
+    {BPF_PROG_TYPE_CGROUP_SOCK_ADDR, BPF_CGROUP_INET4_CONNECT, SOCK_ADDR_CTX,
+     SOCK_TRACE_CONNECT, false, "omnis_connect4"},
+    {BPF_PROG_TYPE_CGROUP_SOCK_ADDR, BPF_CGROUP_INET6_CONNECT, SOCK_ADDR_CTX,
+     SOCK_TRACE_CONNECT, true, "omnis_connect6"},
+    {BPF_PROG_TYPE_CGROUP_SOCK_ADDR, BPF_CGROUP_UDP4_SENDMSG, SOCK_ADDR_CTX,
+     SOCK_TRACE_SENDMSG, false, "omnis_sendmsg4"},
+    {BPF_PROG_TYPE_CGROUP_SOCK_ADDR, BPF_CGROUP_UDP6_SENDMSG, SOCK_ADDR_CTX,
+     SOCK_TRACE_SENDMSG, true, "omnis_sendmsg6"},
+    {BPF_PROG_TYPE_CGROUP_SOCK, BPF_CGROUP_INET4_POST_BIND, SOCK_CTX,
+     SOCK_TRACE_BIND, false, "omnis_bind4"},
+    {BPF_PROG_TYPE_CGROUP_SOCK, BPF_CGROUP_INET6_POST_BIND, SOCK_CTX,
+     SOCK_TRACE_BIND, true, "omnis_bind6"},
+    {BPF_PROG_TYPE_SOCK_OPS, BPF_CGROUP_SOCK_OPS, SOCK_OPS_CTX,
+     SOCK_TRACE_ACTIVE, false, "omnis_sock_ops"},
+};
+
+/* record->field = *(size *)(src + off) */
+static void copy_field(bpf_prog &prog, int size, int src, int16_t off,
+                       int16_t field) {
+    bpf_load(prog, size, BPF_REG_1, src, off);
+    bpf_store_reg(prog, size, BPF_REG_8, BPF_REG_1, field);
+}
+
+/* Reserves a record into r8, returns the jump taken if the ring is full */
+static size_t reserve_record(bpf_prog &prog, int ringbuf_fd) {
+    bpf_load_map_fd(prog, BPF_REG_1, ringbuf_fd);
+    bpf_mov_imm(prog, BPF_REG_2, sizeof(struct sock_trace_record));
+    bpf_mov_imm(prog, BPF_REG_3, 0);
+    bpf_call(prog, BPF_FUNC_ringbuf_reserve);
+    size_t full = bpf_jump_imm(prog, BPF_JEQ, BPF_REG_0, 0, 0);
+    bpf_mov_reg(prog, BPF_REG_8, BPF_REG_0);
+
+    return full;
+}
+
+static void submit_record(bpf_prog &prog) {
+    bpf_store_imm(prog, BPF_W, BPF_REG_8,
+                  offsetof(struct sock_trace_record, pad), 0);
+    bpf_mov_reg(prog, BPF_REG_1, BPF_REG_8);
+    bpf_mov_imm(prog, BPF_REG_2, 0);
+    bpf_call(prog, BPF_FUNC_ringbuf_submit);
+}
+
+/* Builds the program of a connect(), sendmsg() or bind() hook.
+ * These run in the context of the process using the socket. In pseudo C:
+ *
+ *   sk = ctx is a bpf_sock_addr ? ctx->sk : ctx;
+ *   cookie = bpf_get_socket_cookie(ctx);
+ *   if (sendmsg && sk->src_port) {
+ *       if (bpf_map_update_elem(sent, &cookie, &zero, BPF_NOEXIST))
+ *           return 1;
+ *   }
+ *   record = bpf_ringbuf_reserve(ringbuf, sizeof(*record), 0);
+ *   if (!record) return 1;
+ *   record->cookie = cookie;
+ *   record->pid_tgid = bpf_get_current_pid_tgid();
+ *   record->cgroup_id = bpf_get_current_cgroup_id();
+ *   bpf_get_current_comm(record->comm, 16);
+ *   record->local_* = sk->src_*; record->remote_* = sk->dst_*;
+ *   if (ctx is a bpf_sock_addr)
+ *       record->remote_* = ctx->user_*;
+ *   bpf_ringbuf_submit(record, 0);
+ *   return 1;
+ *
+ * Returning 1 lets the call go ahead unchanged. */
+static bpf_prog build_sock_program(const struct sock_trace_hook *hook,
+                                   int ringbuf_fd, int sent_fd) {
+    typedef struct sock_trace_record record;
+    bpf_prog prog;
+    std::vector<size_t> to_out;
+
+    /* r6 = ctx, r7 = sk, r9 = cookie */
+    bpf_mov_reg(prog, BPF_REG_6, BPF_REG_1);
+    if (hook->ctx == SOCK_ADDR_CTX)
+        bpf_load(prog, BPF_DW, BPF_REG_7, BPF_REG_6,
+                 offsetof(struct bpf_sock_addr, sk));
+    else
+        bpf_mov_reg(prog, BPF_REG_7, BPF_REG_6);
+
+    bpf_mov_reg(prog, BPF_REG_1, BPF_REG_6);
+    bpf_call(prog, BPF_FUNC_get_socket_cookie);
+    bpf_mov_reg(prog, BPF_REG_9, BPF_REG_0);
+
+    if (hook->event == SOCK_TRACE_SENDMSG) {
+        /* Not bound yet, the record is still written and its port looked up
+         * by cookie. Only a socket with a port counts as having sent, so
+         * a later send records it again if that fails. */
+        bpf_load(prog, BPF_W, BPF_REG_1, BPF_REG_7,
+                 offsetof(struct bpf_sock, src_port));
+        size_t unbound = bpf_jump_imm(prog, BPF_JEQ, BPF_REG_1, 0, 0);
+
+        bpf_store_reg(prog, BPF_DW, BPF_REG_10, BPF_REG_9, -8);
+        bpf_store_imm(prog, BPF_DW, BPF_REG_10, -16, 0);
+        bpf_load_map_fd(prog, BPF_REG_1, sent_fd);
+        bpf_mov_reg(prog, BPF_REG_2, BPF_REG_10);
+        bpf_alu_imm(prog, BPF_ADD, BPF_REG_2, -8);
+        bpf_mov_reg(prog, BPF_REG_3, BPF_REG_10);
+        bpf_alu_imm(prog, BPF_ADD, BPF_REG_3, -16);
+        bpf_mov_imm(prog, BPF_REG_4, BPF_NOEXIST);
+        bpf_call(prog, BPF_FUNC_map_update_elem);
+        to_out.push_back(bpf_jump_imm(prog, BPF_JNE, BPF_REG_0, 0, 0));
+
+        bpf_patch_jump(prog, unbound);
+    }
+
+    to_out.push_back(reserve_record(prog, ringbuf_fd));
+    bpf_store_reg(prog, BPF_DW, BPF_REG_8, BPF_REG_9,
+                  offsetof(record, cookie));
+
+    bpf_call(prog, BPF_FUNC_get_current_pid_tgid);
+    bpf_store_reg(prog, BPF_DW, BPF_REG_8, BPF_REG_0,
+                  offsetof(record, pid_tgid));
+    bpf_call(prog, BPF_FUNC_get_current_cgroup_id);
+    bpf_store_reg(prog, BPF_DW, BPF_REG_8, BPF_REG_0,
+                  offsetof(record, cgroup_id));
+    bpf_mov_reg(prog, BPF_REG_1, BPF_REG_8);
+    bpf_alu_imm(prog, BPF_ADD, BPF_REG_1, offsetof(record, comm));
+    bpf_mov_imm(prog, BPF_REG_2, sizeof(((record *)0)->comm));
+    bpf_call(prog, BPF_FUNC_get_current_comm);
+
+    /* Bind hooks may only read the addresses of their own family, the
+     * others are zeroed */
+    if (hook->ipv6) {
+        for (int i = 0; i < 4; i++) {
+            copy_field(prog, BPF_W, BPF_REG_7,
+                       offsetof(struct bpf_sock, src_ip6) + 4 * i,
+                       offsetof(record, local_ip6) + 4 * i);
+            copy_field(prog, BPF_W, BPF_REG_7,
+                       offsetof(struct bpf_sock, dst_ip6) + 4 * i,
+                       offsetof(record, remote_ip6) + 4 * i);
+        }
+        bpf_store_imm(prog, BPF_W, BPF_REG_8, offsetof(record, local_ip4), 0);
+        bpf_store_imm(prog, BPF_W, BPF_REG_8, offsetof(record, remote_ip4),
+                      0);
+    } else {
+        copy_field(prog, BPF_W, BPF_REG_7, offsetof(struct bpf_sock, src_ip4),
+                   offsetof(record, local_ip4));
+        copy_field(prog, BPF_W, BPF_REG_7, offsetof(struct bpf_sock, dst_ip4),
+                   offsetof(record, remote_ip4));
+        for (int i = 0; i < 4; i++) {
+            bpf_store_imm(prog, BPF_W, BPF_REG_8,
+                          offsetof(record, local_ip6) + 4 * i, 0);
+            bpf_store_imm(prog, BPF_W, BPF_REG_8,
+                          offsetof(record, remote_ip6) + 4 * i, 0);
+        }
+    }
+    copy_field(prog, BPF_W, BPF_REG_7, offsetof(struct bpf_sock, src_port),
+               offsetof(record, local_port));
+    bpf_load(prog, BPF_H, BPF_REG_1, BPF_REG_7,
+             offsetof(struct bpf_sock, dst_port));
+    bpf_store_reg(prog, BPF_W, BPF_REG_8, BPF_REG_1,
+                  offsetof(record, remote_port));
+    copy_field(prog, BPF_W, BPF_REG_7, offsetof(struct bpf_sock, family),
+               offsetof(record, family));
+    copy_field(prog, BPF_W, BPF_REG_7, offsetof(struct bpf_sock, protocol),
+               offsetof(record, protocol));
+
+    /* The socket isn't connected yet, the address it is given is */
+    if (hook->ctx == SOCK_ADDR_CTX) {
+        if (hook->ipv6) {
+            for (int i = 0; i < 4; i++)
+                copy_field(prog, BPF_W, BPF_REG_6,
+                           offsetof(struct bpf_sock_addr, user_ip6) + 4 * i,
+                           offsetof(record, remote_ip6) + 4 * i);
+        } else {
+            copy_field(prog, BPF_W, BPF_REG_6,
+                       offsetof(struct bpf_sock_addr, user_ip4),
+                       offsetof(record, remote_ip4));
+        }
+        copy_field(prog, BPF_W, BPF_REG_6,
+                   offsetof(struct bpf_sock_addr, user_port),
+                   offsetof(record, remote_port));
+    }
+
+    bpf_store_imm(prog, BPF_W, BPF_REG_8, offsetof(record, event),
+                  hook->event);
+    submit_record(prog);
+
+    for (size_t jump : to_out) bpf_patch_jump(prog, jump);
+    bpf_mov_imm(prog, BPF_REG_0, 1);
+    bpf_exit(prog);
+
+    return prog;
+}
+
+/* Builds the sock_ops program. Established callbacks run in softirq context
+ * without a process, only the addresses and the cookie are recorded:
+ *
+ *   if (ctx->op == BPF_SOCK_OPS_ACTIVE_ESTABLISHED_CB)
+ *       event = SOCK_TRACE_ACTIVE;
+ *   else if (ctx->op == BPF_SOCK_OPS_PASSIVE_ESTABLISHED_CB)
+ *       event = SOCK_TRACE_PASSIVE;
+ *   else
+ *       return 1;
+ *   record = bpf_ringbuf_reserve(ringbuf, sizeof(*record), 0);
+ *   ...
+ */
+static bpf_prog build_sock_ops_program(int ringbuf_fd) {
+    typedef struct sock_trace_record record;
+    bpf_prog prog;
+    std::vector<size_t> to_out;
+
+    /* r6 = ctx, r7 = event */
+    bpf_mov_reg(prog, BPF_REG_6, BPF_REG_1);
+    bpf_load(prog, BPF_W, BPF_REG_1, BPF_REG_6,
+             offsetof(struct bpf_sock_ops, op));
+    bpf_mov_imm(prog, BPF_REG_7, SOCK_TRACE_ACTIVE);
+    size_t active = bpf_jump_imm(prog, BPF_JEQ, BPF_REG_1,
+                                 BPF_SOCK_OPS_ACTIVE_ESTABLISHED_CB, 0);
+    bpf_mov_imm(prog, BPF_REG_7, SOCK_TRACE_PASSIVE);
+    to_out.push_back(bpf_jump_imm(prog, BPF_JNE, BPF_REG_1,
+                                  BPF_SOCK_OPS_PASSIVE_ESTABLISHED_CB, 0));
+    bpf_patch_jump(prog, active);
+
+    to_out.push_back(reserve_record(prog, ringbuf_fd));
+
+    bpf_mov_reg(prog, BPF_REG_1, BPF_REG_6);
+    bpf_call(prog, BPF_FUNC_get_socket_cookie);
+    bpf_store_reg(prog, BPF_DW, BPF_REG_8, BPF_REG_0,
+                  offsetof(record, cookie));
+
+    bpf_store_imm(prog, BPF_DW, BPF_REG_8, offsetof(record, pid_tgid), 0);
+    bpf_store_imm(prog, BPF_DW, BPF_REG_8, offsetof(record, cgroup_id), 0);
+    bpf_store_imm(prog, BPF_DW, BPF_REG_8, offsetof(record, comm), 0);
+    bpf_store_imm(prog, BPF_DW, BPF_REG_8, offsetof(record, comm) + 8, 0);
+
+    copy_field(prog, BPF_W, BPF_REG_6,
+               offsetof(struct bpf_sock_ops, local_ip4),
+               offsetof(record, local_ip4));
+    copy_field(prog, BPF_W, BPF_REG_6,
+               offsetof(struct bpf_sock_ops, remote_ip4),
+               offsetof(record, remote_ip4));
+    for (int i = 0; i < 4; i++) {
+        copy_field(prog, BPF_W, BPF_REG_6,
+                   offsetof(struct bpf_sock_ops, local_ip6) + 4 * i,
+                   offsetof(record, local_ip6) + 4 * i);
+        copy_field(prog, BPF_W, BPF_REG_6,
+                   offsetof(struct bpf_sock_ops, remote_ip6) + 4 * i,
+                   offsetof(record, remote_ip6) + 4 * i);
+    }
+    copy_field(prog, BPF_W, BPF_REG_6,
+               offsetof(struct bpf_sock_ops, local_port),
+               offsetof(record, local_port));
+    copy_field(prog, BPF_W, BPF_REG_6,
+               offsetof(struct bpf_sock_ops, remote_port),
+               offsetof(record, remote_port));
+    copy_field(prog, BPF_W, BPF_REG_6, offsetof(struct bpf_sock_ops, family),
+               offsetof(record, family));
+    bpf_store_imm(prog, BPF_W, BPF_REG_8, offsetof(record, protocol),
+                  IPPROTO_TCP);
+    bpf_store_reg(prog, BPF_W, BPF_REG_8, BPF_REG_7, offsetof(record, event));
+    submit_record(prog);
+
+    for (size_t jump : to_out) bpf_patch_jump(prog, jump);
+    bpf_mov_imm(prog, BPF_REG_0, 1);
+    bpf_exit(prog);
+
+    return prog;
+}
+
+/* Opens the root of the cgroup v2 hierarchy, wherever it is mounted */
+static int open_cgroup_root() {
+    FILE *mounts = setmntent("/proc/mounts", "r");
+    if (mounts == NULL) return -1;
+
+    int fd = -1;
+    struct mntent *mount;
+    while ((mount = getmntent(mounts))) {
+        if (strcmp(mount->mnt_type, "cgroup2") != 0) continue;
+
+        fd = open(mount->mnt_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        break;
+    }
+    endmntent(mounts);
+
+    if (fd < 0 && errno == 0) errno = ENOENT;
+    return fd;
+}
+
+int sock_trace_open(struct sock_trace *trace) {
+    memset(trace, 0, sizeof(struct sock_trace));
+    trace->cgroup_fd = trace->ringbuf_fd = trace->sent_fd = -1;
+    for (int i = 0; i < SOCK_TRACE_PROGS; i++)
+        trace->prog_fds[i] = trace->link_fds[i] = -1;
+
+    errno = 0;
+    trace->cgroup_fd = open_cgroup_root();
+    if (trace->cgroup_fd < 0) {
+        fprintf(g_log, "Could not open the cgroup v2 hierarchy: %s\n",
+                strerror(errno));
+        sock_trace_close(trace);
+        return -1;
+    }
+
+    trace->ringbuf_fd = bpf_create_map(BPF_MAP_TYPE_RINGBUF, 0, 0,
+                                       SOCK_TRACE_RING_SIZE, "omnis_sockets");
+    trace->sent_fd =
+        bpf_create_map(BPF_MAP_TYPE_LRU_HASH, sizeof(uint64_t),
+                       sizeof(uint64_t), SOCK_TRACE_SENT_MAX, "omnis_sent");
+    if (trace->ringbuf_fd < 0 || trace->sent_fd < 0) {
+        fprintf(g_log,
+                "Could not create socket trace maps, BPF ring buffers need "
+                "Linux 5.8+: %s\n",
+                strerror(errno));
+        sock_trace_close(trace);
+        return -1;
+    }
+
+    static char log[65536];
+    for (int i = 0; i < SOCK_TRACE_PROGS; i++) {
+        const struct sock_trace_hook *hook = &SOCK_TRACE_HOOKS[i];
+        bpf_prog prog =
+            hook->ctx == SOCK_OPS_CTX
+                ? build_sock_ops_program(trace->ringbuf_fd)
+                : build_sock_program(hook, trace->ringbuf_fd, trace->sent_fd);
+
+        trace->prog_fds[i] =
+            bpf_load_program(hook->prog_type, hook->attach_type, prog.data(),
+                             prog.size(), hook->name, log, sizeof(log));
+        if (trace->prog_fds[i] < 0) {
+            fprintf(g_log, "Could not load BPF program %s: %s\n%s\n",
+                    hook->name, strerror(errno), log);
+            sock_trace_close(trace);
+            return -1;
+        }
+
+        trace->link_fds[i] = bpf_create_link(
+            trace->prog_fds[i], trace->cgroup_fd, hook->attach_type, 0);
+        if (trace->link_fds[i] < 0) {
+            fprintf(g_log, "Could not attach BPF program %s to cgroup: %s\n",
+                    hook->name, strerror(errno));
+            sock_trace_close(trace);
+            return -1;
+        }
+    }
+
+    if (bpf_ringbuf_open(&trace->ringbuf, trace->ringbuf_fd,
+                         SOCK_TRACE_RING_SIZE) < 0) {
+        fprintf(g_log, "Could not mmap socket trace ring buffer: %s\n",
+                strerror(errno));
+        sock_trace_close(trace);
+        return -1;
+    }
+
+    if (g_args.debug)
+        fprintf(g_log, "Attached %d socket trace programs\n",
+                SOCK_TRACE_PROGS);
+
+    return 0;
+}
+
+void sock_trace_key(const struct sock_trace_record *record,
+                    struct flow_key *key) {
+    memset(key, 0, sizeof(struct flow_key));
+
+    if (record->family == AF_INET) {
+        ip_from_ipv4(&key->local_ip, record->local_ip4);
+        ip_from_ipv4(&key->remote_ip, record->remote_ip4);
+    } else {
+        memcpy(&key->local_ip, record->local_ip6, sizeof(struct in6_addr));
+        memcpy(&key->remote_ip, record->remote_ip6, sizeof(struct in6_addr));
+    }
+
+    key->local_port = record->local_port;
+    if (record->event == SOCK_TRACE_ACTIVE ||
+        record->event == SOCK_TRACE_PASSIVE)
+        key->remote_port = ntohl(record->remote_port);
+    else
+        key->remote_port = ntohs((uint16_t)record->remote_port);
+}
+
+/* State of the loop joining the records of each socket */
+struct sock_trace_state {
+    /* comm of the process behind each connecting socket, by cookie */
+    std::unordered_map<uint64_t, std::string> connecting;
+    /* comm of the process that bound each TCP port, accepted connections
+     * belong to it */
+    std::unordered_map<uint16_t, std::string> listening;
+    /* comm of the process behind each UDP socket that sent before it had a
+     * local port, by cookie */
+    std::unordered_map<uint64_t, std::string> unbound;
+    /* owners found in the current pass over the ring buffer */
+    std::vector<struct socket_owner> owners;
+    /* sock_diag socket the ports of unbound sockets are looked up with */
+    int diag_fd = -1;
+};
+
+static void add_owner(struct sock_trace_state *trace,
+                      const struct flow_key *key, int protocol,
+                      const char *comm) {
+    struct socket_owner owner;
+    owner.key = *key;
+    owner.protocol = protocol;
+    strncpy(owner.comm, comm, sizeof(owner.comm) - 1);
+    owner.comm[sizeof(owner.comm) - 1] = '\0';
+
+    if (g_args.verbose) {
+        char hash[HASHKEYSIZE];
+        fprintf(g_log, "Traced %s socket %s of %s\n",
+                protocol == IPPROTO_UDP ? "udp" : "tcp",
+                flow_key_to_string(key, hash), owner.comm);
+    }
+
+    trace->owners.push_back(owner);
+}
+
+static void handle_record(void *ctx, const uint8_t *data, uint32_t len) {
+    struct sock_trace_state *trace = (struct sock_trace_state *)ctx;
+    const struct sock_trace_record *record =
+        (const struct sock_trace_record *)data;
+
+    if (len < sizeof(struct sock_trace_record)) return;
+    if (record->protocol != IPPROTO_TCP && record->protocol != IPPROTO_UDP)
+        return;
+
+    struct flow_key key;
+    sock_trace_key(record, &key);
+
+    switch (record->event) {
+        case SOCK_TRACE_CONNECT:
+            /* The UDP port is only picked after connect(), connected UDP
+             * sockets are left to /proc */
+            if (record->protocol != IPPROTO_TCP) break;
+
+            if (trace->connecting.size() >= SOCK_TRACE_PENDING_MAX)
+                trace->connecting.clear();
+            trace->connecting[record->cookie] = record->comm;
+            break;
+
+        case SOCK_TRACE_SENDMSG:
+            if (key.local_port == 0) {
+                if (trace->unbound.size() >= SOCK_TRACE_PENDING_MAX)
+                    trace->unbound.clear();
+                trace->unbound[record->cookie] = record->comm;
+                break;
+            }
+
+            key.remote_port = 0;
+            add_owner(trace, &key, IPPROTO_UDP, record->comm);
+            break;
+
+        case SOCK_TRACE_BIND:
+            if (record->protocol == IPPROTO_UDP) {
+                add_owner(trace, &key, IPPROTO_UDP, record->comm);
+                break;
+            }
+
+            if (trace->listening.size() >= SOCK_TRACE_PENDING_MAX)
+                trace->listening.clear();
+            trace->listening[key.local_port] = record->comm;
+            break;
+
+        case SOCK_TRACE_ACTIVE: {
+            auto found = trace->connecting.find(record->cookie);
+            if (found == trace->connecting.end()) break;
+
+            add_owner(trace, &key, IPPROTO_TCP, found->second.c_str());
+            trace->connecting.erase(found);
+            break;
+        }
+
+        case SOCK_TRACE_PASSIVE: {
+            auto found = trace->listening.find(key.local_port);
+            if (found != trace->listening.end())
+                add_owner(trace, &key, IPPROTO_TCP, found->second.c_str());
+            break;
+        }
+    }
+}
+
+/* The state find_unbound_sockets() is looking sockets up for */
+static struct sock_trace_state *unbound_state = NULL;
+
+static void handle_unbound_socket(const struct diag_socket *socket,
+                                  int protocol) {
+    auto found = unbound_state->unbound.find(socket->cookie);
+    if (found == unbound_state->unbound.end()) return;
+
+    struct flow_key key = socket->key;
+    key.remote_port = 0;
+    add_owner(unbound_state, &key, IPPROTO_UDP, found->second.c_str());
+    unbound_state->unbound.erase(found);
+}
+
+/* Finds the local ports of the UDP sockets that sent before they had one by
+ * dumping every UDP socket. Those closed again by now are missed. */
+static void find_unbound_sockets(struct sock_trace_state *trace) {
+    if (trace->diag_fd < 0) trace->diag_fd = sock_diag_open();
+
+    unbound_state = trace;
+    int families[] = {AF_INET, AF_INET6};
+    for (int family : families) {
+        if (trace->unbound.empty() || trace->diag_fd < 0) break;
+
+        sock_diag_dump(trace->diag_fd, family, IPPROTO_UDP, ~0u,
+                       handle_unbound_socket);
+    }
+    unbound_state = NULL;
+
+    if (g_args.debug && !trace->unbound.empty())
+        fprintf(g_log, "Lost %zu UDP sockets closed before their port was "
+                       "found\n",
+                trace->unbound.size());
+    trace->unbound.clear();
+}
+
+/* Reads every record waiting in the ring buffer into the owners of ctx.
+ * Returns the number of records read. */
+static int sock_trace_read(struct sock_trace *trace,
+                           struct sock_trace_state *ctx) {
+    int records = bpf_ringbuf_consume(&trace->ringbuf, handle_record, ctx);
+    if (!ctx->unbound.empty()) find_unbound_sockets(ctx);
+
+    return records;
+}
+
+void sock_trace_loop() {
+    struct sock_trace trace;
+    if (sock_trace_open(&trace) < 0) {
+        fprintf(g_log, "Sockets will only be found through /proc\n");
+        return;
+    }
+
+    struct sock_trace_state ctx;
+    while (1) {
+        if (sock_trace_read(&trace, &ctx) > 0) {
+            if (!ctx.owners.empty())
+                request_socket_owners(ctx.owners.data(), ctx.owners.size());
+            ctx.owners.clear();
+            continue;
+        }
+
+        if (bpf_ringbuf_poll(&trace.ringbuf, -1) < 0 && errno != EINTR) {
+            fprintf(g_log, "Polling socket trace ring buffer failed: %s\n",
+                    strerror(errno));
+            break;
+        }
+    }
+
+    if (ctx.diag_fd >= 0) close(ctx.diag_fd);
+    sock_trace_close(&trace);
+}
+
+/* Reports whether the owner of the socket on the local port, and for TCP the
+ * remote one, was traced as comm */
+static bool check_owner(const std::vector<struct socket_owner> &owners,
+                        const char *what, int protocol, uint16_t local_port,
+                        uint16_t remote_port, const char *comm) {
+    for (const struct socket_owner &owner : owners) {
+        if (owner.protocol != protocol || owner.key.local_port != local_port)
+            continue;
+        if (protocol == IPPROTO_TCP && owner.key.remote_port != remote_port)
+            continue;
+
+        bool same = strcmp(owner.comm, comm) == 0;
+        fprintf(g_log, "  %s: %s %s\n", what,
+                same ? "traced as" : "FAILED, traced as", owner.comm);
+        return same;
+    }
+
+    fprintf(g_log, "  %s: FAILED, not traced\n", what);
+    return false;
+}
+
+int sock_trace_check() {
+    struct sock_trace trace;
+    if (sock_trace_open(&trace) < 0) return -1;
+
+    char comm[16] = {0};
+    prctl(PR_GET_NAME, comm);
+
+    struct sockaddr_in loopback;
+    memset(&loopback, 0, sizeof(loopback));
+    loopback.sin_family = AF_INET;
+    loopback.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    /* A TCP connection to ourselves, and a single datagram sent from a
+     * socket closed right after like a one-shot DNS client would */
+    struct sockaddr_in server, client, receiver, sender;
+    socklen_t len = sizeof(struct sockaddr_in);
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int client_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int receive_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int send_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int accept_fd = -1;
+
+    bool opened =
+        bind(listen_fd, (struct sockaddr *)&loopback, len) == 0 &&
+        listen(listen_fd, 1) == 0 &&
+        getsockname(listen_fd, (struct sockaddr *)&server, &len) == 0 &&
+        connect(client_fd, (struct sockaddr *)&server, len) == 0 &&
+        (accept_fd = accept(listen_fd, NULL, NULL)) >= 0 &&
+        getsockname(client_fd, (struct sockaddr *)&client, &len) == 0 &&
+        bind(receive_fd, (struct sockaddr *)&loopback, len) == 0 &&
+        getsockname(receive_fd, (struct sockaddr *)&receiver, &len) == 0 &&
+        sendto(send_fd, "omnis", 5, 0, (struct sockaddr *)&receiver, len) ==
+            5 &&
+        getsockname(send_fd, (struct sockaddr *)&sender, &len) == 0;
+    if (!opened)
+        fprintf(g_log, "Could not open loopback sockets: %s\n",
+                strerror(errno));
+
+    close(send_fd);
+
+    /* Established callbacks may come in a little after the calls return */
+    struct sock_trace_state ctx;
+    for (int i = 0; opened && i < 5; i++) {
+        bpf_ringbuf_poll(&trace.ringbuf, 100);
+        sock_trace_read(&trace, &ctx);
+    }
+
+    int passed = 0;
+    if (opened) {
+        uint16_t server_port = ntohs(server.sin_port);
+        uint16_t client_port = ntohs(client.sin_port);
+
+        fprintf(g_log, "Checking sockets traced for %s:\n", comm);
+        passed += check_owner(ctx.owners, "outgoing tcp connection",
+                              IPPROTO_TCP, client_port, server_port, comm);
+        passed += check_owner(ctx.owners, "accepted tcp connection",
+                              IPPROTO_TCP, server_port, client_port, comm);
+        passed += check_owner(ctx.owners, "udp datagram", IPPROTO_UDP,
+                              ntohs(sender.sin_port), 0, comm);
+    }
+
+    if (accept_fd >= 0) close(accept_fd);
+    close(listen_fd);
+    close(client_fd);
+    close(receive_fd);
+    if (ctx.diag_fd >= 0) close(ctx.diag_fd);
+    sock_trace_close(&trace);
+
+    return passed == 3 ? 0 : -1;
+}
+
+void sock_trace_close(struct sock_trace *trace) {
+    bpf_ringbuf_close(&trace->ringbuf);
+
+    for (int i = 0; i < SOCK_TRACE_PROGS; i++) {
+        if (trace->link_fds[i] >= 0) close(trace->link_fds[i]);
+        if (trace->prog_fds[i] >= 0) close(trace->prog_fds[i]);
+        trace->link_fds[i] = trace->prog_fds[i] = -1;
+    }
+
+    if (trace->ringbuf_fd >= 0) close(trace->ringbuf_fd);
+    if (trace->sent_fd >= 0) close(trace->sent_fd);
+    if (trace->cgroup_fd >= 0) close(trace->cgroup_fd);
+
+    trace->ringbuf_fd = trace->sent_fd = trace->cgroup_fd = -1;
+}
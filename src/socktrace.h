@@ -0,0 +1,90 @@
+#ifndef SOCKTRACE_H
+#define SOCKTRACE_H
+
+#include <stdint.h>
+
+#include "bpf.h"
+#include "packet.h"
+
+/* Socket ownership tracing. Even looking single flows up races against
+ * processes that open a socket, send and close it again before the refresh
+ * thread gets to read their file descriptors. Small BPF programs attached to
+ * the root cgroup see sockets in the context of the process using them
+ * instead, when it connects, binds or first sends on an unconnected UDP
+ * socket. A sock_ops program adds the full addresses once a TCP connection
+ * is established either way. Each writes a record into a BPF ring buffer,
+ * and the records of a socket are joined by its cookie, or for accepted
+ * connections by the port of the listening socket, into owners the refresh
+ * thread adds to the map.
+ *
+ * The kernel normally binds a UDP socket before its first send is seen. One
+ * that is still unbound has its local port looked up by cookie over
+ * sock_diag right after, which misses it only if it was closed by then.
+ * --check-trace-sockets checks all of this on loopback sockets.
+ *
+ * The programs are built by hand like the XDP one, without libbpf. Without
+ * BPF, cgroup v2 or the privileges for them, sockets are only found through
+ * /proc as before. */
+
+/* What a record was written for */
+enum sock_trace_event {
+    SOCK_TRACE_CONNECT, /* connect(), the local port is usually not set yet */
+    SOCK_TRACE_SENDMSG, /* first sendmsg() of an unconnected UDP socket */
+    SOCK_TRACE_BIND,    /* bind(), only the local side is set */
+    SOCK_TRACE_ACTIVE,  /* outgoing TCP connection established, no process */
+    SOCK_TRACE_PASSIVE, /* incoming TCP connection established, no process */
+};
+
+/* Layout of each record the programs write into the ring buffer. Fields are
+ * copied as the kernel hands them over, sock_trace_key() converts them. */
+struct sock_trace_record {
+    uint64_t cookie;   /* socket cookie, the same for every event of a socket */
+    uint64_t pid_tgid; /* tgid << 32 | pid, 0 outside of process context */
+    uint64_t cgroup_id; /* cgroup v2 id of the process, 0 likewise */
+    char comm[16];      /* comm of the process, empty likewise */
+    uint32_t local_ip4; /* network order */
+    uint32_t remote_ip4;
+    uint32_t local_ip6[4];
+    uint32_t remote_ip6[4];
+    uint32_t local_port;  /* host order */
+    uint32_t remote_port; /* network order, shifted up 16 bits by sock_ops */
+    uint32_t family;      /* AF_INET or AF_INET6 */
+    uint32_t protocol;    /* IPPROTO_* */
+    uint32_t event;       /* enum sock_trace_event */
+    uint32_t pad;
+};
+
+/* Programs and the cgroup hooks they are attached to */
+const int SOCK_TRACE_PROGS = 7;
+
+struct sock_trace {
+    int cgroup_fd;                    /* root of the cgroup v2 hierarchy */
+    int ringbuf_fd;                   /* ring buffer map records go into */
+    int sent_fd;                      /* lru map of UDP sockets that sent */
+    int prog_fds[SOCK_TRACE_PROGS];   /* loaded programs */
+    int link_fds[SOCK_TRACE_PROGS];   /* links attaching them */
+    struct bpf_ringbuf ringbuf;       /* our mapping of ringbuf_fd */
+};
+
+/* Loads the programs and attaches them to the root cgroup. Returns 0 on
+ * success, -1 on failure with the reason written to g_log. */
+int sock_trace_open(struct sock_trace *trace);
+
+/* Converts the addresses and ports of a record into key */
+void sock_trace_key(const struct sock_trace_record *record,
+                    struct flow_key *key);
+
+/* Opens the tracer and hands the owners of traced sockets to the refresh
+ * thread with request_socket_owners(). Never returns unless opening or
+ * polling the ring buffer fails. */
+void sock_trace_loop();
+
+/* Detaches the programs and releases the ring buffer. */
+void sock_trace_close(struct sock_trace *trace);
+
+/* Opens the tracer, makes a TCP connection and sends a single UDP packet
+ * over loopback, and checks that the owners traced for them are this process.
+ * Reports every check to g_log. Returns 0 if all of them passed, -1 if not. */
+int sock_trace_check();
+
+#endif
@@ -0,0 +1,245 @@
+#include "xdp.h"
+
+#include <errno.h>
+#include <linux/if_link.h>
+#include <net/if.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include "bpf_insn.h"
+#include "omnis.h"
+
+/* Frames are copied in the largest of these sizes that fits inside of them.
+ * Each must be a multiple of 8 since the copy is done 8 bytes at a time. The
+ * packet handler needs every header up to the end of the transport header,
+ * which the largest covers even in the worst case of HEADER_SNAPLEN. The
+ * steps below keep the common frames whole: 80 an IPv6 TCP header behind a
+ * vlan tag (78), 64 an IPv6 UDP one (62) and 56 an IPv4 TCP one (54) in a
+ * minimum sized 60 byte ethernet frame. 48 is left for IPv4 UDP (42), which
+ * only shows up in frames that short on loopback. */
+static const int XDP_SNAP_SIZES[] = {192, 128, 96, 80, 64, 56, 48};
+
+/* Builds the XDP program. In pseudo C it is:
+ *
+ *   len = data_end - data;
+ *   for (size in XDP_SNAP_SIZES) {
+ *       if (data + size > data_end) continue;
+ *       record = bpf_ringbuf_reserve(ringbuf, 8 + size, 0);
+ *       if (!record) { stats[0]++; break; }
+ *       record->len = len; record->caplen = size;
+ *       memcpy(record->data, data, size);
+ *       bpf_ringbuf_submit(record, 0);
+ *       break;
+ *   }
+ *   return XDP_PASS;
+ */
+static bpf_prog build_xdp_program(int ringbuf_fd, int stats_fd) {
+    bpf_prog prog;
+    std::vector<size_t> to_pass, to_drop;
+
+    /* r7 = data, r8 = data_end, r9 = frame length */
+    bpf_load(prog, BPF_W, BPF_REG_7, BPF_REG_1, offsetof(struct xdp_md, data));
+    bpf_load(prog, BPF_W, BPF_REG_8, BPF_REG_1,
+             offsetof(struct xdp_md, data_end));
+    bpf_mov_reg(prog, BPF_REG_9, BPF_REG_8);
+    bpf_alu_reg(prog, BPF_SUB, BPF_REG_9, BPF_REG_7);
+
+    for (int size : XDP_SNAP_SIZES) {
+        bpf_mov_reg(prog, BPF_REG_1, BPF_REG_7);
+        bpf_alu_imm(prog, BPF_ADD, BPF_REG_1, size);
+        size_t too_short = bpf_jump_reg(prog, BPF_JGT, BPF_REG_1, BPF_REG_8, 0);
+
+        bpf_load_map_fd(prog, BPF_REG_1, ringbuf_fd);
+        bpf_mov_imm(prog, BPF_REG_2, sizeof(struct xdp_record) + size);
+        bpf_mov_imm(prog, BPF_REG_3, 0);
+        bpf_call(prog, BPF_FUNC_ringbuf_reserve);
+        to_drop.push_back(bpf_jump_imm(prog, BPF_JEQ, BPF_REG_0, 0, 0));
+
+        bpf_store_reg(prog, BPF_W, BPF_REG_0, BPF_REG_9,
+                      offsetof(struct xdp_record, len));
+        bpf_store_imm(prog, BPF_W, BPF_REG_0,
+                      offsetof(struct xdp_record, caplen), size);
+        for (int i = 0; i < size; i += 8) {
+            bpf_load(prog, BPF_DW, BPF_REG_1, BPF_REG_7, i);
+            bpf_store_reg(prog, BPF_DW, BPF_REG_0, BPF_REG_1,
+                          sizeof(struct xdp_record) + i);
+        }
+
+        bpf_mov_reg(prog, BPF_REG_1, BPF_REG_0);
+        bpf_mov_imm(prog, BPF_REG_2, 0);
+        bpf_call(prog, BPF_FUNC_ringbuf_submit);
+        to_pass.push_back(bpf_jump(prog, 0));
+
+        bpf_patch_jump(prog, too_short);
+    }
+    /* Frames smaller than every snap size can't be a TCP or UDP packet */
+    to_pass.push_back(bpf_jump(prog, 0));
+
+    /* The ring buffer is full, count the lost frame in stats[0] */
+    for (size_t jump : to_drop) bpf_patch_jump(prog, jump);
+    bpf_store_imm(prog, BPF_W, BPF_REG_10, -4, 0);
+    bpf_load_map_fd(prog, BPF_REG_1, stats_fd);
+    bpf_mov_reg(prog, BPF_REG_2, BPF_REG_10);
+    bpf_alu_imm(prog, BPF_ADD, BPF_REG_2, -4);
+    bpf_call(prog, BPF_FUNC_map_lookup_elem);
+    to_pass.push_back(bpf_jump_imm(prog, BPF_JEQ, BPF_REG_0, 0, 0));
+    bpf_mov_imm(prog, BPF_REG_1, 1);
+    bpf_atomic_add(prog, BPF_REG_0, BPF_REG_1, 0);
+
+    for (size_t jump : to_pass) bpf_patch_jump(prog, jump);
+    bpf_mov_imm(prog, BPF_REG_0, XDP_PASS);
+    bpf_exit(prog);
+
+    return prog;
+}
+
+int xdp_open(struct xdp *xdp, const char *device_name, unsigned int ring_size,
+             bool native) {
+    memset(xdp, 0, sizeof(struct xdp));
+    xdp->prog_fd = xdp->link_fd = xdp->ringbuf_fd = xdp->stats_fd = -1;
+
+    unsigned int ifindex = if_nametoindex(device_name);
+    if (ifindex == 0) {
+        fprintf(g_log, "Could not find interface index for device %s: %s\n",
+                device_name, strerror(errno));
+        return -1;
+    }
+
+    /* Ring buffer maps must be a power of 2 in size */
+    size_t size = 1 << 20;
+    while (size < (size_t)ring_size << 20) size <<= 1;
+
+    xdp->ringbuf_fd =
+        bpf_create_map(BPF_MAP_TYPE_RINGBUF, 0, 0, size, "omnis_frames");
+    xdp->stats_fd = bpf_create_map(BPF_MAP_TYPE_ARRAY, sizeof(uint32_t),
+                                   sizeof(uint64_t), 1, "omnis_xdp_stats");
+    if (xdp->ringbuf_fd < 0 || xdp->stats_fd < 0) {
+        fprintf(g_log,
+                "Could not create XDP ring buffer for device %s, BPF ring "
+                "buffers need Linux 5.8+: %s\n",
+                device_name, strerror(errno));
+        xdp_close(xdp);
+        return -1;
+    }
+
+    bpf_prog prog = build_xdp_program(xdp->ringbuf_fd, xdp->stats_fd);
+
+    static char log[65536];
+    xdp->prog_fd = bpf_load_program(BPF_PROG_TYPE_XDP, 0, prog.data(),
+                                    prog.size(), "omnis_xdp", log, sizeof(log));
+    if (xdp->prog_fd < 0) {
+        fprintf(g_log, "Could not load XDP program: %s\n%s\n", strerror(errno),
+                log);
+        xdp_close(xdp);
+        return -1;
+    }
+
+    /* A link detaches the program as soon as omnis exits, unlike attaching
+     * over netlink which leaves it on the interface. */
+    xdp->link_fd =
+        bpf_create_link(xdp->prog_fd, ifindex, BPF_XDP,
+                        native ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE);
+    if (xdp->link_fd < 0) {
+        fprintf(g_log,
+                "Could not attach XDP program to device %s in %s mode: %s\n",
+                device_name, native ? "native" : "generic", strerror(errno));
+        xdp_close(xdp);
+        return -1;
+    }
+
+    if (bpf_ringbuf_open(&xdp->ringbuf, xdp->ringbuf_fd, size) < 0) {
+        fprintf(g_log, "Could not mmap XDP ring buffer for device %s: %s\n",
+                device_name, strerror(errno));
+        xdp_close(xdp);
+        return -1;
+    }
+
+    if (g_args.debug)
+        fprintf(g_log,
+                "Attached XDP program to %s in %s mode with a %zu byte ring "
+                "buffer\n",
+                device_name, native ? "native" : "generic", size);
+
+    return 0;
+}
+
+unsigned long long xdp_update_stats(struct xdp *xdp) {
+    uint32_t key = 0;
+    uint64_t drops = 0;
+
+    if (bpf_lookup_elem(xdp->stats_fd, &key, &drops) < 0) return 0;
+
+    unsigned long long dropped = drops - xdp->drops;
+    xdp->drops = drops;
+
+    return dropped;
+}
+
+struct xdp_consume_ctx {
+    xdp_handler handler;
+    u_char *args;
+    struct timeval ts;
+};
+
+static void handle_record(void *ctx, const uint8_t *data, uint32_t len) {
+    struct xdp_consume_ctx *consume = (struct xdp_consume_ctx *)ctx;
+    const struct xdp_record *record = (const struct xdp_record *)data;
+
+    if (len < sizeof(struct xdp_record)) return;
+
+    consume->handler(consume->args, &consume->ts, record->data,
+                     record->caplen, record->len);
+}
+
+int xdp_loop(struct xdp *xdp, xdp_handler handler, xdp_flush_handler flush,
+             u_char *args) {
+    struct xdp_consume_ctx ctx;
+    ctx.handler = handler;
+    ctx.args = args;
+
+    time_t last_stats = std::time(NULL);
+    while (1) {
+        time_t now = std::time(NULL);
+        if (now - last_stats >= g_args.interval) {
+            unsigned long long dropped = xdp_update_stats(xdp);
+            if (dropped)
+                fprintf(g_log,
+                        "XDP ring buffer dropped %llu frames in the last %lds "
+                        "(%llu total)\n",
+                        dropped, (long)(now - last_stats), xdp->drops);
+
+            last_stats = now;
+        }
+
+        /* Records carry no timestamp, all frames read in one pass share the
+         * time they were read at. */
+        gettimeofday(&ctx.ts, NULL);
+        if (bpf_ringbuf_consume(&xdp->ringbuf, handle_record, &ctx) > 0) {
+            flush(args);
+            continue;
+        }
+
+        if (bpf_ringbuf_poll(&xdp->ringbuf, g_args.interval * 1000) < 0 &&
+            errno != EINTR) {
+            fprintf(g_log, "Polling XDP ring buffer failed: %s\n",
+                    strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void xdp_close(struct xdp *xdp) {
+    bpf_ringbuf_close(&xdp->ringbuf);
+
+    if (xdp->link_fd >= 0) close(xdp->link_fd);
+    if (xdp->prog_fd >= 0) close(xdp->prog_fd);
+    if (xdp->ringbuf_fd >= 0) close(xdp->ringbuf_fd);
+    if (xdp->stats_fd >= 0) close(xdp->stats_fd);
+
+    xdp->link_fd = xdp->prog_fd = xdp->ringbuf_fd = xdp->stats_fd = -1;
+}
@@ -0,0 +1,63 @@
+#ifndef XDP_H
+#define XDP_H
+
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "bpf.h"
+
+/* XDP header capture. A small XDP program copies the first bytes of every
+ * frame (enough for the L2-L4 headers) along with the frame length into a
+ * BPF ring buffer and lets the frame continue with XDP_PASS, so the rest of
+ * the stack is unaffected. omnis polls the shared ring buffer and dissects
+ * the headers in place.
+ *
+ * An AF_XDP socket is not used on purpose: frames redirected into one are
+ * consumed by it and would never reach the applications we are monitoring.
+ *
+ * Generic (SKB) mode works on any interface including veth pairs, native
+ * mode requires driver support. */
+
+/* Layout of each record the XDP program writes into the ring buffer */
+struct xdp_record {
+    uint32_t len;    /* length of the frame on the wire */
+    uint32_t caplen; /* number of bytes copied into data */
+    uint8_t data[];  /* start of the frame, beginning at the L2 header */
+};
+
+/* Called for every captured frame, frame points into the ring buffer and is
+ * only valid for the duration of the call. */
+typedef void (*xdp_handler)(u_char *args, const struct timeval *ts,
+                            const u_char *frame, unsigned int caplen,
+                            unsigned int len);
+
+struct xdp {
+    int prog_fd;                   /* loaded XDP program */
+    int link_fd;                   /* link attaching the program */
+    int ringbuf_fd;                /* ring buffer map frames are copied into */
+    int stats_fd;                  /* array map counting ring buffer drops */
+    struct bpf_ringbuf ringbuf;    /* our mapping of ringbuf_fd */
+    unsigned long long drops;      /* frames lost to a full ring buffer */
+};
+
+/* Loads and attaches the XDP program to the device with a ring buffer of
+ * ring_size MiB. The program runs in generic mode unless native is set.
+ * Returns 0 on success, -1 on failure with the reason written to g_log. */
+int xdp_open(struct xdp *xdp, const char *device_name, unsigned int ring_size,
+             bool native);
+
+/* Called once every frame currently in the ring buffer has been handled */
+typedef void (*xdp_flush_handler)(u_char *args);
+
+/* Polls the ring buffer and calls handler for every frame, then flush once
+ * the ring buffer is drained. Never returns unless polling fails. */
+int xdp_loop(struct xdp *xdp, xdp_handler handler, xdp_flush_handler flush,
+             u_char *args);
+
+/* Returns the number of frames dropped since the last call. */
+unsigned long long xdp_update_stats(struct xdp *xdp);
+
+/* Detaches the program and releases the ring buffer. */
+void xdp_close(struct xdp *xdp);
+
+#endif